@@ -70,6 +70,8 @@ void App::onInit() {
     
     showRenderingStats      = false;
 
+    m_caustics = std::make_shared<CausticAtlas>();
+
     makeGUI();
     // For higher-quality screenshots:
     // developerWindow->videoRecordDialog->setScreenShotFormat("PNG");
@@ -140,50 +142,128 @@ void App::makeGUI() {
     interfacePane->addNumberBox("Rays per pixel", &m_options.raysPerPixel, "rays", GuiTheme::NO_SLIDER, 0, 10000, 1);
     interfacePane->addNumberBox("Max ray depth", &m_options.maxRayDepth, "", GuiTheme::NO_SLIDER, 0, 10000, 1);
     interfacePane->addCheckBox("Halve camera sensitivity", &m_options.lowerCameraSensitivity);
-    interfacePane->addButton("Render Picture", [this](){
+    interfacePane->addCheckBox("Trace particles", &m_options.traceParticles);
+    interfacePane->addNumberBox("Tile size", &m_options.tileSize, "px", GuiTheme::NO_SLIDER, 0, 512, 8);
+    interfacePane->addCheckBox("Adaptive sampling", &m_options.adaptiveSampling);
+    interfacePane->addNumberBox("Min rays per pixel", &m_options.minRaysPerPixel, "rays", GuiTheme::NO_SLIDER, 1, 10000, 1);
+    interfacePane->addNumberBox("Noise threshold", &m_options.noiseThreshold, "", GuiTheme::LOG_SLIDER, 0.001f, 0.5f);
+    interfacePane->addCheckBox("Russian roulette", &m_options.russianRoulette);
+    interfacePane->addNumberBox("Caustic photons", &m_options.causticPhotons, "", GuiTheme::NO_SLIDER, 0, 10000000, 10000);
+    interfacePane->addNumberBox("Photon radius", &m_options.photonRadius, "m", GuiTheme::LOG_SLIDER, 0.005f, 0.5f);
+    interfacePane->addCheckBox("Bilinear caustics", &m_caustics->options().bilinear);
+    Array<String> backendLabels = {"TriTree", "WideBVH"};
+    interfacePane->addDropDownList("Intersection", backendLabels, (int*) &m_options.intersectionBackend);
+    interfacePane->addCheckBox("Denoise", &m_denoiser.options().enabled);
+    interfacePane->addNumberBox("Denoise iterations", &m_denoiser.options().iterations, "", GuiTheme::NO_SLIDER, 1, 10, 1);
+    interfacePane->addCheckBox("Temporal accumulation", &m_temporal.options().enabled);
+    interfacePane->addButton("Compare denoising", [this](){
+        if (notNull(m_render)) {
+            return;
+        }
         drawMessage("Rendering...");
-        Point2 dimensions;
-        if (m_options.resolution == pixel) {
-            dimensions = Point2(1,1);
-        } else if (m_options.resolution == verysmall) {
-            dimensions = Point2(10,10);
-        } else if (m_options.resolution == small) {
-            dimensions = Point2(100,100);
-        } else if (m_options.resolution == medium) {
-            dimensions = Point2(320,200);
-        } else if (m_options.resolution == large) {
-             dimensions = Point2(640,400);
-        } else if (m_options.resolution == vLarge) {
-             dimensions = Point2(1280,720);
+        compareDenoising();
+    });
+    interfacePane->addButton("Render Picture", [this](){
+        startRender();
+    });
+    interfacePane->addButton("Stop Render", [this](){
+        if (notNull(m_render)) {
+            m_render->tracer->cancel();
         }
-        shared_ptr<Texture> dst;
-        float renderTime = traceImage(dst, dimensions);
-        show(dst, format("Rendering Time: %f ", renderTime));
     });
 
     interfacePane->addNumberBox("Video length", &videoLength, "s", GuiTheme::NO_SLIDER, 0, 10000, 1);
     interfacePane->addButton("Render Video", [this](){
-        Point2 dimensions;
-        if (m_options.resolution == pixel) {
-            dimensions = Point2(1,1);
-        } else if (m_options.resolution == verysmall) {
-            dimensions = Point2(10,10);
-        } else if (m_options.resolution == small) {
-            dimensions = Point2(100,100);
-        } else if (m_options.resolution == medium) {
-            dimensions = Point2(320,200);
-        } else if (m_options.resolution == large) {
-             dimensions = Point2(640,400);
-        } else if (m_options.resolution == vLarge) {
-             dimensions = Point2(1280,720);
+        if (notNull(m_render)) {
+            return;
         }
+        const Point2& dimensions = resolutionDimensions();
         m_videoRecorder.startRecording(dimensions, m_options.name, videoLength);
+        m_temporal.clear();
     });
 
      interfacePane->addButton("Stop Video", [this](){
         m_videoRecorder.numFrames = 1;
     });
 
+    interfacePane->addButton("Benchmark traversal", [this](){
+        // Camera rays through the pixel centers at 640x400, against the static level, lit by the first light
+        if (notNull(m_render)) {
+            return;
+        }
+        m_sceneTrees->update(scene(), {"water"});
+        const Rect2D& bounds = Rect2D::xywh(0, 0, 640, 400);
+        Array<Ray> cameraRays;
+        for (int y = 0; y < int(bounds.height()); ++y) {
+            for (int x = 0; x < int(bounds.width()); ++x) {
+                cameraRays.append(activeCamera()->worldRay(x + 0.5f, y + 0.5f, bounds));
+            }
+        }
+        const Array<shared_ptr<Light>>& lights = scene()->lightingEnvironment().lightArray;
+        const Point3& light = (lights.size() > 0) ? lights[0]->position().xyz() : activeCamera()->frame().translation;
+
+        const String& report = WideBVH::benchmark(m_sceneTrees->level(SceneTree::STATIC).tris, cameraRays, light);
+        debugPrintf("%s", report.c_str());
+        logPrintf("%s", report.c_str());
+    });
+
+    GuiPane* meshingPane = debugPane->addPane("Meshing");
+    meshingPane->addCheckBox("Parallel", &m_waterModel.meshOptions.parallel);
+    Array<String> kernelLabels;
+    for (int impl = FieldKernel::SCALAR; impl <= FieldKernel::best(); ++impl) {
+        kernelLabels.append(FieldKernel::name(FieldKernel::Implementation(impl)));
+    }
+    meshingPane->addDropDownList("Field kernel", kernelLabels, (int*) &m_waterModel.meshOptions.fieldKernel);
+    Array<String> fieldLabels = {"Sphere distance", "Anisotropic kernel"};
+    meshingPane->addDropDownList("Field", fieldLabels, (int*) &m_waterModel.meshOptions.field);
+    Array<String> extractorLabels = {"Marching cubes", "Surface nets"};
+    meshingPane->addDropDownList("Extractor", extractorLabels, (int*) &m_waterModel.meshOptions.extractor);
+    meshingPane->addNumberBox("Kernel step", &anisotropicStepRatio, "", GuiTheme::LINEAR_SLIDER, 0.25f, 2.0f);
+    meshingPane->addCheckBox("Skip interior", &m_waterModel.meshOptions.skipInteriorParticles);
+    meshingPane->addCheckBox("Incremental", &m_waterModel.meshOptions.incremental);
+    meshingPane->addCheckBox("Adaptive", &m_waterModel.meshOptions.adaptive);
+    meshingPane->addNumberBox("Pixel error", &m_waterModel.meshOptions.pixelError, "px", GuiTheme::LOG_SLIDER, 0.25f, 16.0f);
+    meshingPane->addCheckBox("Cull to view", &m_waterModel.meshOptions.frustumCulling);
+    meshingPane->addNumberBox("Preview margin", &previewCullMargin, "m", GuiTheme::LINEAR_SLIDER, 0.0f, 5.0f);
+    meshingPane->addNumberBox("Render margin", &renderCullMargin, "m", GuiTheme::LINEAR_SLIDER, 0.0f, 10.0f);
+    meshingPane->addCheckBox("Decimate", &m_waterModel.decimateOptions.enabled);
+    meshingPane->addNumberBox("Keep", &m_waterModel.decimateOptions.targetRatio, "", GuiTheme::LINEAR_SLIDER, 0.05f, 1.0f);
+    meshingPane->addNumberBox("Max error", &m_waterModel.decimateOptions.maxError, "steps", GuiTheme::LOG_SLIDER, 0.01f, 1.0f);
+    meshingPane->addCheckBox("Record frames", &m_recordParticleFrames);
+    meshingPane->addButton("Benchmark", [this, extractorLabels](){
+        Array<Array<Point3>> frames;
+        MesherBenchmark::loadFrames(frames);
+        String report = MesherBenchmark::benchmarkFieldKernels(frames, waterRadius, waterRadius * stepRatio);
+        report += MesherBenchmark::benchmarkExtractors(frames, waterRadius, waterRadius * stepRatio);
+
+        // Path trace the last frame meshed by each extractor, including the TriTree build, since that is where the triangles cost
+        if (frames.size() > 0) {
+            const MCubes::Extractor extractor = m_waterModel.meshOptions.extractor;
+            Array<Vector3> livePositions = m_waterModel.particlePositions;
+            const float liveRadius = m_waterModel.particleRadius;
+            const float liveStep = m_waterModel.particleStep;
+            for (int e = MCubes::MARCHING_CUBES; e <= MCubes::SURFACE_NETS; ++e) {
+                m_waterModel.meshOptions.extractor = MCubes::Extractor(e);
+                m_waterModel.addWaterToScene(frames.last(), scene(), waterRadius, waterRadius * stepRatio);
+
+                const shared_ptr<Image> img = Image::create(100, 100, ImageFormat::RGB32F());
+                Stopwatch clock;
+                clock.tick();
+                PathTracer tracer(scene(), activeCamera(), img, m_options, m_caustics, m_waterModel.foamInstances);
+                tracer.pathTrace();
+                clock.tock();
+                report += format("  %s path trace: %.3f s at 100x100\n", extractorLabels[e].c_str(), clock.elapsedTime());
+            }
+            m_waterModel.meshOptions.extractor = extractor;
+
+            // Put the simulation's own water back in the scene
+            m_waterModel.addWaterToScene(livePositions, scene(), liveRadius, liveStep);
+        }
+
+        debugPrintf("%s", report.c_str());
+        logPrintf("%s", report.c_str());
+    });
+
     if (false) {
         developerWindow->profilerWindow->setVisible(true);
         Profiler::setEnabled(true);
@@ -193,32 +273,224 @@ void App::makeGUI() {
     debugWindow->setRect(Rect2D::xywh(0, 0, (float)window()->width(), debugWindow->rect().height()));
 }
 
+Point2 App::resolutionDimensions() const {
+    Point2 dimensions;
+    if (m_options.resolution == pixel) {
+        dimensions = Point2(1,1);
+    } else if (m_options.resolution == verysmall) {
+        dimensions = Point2(10,10);
+    } else if (m_options.resolution == small) {
+        dimensions = Point2(100,100);
+    } else if (m_options.resolution == medium) {
+        dimensions = Point2(320,200);
+    } else if (m_options.resolution == large) {
+         dimensions = Point2(640,400);
+    } else if (m_options.resolution == vLarge) {
+         dimensions = Point2(1280,720);
+    }
+    return dimensions;
+}
+
+void App::setMeshView(const Point2& dimensions, float cullMargin) {
+    const shared_ptr<Camera>& camera = activeCamera();
+    const float fovPixels = (camera->fieldOfViewDirection() == FOVDirection::HORIZONTAL) ? dimensions.x : dimensions.y;
+    m_waterModel.meshOptions.view.position = camera->frame().translation;
+    m_waterModel.meshOptions.view.pixelsPerRadian = 0.5f * fovPixels / tan(0.5f * camera->fieldOfViewAngle());
+    camera->getClipPlanes(Rect2D::xywh(0.0f, 0.0f, dimensions.x, dimensions.y), m_waterModel.meshOptions.view.clipPlanes);
+    m_waterModel.meshOptions.cullMargin = cullMargin;
+}
+
+void App::meshWaterForRender(const Point2& dimensions) {
+    // Traced particles have no mesh, and a frame with no water has nothing to mesh
+    if (m_options.traceParticles || (m_waterModel.particlePositions.size() == 0)) {
+        return;
+    }
+    setMeshView(dimensions, renderCullMargin);
+    Array<Vector3> points = m_waterModel.particlePositions;
+    m_waterModel.addWaterToScene(points, scene(), m_waterModel.particleRadius, m_waterModel.particleStep);
+}
+
+void App::compareDenoising() {
+    const Point2& dimensions = resolutionDimensions();
+    meshWaterForRender(dimensions);
+    const PathTracer::Options saved = m_options;
+    m_options.adaptiveSampling = false;
+    m_options.writeImage = false;
+    m_options.time = m_time;
+    const shared_ptr<Image> img = Image::create(int(dimensions.x), int(dimensions.y), ImageFormat::RGB32F());
+
+    // Returns the time that the path trace took
+    const auto render = [&](int raysPerPixel, Array<Radiance3>& radiance, DenoiseBuffers& buffers) {
+        m_options.raysPerPixel = raysPerPixel;
+        PathTracer tracer(scene(), activeCamera(), img, m_options, m_caustics, m_waterModel.foamInstances, nullptr, m_sceneTrees);
+        Stopwatch clock;
+        clock.tick();
+        tracer.pathTrace();
+        clock.tock();
+        Array<Radiance3>::swap(radiance, tracer.framebuffer());
+        buffers = tracer.denoiseBuffers();
+        return clock.elapsedTime();
+    };
+
+    // Far more rays than any of the images compared, so that its own noise hardly counts
+    const int referenceRays = 128;
+    Array<Radiance3> reference;
+    DenoiseBuffers buffers;
+    const RealTime referenceTime = render(referenceRays, reference, buffers);
+    String report = format("Denoising at %dx%d, %d iterations, RMSE against %d rays per pixel (%.2f s):\n",
+        int(dimensions.x), int(dimensions.y), m_denoiser.options().iterations, referenceRays, referenceTime);
+
+    for (const int raysPerPixel : {4, 8, 32}) {
+        Array<Radiance3> radiance;
+        const RealTime traceTime = render(raysPerPixel, radiance, buffers);
+        const float noisyError = Denoiser::rmse(radiance, reference);
+        m_denoiser.apply(radiance, buffers);
+        report += format("  %2d rays: traced in %6.2f s, RMSE %.4f, denoised in %.3f s, RMSE %.4f\n",
+            raysPerPixel, traceTime, noisyError, m_denoiser.time(), Denoiser::rmse(radiance, reference));
+    }
+
+    m_options = saved;
+    debugPrintf("%s", report.c_str());
+    logPrintf("%s", report.c_str());
+}
+
 float App::traceImage(shared_ptr<Texture>& dst, Point2 dimensions) {
     shared_ptr<Image> img = G3D::Image::create(dimensions.x, dimensions.y,ImageFormat::RGB32F());
 
-    // Select the caustic map to use
-    int num = int(m_videoRecorder.numFrames) % 32 + 1;
-    const shared_ptr<Image> causticMap = Image::fromFile(format("data-files/waterCaustic/waterCaustic_0%d%d.jpg",num / 10,num % 10));
-
-    // Start the path-tracer
-    PathTracer tracer = PathTracer(scene(), activeCamera(), img, m_options, causticMap);
+    shared_ptr<ParticleSurface> water;
+    const shared_ptr<PathTracer>& tracer = createTracer(img, activeCamera(), water);
     Stopwatch clock;
     clock.tick();
-    tracer.pathTrace();
+    tracer->pathTrace();
     clock.tock();
     float renderTime = clock.elapsedTime();
     debugPrintf("Rendering Time: %f\n", renderTime);
+
+    finishImage(*tracer, img, activeCamera(), dst);
+    return renderTime;
+}
+
+shared_ptr<PathTracer> App::createTracer(const shared_ptr<Image>& img, const shared_ptr<Camera>& camera, shared_ptr<ParticleSurface>& water, const std::function<void(const Rect2D&, int, int)>& onTileDone) {
+    // Trace the water particles directly instead of their mesh when requested
+    water = m_options.traceParticles ? m_waterModel.createParticleSurface() : nullptr;
+
+    // The caustics are animated by simulation time
+    m_options.time = m_time;
+    PathTracer::Options options = m_options;
+    options.onTileDone = onTileDone;
+
+    // finishImage writes the image once the framebuffer has been filtered
+    options.writeImage = false;
+    if (m_temporal.options().enabled) {
+        // Pixels that the last frame covers need only a few fresh rays
+        m_temporal.rayBudget(options.raysPerPixel, camera, options.pixelRayBudget);
+    }
+    return std::make_shared<PathTracer>(scene(), camera, img, options, m_caustics, m_waterModel.foamInstances, water.get(), m_sceneTrees);
+}
+
+void App::finishImage(PathTracer& tracer, const shared_ptr<Image>& img, const shared_ptr<Camera>& camera, shared_ptr<Texture>& dst) {
+    m_samplesPerPixel = Texture::fromImage("Rays per pixel", tracer.samplesPerPixelImage(), ImageFormat::RGB32F());
+
+    if (m_temporal.options().enabled) {
+        m_temporal.accumulate(tracer.framebuffer(), tracer.denoiseBuffers(), tracer.samplesPerPixel(), camera);
+        debugPrintf("Temporal reuse: %.1f%% of pixels\n", 100.0f * m_temporal.reuse());
+    }
+    if (m_denoiser.options().enabled) {
+        m_denoiser.apply(tracer.framebuffer(), tracer.denoiseBuffers());
+        debugPrintf("Denoising Time: %f\n", m_denoiser.time());
+    }
+    tracer.resolveImage();
     const shared_ptr<Texture>& src = Texture::fromImage("Source", img, ImageFormat::RGB32F());
 
     // post-process the image
-    m_film->exposeAndRender(renderDevice, activeCamera()->filmSettings(), src, 0, 0, dst);
+    m_film->exposeAndRender(renderDevice, camera->filmSettings(), src, 0, 0, dst);
     if (m_options.save) {
         const String name = format("%s%s", m_options.name, ".png");
         shared_ptr<Image> savedImage = dst->toImage(ImageFormat::RGB32F());
         savedImage->convert(ImageFormat::RGB8()); //have to convert the image back to RG8 which means a loss of precision.
         savedImage->save(name);
     }
-    return renderTime;
+}
+
+void App::startRender() {
+    // The scene trees are shared, so only one path trace may run at a time
+    if (notNull(m_render) || (m_videoRecorder.numFrames > 0)) {
+        return;
+    }
+    const Point2& dimensions = resolutionDimensions();
+    meshWaterForRender(dimensions);
+    m_render = std::make_shared<Render>();
+    m_render->image = Image::create(int(dimensions.x), int(dimensions.y), ImageFormat::RGB32F());
+    m_render->previewImage = Image::create(int(dimensions.x), int(dimensions.y), ImageFormat::RGB32F());
+    m_render->previewImage->setAll(Radiance3::black());
+    m_render->camera = Camera::create("Render camera");
+    m_render->camera->copyParametersFrom(activeCamera());
+
+    // Tiles finish on the tracer's threads, but textures can only be made on this one, so they are queued for updateRender
+    Render* render = m_render.get();
+    m_render->tracer = createTracer(m_render->image, m_render->camera, m_render->water, [render](const Rect2D& tile, int tilesDone, int tileCount) {
+        std::lock_guard<std::mutex> lock(render->tilesMutex);
+        render->finishedTiles.append(tile);
+    });
+
+    m_render->startTime = System::time();
+    m_render->thread = std::thread([render]() {
+        render->tracer->pathTrace();
+        render->done = true;
+    });
+}
+
+void App::updateRender(RenderDevice* rd) {
+    if (isNull(m_render)) {
+        return;
+    }
+
+    Array<Rect2D> tiles;
+    {
+        std::lock_guard<std::mutex> lock(m_render->tilesMutex);
+        Array<Rect2D>::swap(tiles, m_render->finishedTiles);
+    }
+    if (tiles.size() > 0) {
+        const Array<Radiance3>& framebuffer = m_render->tracer->framebuffer();
+        const int width = m_render->image->width();
+        const float scale = m_render->tracer->sensitivityScale();
+        for (const Rect2D& tile : tiles) {
+            for (int y = int(tile.y0()); y < int(tile.y1()); ++y) {
+                for (int x = int(tile.x0()); x < int(tile.x1()); ++x) {
+                    m_render->previewImage->set(Point2int32(x, y), framebuffer[x + y * width] * scale);
+                }
+            }
+        }
+        const shared_ptr<Texture>& src = Texture::fromImage("Preview", m_render->previewImage, ImageFormat::RGB32F());
+        m_film->exposeAndRender(rd, m_render->camera->filmSettings(), src, 0, 0, m_render->preview);
+    }
+
+    if (! m_render->done) {
+        return;
+    }
+    m_render->thread.join();
+    const float renderTime = float(System::time() - m_render->startTime);
+    debugPrintf("Rendering Time: %f\n", renderTime);
+    if (m_render->tracer->cancelled()) {
+        debugPrintf("Render stopped at %.0f%% of the tiles\n", 100.0f * m_render->tracer->progress());
+    } else {
+        shared_ptr<Texture> dst;
+        finishImage(*m_render->tracer, m_render->image, m_render->camera, dst);
+        show(dst, format("Rendering Time: %f ", renderTime));
+        if (m_options.adaptiveSampling && notNull(m_samplesPerPixel)) {
+            show(m_samplesPerPixel, "Rays per pixel");
+        }
+    }
+    m_render.reset();
+}
+
+void App::onCleanup() {
+    if (notNull(m_render)) {
+        m_render->tracer->cancel();
+        m_render->thread.join();
+        m_render.reset();
+    }
+    GApp::onCleanup();
 }
 
 // This default implementation is a direct copy of GApp::onGraphics3D to make it easy
@@ -278,6 +550,8 @@ void App::onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& allSurface
 
 
 
+    updateRender(rd);
+
     // Save videos from our path-tracer
     if (m_videoRecorder.numFrames > 0) {
         debugPrintf(format("\nRendering frame %d \n", m_videoRecorder.numFrames).c_str());
@@ -289,6 +563,10 @@ void App::onGraphics3D(RenderDevice* rd, Array<shared_ptr<Surface> >& allSurface
 
 
 void App::onSimulation(RealTime rdt, SimTime sdt, SimTime idt) {
+    // A render in flight reads the scene and its lights from its own thread, so everything holds still until it is done
+    if (notNull(m_render)) {
+        return;
+    }
     GApp::onSimulation(rdt, sdt, idt);
 	
 	if (m_skipAhead) {
@@ -299,11 +577,32 @@ void App::onSimulation(RealTime rdt, SimTime sdt, SimTime idt) {
 		m_skipAhead = false;
 	} else if (m_time > 1.0f && m_isSimulating){
         // Take one simulation step
+		const bool anisotropic = (m_waterModel.meshOptions.field == MCubes::ANISOTROPIC_KERNEL);
+		flex.g_readAnisotropy = anisotropic;
 		flex.flexStep();
 
         // Update the scene
 		Array<Vector3> points = flex.getWaterPositions();
-		m_waterModel.addWaterToScene(points, scene(), waterRadius, waterRadius * stepRatio);
+		if (m_recordParticleFrames) {
+		    MesherBenchmark::saveFrame(points, m_recordedFrameCount++);
+		}
+		if (anisotropic) {
+		    points = flex.getSmoothWaterPositions();
+		    flex.getWaterAnisotropy(m_waterModel.anisotropy.q1, m_waterModel.anisotropy.q2, m_waterModel.anisotropy.q3);
+		}
+		// Levels of detail and culling are chosen for the view that the water will be seen from, at the size it is path traced at while recording
+		if (m_videoRecorder.numFrames > 0) {
+		    setMeshView(m_videoRecorder.dimensions, renderCullMargin);
+		} else {
+		    setMeshView(Point2(float(window()->width()), float(window()->height())), previewCullMargin);
+		}
+		const float waterStep = waterRadius * (anisotropic ? anisotropicStepRatio : stepRatio);
+		if (m_options.traceParticles && (m_videoRecorder.numFrames > 0)) {
+		    // Recorded frames trace the particles directly, so there is nothing to mesh
+		    m_waterModel.setWaterParticles(points, waterRadius, waterStep);
+		} else {
+		    m_waterModel.addWaterToScene(points, scene(), waterRadius, waterStep);
+		}
 		Array<Vector4> Dpoints = flex.getDiffusePositions();
 		m_waterModel.addDiffuseToScene(Dpoints, scene(), diffuseRadius, diffuseRadius*stepRatio);
 	}
@@ -366,6 +665,28 @@ void App::onPose(Array<shared_ptr<Surface> >& surface, Array<shared_ptr<Surface2
 
 
 void App::onGraphics2D(RenderDevice* rd, Array<shared_ptr<Surface2D> >& posed2D) {
+    const MCubes::Stats& meshStats = m_waterModel.meshStats;
+    screenPrintf("Meshing: %d particles, %d interior skipped, %d cells visited", meshStats.particles, meshStats.skippedParticles, meshStats.visitedCells);
+    screenPrintf("Remeshing: %d particles moved, %d bricks remeshed, %d reused, %d culled", meshStats.movedParticles, meshStats.remeshedBricks, meshStats.reusedBricks, meshStats.culledBricks);
+    const MeshDecimator::Stats& decimateStats = m_waterModel.decimateStats;
+    if (m_waterModel.decimateOptions.enabled) {
+        screenPrintf("Decimation: %d -> %d triangles (%.0f%%) in %.1f ms", decimateStats.inputTriangles, decimateStats.outputTriangles, 100.0f * decimateStats.ratio(), 1000.0f * decimateStats.time);
+    }
+    for (int level = 0; level < MCubes::MAX_LOD_LEVELS; ++level) {
+        screenPrintf("  LOD %d: %d bricks, %d triangles, %.2f px max cell", level, meshStats.lodBricks[level], meshStats.lodTriangles[level], meshStats.lodPixelError[level]);
+    }
+
+    // The picture being path traced, as far as it has got, scaled down to fit the window
+    if (notNull(m_render)) {
+        screenPrintf("Path tracing: %.0f%% of the tiles in %.1f s", 100.0f * m_render->tracer->progress(), System::time() - m_render->startTime);
+        if (notNull(m_render->preview)) {
+            const float w = float(m_render->preview->width());
+            const float h = float(m_render->preview->height());
+            const float s = min(1.0f, min(rd->width() / w, rd->height() / h));
+            Draw::rect2D(Rect2D::xywh(0, 0, w * s, h * s), rd, Color3::white(), m_render->preview);
+        }
+    }
+
     // Render 2D objects like Widgets.  These do not receive tone mapping or gamma correction.
     Surface2D::sortAndRender(rd, posed2D);
 }
@@ -11,7 +11,12 @@
 #include "WaterModel.h"
 #include "PhysFlex.h"
 #include "PathTracer.h"
+#include "TemporalAccumulator.h"
 #include "Video.h"
+#include "MesherBenchmark.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 /* Change Log:
     - based on G3D sample code
@@ -33,6 +38,61 @@ protected:
     /** Object used for rendering the water model and the diffuse particles every scene. */
     WaterModel m_waterModel;
 
+    /** Whether each simulated frame of water particles is saved for MesherBenchmark. */
+    bool m_recordParticleFrames = false;
+
+    /** Number of particle frames saved so far this session. */
+    int m_recordedFrameCount = 0;
+
+    /** How far outside the view, in meters, water is still meshed for the interactive preview when culling. */
+    float previewCullMargin = 0.5f;
+
+    /** How far outside the view, in meters, water is still meshed for path-traced pictures and video, where reflections and refractions reach further. */
+    float renderCullMargin = 2.0f;
+
+    /** The path tracer's triangles, kept between frames so that the static geometry is only built once. */
+    shared_ptr<SceneTree> m_sceneTrees = std::make_shared<SceneTree>();
+
+    /** Rays traced at each pixel of the last path-traced image, as a fraction of the most allowed. */
+    shared_ptr<Texture> m_samplesPerPixel;
+
+    /** Every frame of the caustic animation that the path tracer projects under the water, decoded once in onInit. */
+    shared_ptr<CausticAtlas> m_caustics;
+
+    /** Filters path-traced images before they are exposed, when enabled. */
+    Denoiser m_denoiser;
+
+    /** Reuses each path-traced frame's radiance in the next, when enabled. */
+    TemporalAccumulator m_temporal;
+
+    /** A picture being path traced on another thread, so that the GUI stays live, shows the tiles as they finish, and can stop it. */
+    class Render {
+    public:
+        shared_ptr<PathTracer> tracer;
+
+        /** What tracer refers to, kept alive until it is done. */
+        shared_ptr<ParticleSurface> water;
+
+        /** A copy of the active camera when the render started, so that moving the camera does not disturb it. */
+        shared_ptr<Camera> camera;
+
+        shared_ptr<Image> image;
+        std::thread thread;
+        std::atomic<bool> done{false};
+        RealTime startTime = 0;
+
+        /** Tiles that tracer has finished and the preview does not show yet. Guarded by tilesMutex. */
+        Array<Rect2D> finishedTiles;
+        std::mutex tilesMutex;
+
+        /** Radiance of the finished tiles, and the same exposed for display. */
+        shared_ptr<Image> previewImage;
+        shared_ptr<Texture> preview;
+    };
+
+    /** The render in flight, or null. */
+    shared_ptr<Render> m_render;
+
     int videoLength = 0;
     VideoRecorder m_videoRecorder;
 
@@ -52,11 +112,48 @@ protected:
     /** Step parameter for marching cubes. Set to .5 for no holes, .8 for faster but some holes, 1 if you're a madman (or madwoman). */
 	float stepRatio = .5f;
 
+    /** Step parameter for marching cubes when meshing the anisotropic kernel field, which stays closed at about twice the step of the sphere field. */
+	float anisotropicStepRatio = 1.0f;
+
     /** Called from onInit */
     void makeGUI();
 
     /** Populates the dst image with a path-traced image representing the scene. Returns time it took to render image. */
     float traceImage(shared_ptr<Texture>& dst, Point2 dimensions);
+
+    /**
+     * A path tracer for the scene as it is now, seen from camera, that renders into img. Creates the particle surface
+     * that it traces into water when m_options.traceParticles is set, which must outlive the tracer.
+     */
+    shared_ptr<PathTracer> createTracer(const shared_ptr<Image>& img, const shared_ptr<Camera>& camera, shared_ptr<ParticleSurface>& water,
+        const std::function<void(const Rect2D&, int, int)>& onTileDone = nullptr);
+
+    /** Filters tracer's framebuffer, writes it to img, exposes that into dst, and saves it when m_options.save is set. */
+    void finishImage(PathTracer& tracer, const shared_ptr<Image>& img, const shared_ptr<Camera>& camera, shared_ptr<Texture>& dst);
+
+    /** Starts path tracing a picture on another thread, unless one is already in flight. */
+    void startRender();
+
+    /** Exposes the tiles finished since the last call into the preview, and shows the picture once it is done. Called every frame. */
+    void updateRender(RenderDevice* rd);
+
+    /** Image size for m_options.resolution. */
+    Point2 resolutionDimensions() const;
+
+    /**
+     * Has the mesher choose levels of detail for the active camera, at the pixels of an image of the given size, and
+     * cull to the view of that image pushed out by cullMargin.
+     */
+    void setMeshView(const Point2& dimensions, float cullMargin);
+
+    /** Remeshes the current water particles for a path-traced image of the given size, seen from the active camera. */
+    void meshWaterForRender(const Point2& dimensions);
+
+    /**
+     * Path traces at 4, 8 and 32 rays per pixel without adaptive sampling, denoises each, and logs the time and the
+     * error of each before and after denoising against an image with many more rays.
+     */
+    void compareDenoising();
 public:
     
     App(const GApp::Settings& settings = GApp::Settings());
@@ -73,4 +170,6 @@ public:
     virtual void onUserInput(UserInput* ui) override;
 
     virtual void saveScene() override;
+
+    virtual void onCleanup() override;
 };
@@ -0,0 +1,45 @@
+#include "CausticAtlas.h"
+
+CausticAtlas::CausticAtlas(const String& filenamePattern, int frameCount, const Options& options) : m_options(options) {
+    Stopwatch clock;
+    clock.tick();
+
+    Array<shared_ptr<Image>> images;
+    images.resize(frameCount);
+    Thread::runConcurrently(0, frameCount, [&](int f) {
+        images[f] = Image::fromFile(format(filenamePattern.c_str(), f + 1));
+    });
+
+    m_width = images[0]->width();
+    m_height = images[0]->height();
+    m_frameCount = frameCount;
+    m_texels.resize(m_frameCount * m_width * m_height);
+    Thread::runConcurrently(0, m_frameCount * m_height, [&](int row) {
+        const int f = row / m_height;
+        const int y = row % m_height;
+        alwaysAssertM((images[f]->width() == m_width) && (images[f]->height() == m_height), "Caustic frames must all be the same size");
+        Color3* texels = m_texels.getCArray() + row * m_width;
+        for (int x = 0; x < m_width; ++x) {
+            images[f]->get(Point2int32(x, y), texels[x]);
+        }
+    });
+
+    clock.tock();
+    debugPrintf("Caustic atlas: %d frames of %dx%d in %.3f s\n", m_frameCount, m_width, m_height, clock.elapsedTime());
+}
+
+Color3 CausticAtlas::sample(int frame, const Point3& position) const {
+    const float x = position.x * m_options.texelsPerMeter;
+    const float y = position.z * m_options.texelsPerMeter;
+    if (! m_options.bilinear) {
+        return texel(frame, iFloor(x), iFloor(y));
+    }
+
+    // Texel centers are at half-integers
+    const int x0 = iFloor(x - 0.5f);
+    const int y0 = iFloor(y - 0.5f);
+    const float fx = x - 0.5f - float(x0);
+    const float fy = y - 0.5f - float(y0);
+    return (texel(frame, x0, y0) * (1.0f - fx) + texel(frame, x0 + 1, y0) * fx) * (1.0f - fy) +
+        (texel(frame, x0, y0 + 1) * (1.0f - fx) + texel(frame, x0 + 1, y0 + 1) * fx) * fy;
+}
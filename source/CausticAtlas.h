@@ -0,0 +1,69 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * Every frame of the animated caustic texture, decoded once into one flat array of floats.
+ *
+ * The path tracer used to decode a frame's JPEG for every image it rendered and then look texels up through Image::get.
+ * Here the frames are decoded together, in parallel, when the atlas is created, and a lookup is plain arithmetic on an
+ * index. The texture tiles the XZ plane and is animated by simulation time.
+ */
+class CausticAtlas {
+public:
+    class Options {
+    public:
+        Options() {}
+
+        /** Blend the four nearest texels instead of taking the nearest one. */
+        bool bilinear = true;
+
+        /** Texels across one meter of the XZ plane. More makes the pattern smaller. */
+        float texelsPerMeter = 150.0f;
+
+        /** Caustic frames per second of simulation time. The video records at 30. */
+        float framesPerSecond = 30.0f;
+    };
+
+protected:
+    Options m_options;
+
+    int m_width = 0;
+    int m_height = 0;
+    int m_frameCount = 0;
+
+    /** Frame after frame, each row-major. */
+    Array<Color3> m_texels;
+
+    /** i modulo n, also for negative i. */
+    static int wrap(int i, int n) {
+        return ((i % n) + n) % n;
+    }
+
+    const Color3& texel(int frame, int x, int y) const {
+        return m_texels[(frame * m_height + wrap(y, m_height)) * m_width + wrap(x, m_width)];
+    }
+
+public:
+
+    /**
+     * Decodes filenamePattern formatted with each frame number from 1 to frameCount. Every frame must have the size of the
+     * first. Throws if a file cannot be read.
+     */
+    CausticAtlas(const String& filenamePattern = "data-files/waterCaustic/waterCaustic_%03d.jpg", int frameCount = 32, const Options& options = Options());
+
+    Options& options() {
+        return m_options;
+    }
+
+    int frameCount() const {
+        return m_frameCount;
+    }
+
+    /** The frame shown at a simulation time, looping. */
+    int frameAt(SimTime time) const {
+        return wrap(iFloor(float(time) * m_options.framesPerSecond), m_frameCount);
+    }
+
+    /** The caustic light of a frame over a point, from its X and Z. */
+    Color3 sample(int frame, const Point3& position) const;
+};
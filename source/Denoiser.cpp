@@ -0,0 +1,114 @@
+#include "Denoiser.h"
+
+/** The B3-spline, which is the a-trous filter's kernel along each axis. */
+static const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+/** Albedo is divided out, so very dark albedo is clamped to keep the division stable. */
+static const float MIN_ALBEDO = 0.01f;
+
+void DenoiseBuffers::resize(int w, int h) {
+    width = w;
+    height = h;
+    normal.resize(w * h);
+    depth.resize(w * h);
+    position.resize(w * h);
+    albedo.resize(w * h);
+    surface.resize(w * h);
+}
+
+void Denoiser::apply(Array<Radiance3>& radiance, const DenoiseBuffers& buffers) {
+    Stopwatch clock;
+    clock.tick();
+
+    const int numPixels = buffers.width * buffers.height;
+    alwaysAssertM(radiance.size() == numPixels, "The denoise buffers must match the framebuffer");
+
+    Array<Radiance3> dst;
+    dst.resize(numPixels);
+    Thread::runConcurrently(0, numPixels, [&](int p) {
+        radiance[p] = radiance[p] / buffers.albedo[p].max(Color3(MIN_ALBEDO));
+    });
+
+    for (int i = 0; i < m_options.iterations; ++i) {
+        filter(buffers, radiance, dst, i);
+        Array<Radiance3>::swap(radiance, dst);
+    }
+
+    Thread::runConcurrently(0, numPixels, [&](int p) {
+        radiance[p] = radiance[p] * buffers.albedo[p].max(Color3(MIN_ALBEDO));
+    });
+
+    clock.tock();
+    m_time = clock.elapsedTime();
+}
+
+void Denoiser::filter(const DenoiseBuffers& buffers, const Array<Radiance3>& src, Array<Radiance3>& dst, int iteration) const {
+    const int width = buffers.width;
+    const int height = buffers.height;
+    const int step = 1 << iteration;
+    const int tilesWide = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesHigh = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    // The color tolerance halves each iteration as the noise is filtered out, as in Dammertz et al.
+    const float colorVariance = square(m_options.colorSigma / float(step));
+    const float depthScale = 1.0f / (m_options.depthSigma * float(step));
+
+    Thread::runConcurrently(0, tilesWide * tilesHigh, [&](int tile) {
+        const int x0 = (tile % tilesWide) * TILE_SIZE;
+        const int y0 = (tile / tilesWide) * TILE_SIZE;
+        for (int y = y0; y < min(y0 + TILE_SIZE, height); ++y) {
+            for (int x = x0; x < min(x0 + TILE_SIZE, width); ++x) {
+                const int p = x + y * width;
+                const uint8 surface = buffers.surface[p];
+                if (surface == DenoiseBuffers::SKY) {
+                    // The sky is already smooth
+                    dst[p] = src[p];
+                    continue;
+                }
+
+                const Radiance3& color = src[p];
+                const float brightness = color.average();
+                const Vector3& normal = buffers.normal[p];
+                const float depth = buffers.depth[p];
+
+                Radiance3 sum = Radiance3::black();
+                float weightSum = 0.0f;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    const int qy = y + dy * step;
+                    if ((qy < 0) || (qy >= height)) {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        const int qx = x + dx * step;
+                        if ((qx < 0) || (qx >= width)) {
+                            continue;
+                        }
+                        const int q = qx + qy * width;
+                        if (buffers.surface[q] != surface) {
+                            continue;
+                        }
+
+                        const Radiance3& tap = src[q];
+                        const float colorDistance = (tap - color).squaredLength() / (colorVariance * square(0.5f * (brightness + tap.average())) + 1e-6f);
+                        const float depthDistance = std::abs(buffers.depth[q] - depth) * depthScale / max(depth, 1e-3f);
+                        const float normalWeight = pow(max(buffers.normal[q].dot(normal), 0.0f), m_options.normalPower);
+                        const float weight = KERNEL[dx + 2] * KERNEL[dy + 2] * normalWeight * exp(-colorDistance - depthDistance);
+                        sum += tap * weight;
+                        weightSum += weight;
+                    }
+                }
+
+                // Only a pixel without a normal can reject even its own tap
+                dst[p] = (weightSum > 0.0f) ? sum / weightSum : color;
+            }
+        }
+    });
+}
+
+float Denoiser::rmse(const Array<Radiance3>& a, const Array<Radiance3>& b) {
+    double sum = 0.0;
+    for (int p = 0; p < a.size(); ++p) {
+        sum += (a[p] - b[p]).squaredLength();
+    }
+    return float(sqrt(sum / (3.0 * max(a.size(), 1))));
+}
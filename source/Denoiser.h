@@ -0,0 +1,91 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * What the camera ray of each pixel hit first, which the path tracer records for the denoiser. Row-major over the image.
+ */
+class DenoiseBuffers {
+public:
+    /** What a pixel shows. The denoiser never blends pixels of different kinds. */
+    enum Surface { SKY, SOLID, WATER, FOAM };
+
+    int width = 0;
+    int height = 0;
+
+    /** Shading normal, facing the camera. */
+    Array<Vector3> normal;
+
+    /** Distance from the camera. */
+    Array<float> depth;
+
+    /** Where the camera ray hit. Unset for the sky. */
+    Array<Point3> position;
+
+    /** Color that the surface's texture gives its light. 1 for the sky, water and foam, whose light has no texture. */
+    Array<Color3> albedo;
+
+    Array<uint8> surface;
+
+    void resize(int w, int h);
+};
+
+/**
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) for path-traced images.
+ *
+ * Each iteration blurs with a 5x5 B3-spline whose taps are spread twice as far apart as the last, so a few iterations
+ * cover a wide footprint at 25 taps each. Taps are weighted down where the normal, depth or color differ from the
+ * center's, and pixels of different kinds (sky, solid, water, foam) are never mixed, so edges stay sharp. The image
+ * is divided by the albedo before filtering and multiplied by it after, so textures are not blurred with the noise.
+ * Runs over tiles on all cores.
+ */
+class Denoiser {
+public:
+    class Options {
+    public:
+        Options() {}
+
+        bool enabled = false;
+
+        /** Taps are 2^i pixels apart in iteration i, so 5 iterations reach 62 pixels out. */
+        int iterations = 5;
+
+        /** Color difference, relative to the pixels' brightness, at which a tap's weight falls to 1/e. Halves each iteration. */
+        float colorSigma = 0.5f;
+
+        /** Exponent on the cosine between normals. */
+        float normalPower = 64.0f;
+
+        /** Depth difference, relative to the depth and per pixel of tap spacing, at which a tap's weight falls to 1/e. */
+        float depthSigma = 0.02f;
+    };
+
+protected:
+    /** Side of the square tiles that the image is filtered in, in pixels. */
+    static const int TILE_SIZE = 32;
+
+    Options m_options;
+
+    RealTime m_time = 0;
+
+    /** One iteration from src to dst with taps step pixels apart. */
+    void filter(const DenoiseBuffers& buffers, const Array<Radiance3>& src, Array<Radiance3>& dst, int iteration) const;
+
+public:
+
+    Denoiser(const Options& options = Options()) : m_options(options) {}
+
+    Options& options() {
+        return m_options;
+    }
+
+    /** Filters radiance, a path tracer's framebuffer() of buffers.width x buffers.height, in place. */
+    void apply(Array<Radiance3>& radiance, const DenoiseBuffers& buffers);
+
+    /** Seconds the last apply took. */
+    RealTime time() const {
+        return m_time;
+    }
+
+    /** Root mean square difference between two framebuffers of the same size, over all channels. */
+    static float rmse(const Array<Radiance3>& a, const Array<Radiance3>& b);
+};
@@ -0,0 +1,142 @@
+#include "FieldKernel.h"
+#include "Intrinsics.h"
+
+/** Distance used when no particle is near a corner. Matches the original scalar loop. */
+static const float FAR_SQUARED_DISTANCE = 1e10f;
+
+static bool cpuSupportsAVX() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    const bool cpuHasAVX = (info[2] & (1 << 28)) != 0;
+    const bool osUsesXSave = (info[2] & (1 << 27)) != 0;
+    if (!(cpuHasAVX && osUsesXSave)) {
+        return false;
+    }
+    // The OS must also save the upper halves of the YMM registers on context switches
+    return (_xgetbv(0) & 0x6) == 0x6;
+#else
+    return __builtin_cpu_supports("avx") != 0;
+#endif
+}
+
+FieldKernel::Implementation FieldKernel::best() {
+    // SSE2 is part of x64, so only AVX needs to be detected
+    static const Implementation implementation = cpuSupportsAVX() ? AVX : SSE;
+    return implementation;
+}
+
+const char* FieldKernel::name(Implementation implementation) {
+    switch (implementation) {
+    case SSE:
+        return "SSE";
+    case AVX:
+        return "AVX";
+    default:
+        return "Scalar";
+    }
+}
+
+void FieldKernel::evaluate(Implementation implementation, const Corners& corners, const NeighborBuffer& neighbors, float radius, float* val) {
+    if (implementation > best()) {
+        implementation = best();
+    }
+
+    const float* nx = neighbors.x.getCArray();
+    const float* ny = neighbors.y.getCArray();
+    const float* nz = neighbors.z.getCArray();
+    const int n = neighbors.size();
+
+    switch (implementation) {
+    case AVX:
+        evaluateAVX(corners, nx, ny, nz, n, radius, val);
+        break;
+    case SSE:
+        evaluateSSE(corners, nx, ny, nz, n, radius, val);
+        break;
+    default:
+        evaluateScalar(corners, nx, ny, nz, n, radius, val);
+        break;
+    }
+}
+
+void FieldKernel::evaluateScalar(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val) {
+    float best[8];
+    for (int k = 0; k < 8; ++k) {
+        best[k] = FAR_SQUARED_DISTANCE;
+    }
+
+    for (int j = 0; j < n; ++j) {
+        for (int k = 0; k < 8; ++k) {
+            const float dx = corners.x[k] - nx[j];
+            const float dy = corners.y[k] - ny[j];
+            const float dz = corners.z[k] - nz[j];
+            best[k] = min(best[k], dx * dx + dy * dy + dz * dz);
+        }
+    }
+
+    for (int k = 0; k < 8; ++k) {
+        val[k] = sqrt(best[k]) - radius;
+    }
+}
+
+/** Squared distance from four corners to one neighbor. */
+static inline __m128 squaredDistanceSSE(__m128 cx, __m128 cy, __m128 cz, __m128 px, __m128 py, __m128 pz) {
+    const __m128 dx = _mm_sub_ps(cx, px);
+    const __m128 dy = _mm_sub_ps(cy, py);
+    const __m128 dz = _mm_sub_ps(cz, pz);
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+}
+
+void FieldKernel::evaluateSSE(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val) {
+    // Corners 0-3 and 4-7
+    const __m128 cxLo = _mm_loadu_ps(corners.x);
+    const __m128 cyLo = _mm_loadu_ps(corners.y);
+    const __m128 czLo = _mm_loadu_ps(corners.z);
+    const __m128 cxHi = _mm_loadu_ps(corners.x + 4);
+    const __m128 cyHi = _mm_loadu_ps(corners.y + 4);
+    const __m128 czHi = _mm_loadu_ps(corners.z + 4);
+
+    __m128 bestLo = _mm_set1_ps(FAR_SQUARED_DISTANCE);
+    __m128 bestHi = bestLo;
+    for (int j = 0; j < n; ++j) {
+        const __m128 px = _mm_set1_ps(nx[j]);
+        const __m128 py = _mm_set1_ps(ny[j]);
+        const __m128 pz = _mm_set1_ps(nz[j]);
+        bestLo = _mm_min_ps(bestLo, squaredDistanceSSE(cxLo, cyLo, czLo, px, py, pz));
+        bestHi = _mm_min_ps(bestHi, squaredDistanceSSE(cxHi, cyHi, czHi, px, py, pz));
+    }
+
+    const __m128 r = _mm_set1_ps(radius);
+    _mm_storeu_ps(val, _mm_sub_ps(_mm_sqrt_ps(bestLo), r));
+    _mm_storeu_ps(val + 4, _mm_sub_ps(_mm_sqrt_ps(bestHi), r));
+}
+
+/** Squared distance from all eight corners to one neighbor. */
+AVX_FUNCTION static inline __m256 squaredDistanceAVX(__m256 cx, __m256 cy, __m256 cz, const float* px, const float* py, const float* pz) {
+    const __m256 dx = _mm256_sub_ps(cx, _mm256_broadcast_ss(px));
+    const __m256 dy = _mm256_sub_ps(cy, _mm256_broadcast_ss(py));
+    const __m256 dz = _mm256_sub_ps(cz, _mm256_broadcast_ss(pz));
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+}
+
+AVX_FUNCTION void FieldKernel::evaluateAVX(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val) {
+    const __m256 cx = _mm256_loadu_ps(corners.x);
+    const __m256 cy = _mm256_loadu_ps(corners.y);
+    const __m256 cz = _mm256_loadu_ps(corners.z);
+
+    // Two independent running minimums hide the latency of the min instruction
+    __m256 best0 = _mm256_set1_ps(FAR_SQUARED_DISTANCE);
+    __m256 best1 = best0;
+    int j = 0;
+    for (; j + 1 < n; j += 2) {
+        best0 = _mm256_min_ps(best0, squaredDistanceAVX(cx, cy, cz, nx + j, ny + j, nz + j));
+        best1 = _mm256_min_ps(best1, squaredDistanceAVX(cx, cy, cz, nx + j + 1, ny + j + 1, nz + j + 1));
+    }
+    if (j < n) {
+        best0 = _mm256_min_ps(best0, squaredDistanceAVX(cx, cy, cz, nx + j, ny + j, nz + j));
+    }
+
+    const __m256 best = _mm256_min_ps(best0, best1);
+    _mm256_storeu_ps(val, _mm256_sub_ps(_mm256_sqrt_ps(best), _mm256_set1_ps(radius)));
+}
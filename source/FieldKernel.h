@@ -0,0 +1,62 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * The distance field at the 8 corners of a marching cubes cell:
+ * val[k] = sqrt(min_j |corner_k - neighbor_j|^2) - radius.
+ *
+ * This is the inner loop of the mesher, so it comes in SSE (two sets of 4 corners)
+ * and AVX (all 8 corners in one register) flavors in addition to the scalar one.
+ * The vector versions broadcast each neighbor against all corners at once and take
+ * a single square root at the end. The fastest implementation that the CPU supports
+ * is chosen at runtime.
+ */
+class FieldKernel {
+public:
+    enum Implementation { SCALAR, SSE, AVX };
+
+    /** The cell corners in structure-of-arrays form, in GRIDCELL order. */
+    class Corners {
+    public:
+        float x[8];
+        float y[8];
+        float z[8];
+    };
+
+    /** Particle positions near a cell in structure-of-arrays form so that the kernel can stream them. */
+    class NeighborBuffer {
+    public:
+        Array<float> x;
+        Array<float> y;
+        Array<float> z;
+
+        void clear() {
+            x.fastClear();
+            y.fastClear();
+            z.fastClear();
+        }
+
+        void append(const Point3& p) {
+            x.append(p.x);
+            y.append(p.y);
+            z.append(p.z);
+        }
+
+        int size() const {
+            return x.size();
+        }
+    };
+
+    /** The fastest implementation that this CPU and OS support. Detected once. */
+    static Implementation best();
+
+    /** Display name of an implementation. */
+    static const char* name(Implementation implementation);
+
+    /** Writes the field value at each corner to val. Falls back to best() if the requested implementation is not supported. */
+    static void evaluate(Implementation implementation, const Corners& corners, const NeighborBuffer& neighbors, float radius, float* val);
+
+    static void evaluateScalar(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val);
+    static void evaluateSSE(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val);
+    static void evaluateAVX(const Corners& corners, const float* nx, const float* ny, const float* nz, int n, float radius, float* val);
+};
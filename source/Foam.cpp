@@ -0,0 +1,218 @@
+#include "Foam.h"
+#include <algorithm>
+
+/** Builds an icosahedron subdivided once: 42 vertices and 80 triangles, about as many as the low-poly sphere model. */
+static void buildSphereMesh(Array<Vector3>& vertices, Array<int>& indices) {
+    const float t = (1.0f + sqrt(5.0f)) * 0.5f;
+    const Vector3 corners[12] = {
+        Vector3(-1, t, 0), Vector3(1, t, 0), Vector3(-1, -t, 0), Vector3(1, -t, 0),
+        Vector3(0, -1, t), Vector3(0, 1, t), Vector3(0, -1, -t), Vector3(0, 1, -t),
+        Vector3(t, 0, -1), Vector3(t, 0, 1), Vector3(-t, 0, -1), Vector3(-t, 0, 1) };
+    static const int faces[20][3] = {
+        {0, 11, 5}, {0, 5, 1}, {0, 1, 7}, {0, 7, 10}, {0, 10, 11},
+        {1, 5, 9}, {5, 11, 4}, {11, 10, 2}, {10, 7, 6}, {7, 1, 8},
+        {3, 9, 4}, {3, 4, 2}, {3, 2, 6}, {3, 6, 8}, {3, 8, 9},
+        {4, 9, 5}, {2, 4, 11}, {6, 2, 10}, {8, 6, 7}, {9, 8, 1} };
+
+    vertices.fastClear();
+    indices.fastClear();
+    for (int i = 0; i < 12; ++i) {
+        vertices.append(corners[i].direction());
+    }
+
+    // Split every edge once, sharing the midpoint between the two faces on either side
+    Table<int, int> midpoints;
+    const auto midpoint = [&](int a, int b) {
+        const int key = min(a, b) * 12 + max(a, b);
+        bool created = false;
+        int& index = midpoints.getCreate(key, created);
+        if (created) {
+            index = vertices.size();
+            vertices.append((vertices[a] + vertices[b]).direction());
+        }
+        return index;
+    };
+
+    for (int f = 0; f < 20; ++f) {
+        const int a = faces[f][0];
+        const int b = faces[f][1];
+        const int c = faces[f][2];
+        const int ab = midpoint(a, b);
+        const int bc = midpoint(b, c);
+        const int ca = midpoint(c, a);
+        indices.append(a, ab, ca);
+        indices.append(b, bc, ab);
+        indices.append(c, ca, bc);
+        indices.append(ab, bc, ca);
+    }
+}
+
+void FoamInstance::getSphereMesh(Array<Vector3>& vertices, Array<int>& indices) {
+    static Array<Vector3> sphereVertices;
+    static Array<int> sphereIndices;
+    static bool initialized = false;
+    if (! initialized) {
+        buildSphereMesh(sphereVertices, sphereIndices);
+        initialized = true;
+    }
+    vertices = sphereVertices;
+    indices = sphereIndices;
+}
+
+void FoamTree::setContents(const Array<FoamInstance>& instances) {
+    m_instances = instances;
+    m_nodes.fastClear();
+    if (m_instances.size() == 0) {
+        return;
+    }
+
+    // Split the top of the tree on this thread until the subtrees are small enough to build one per thread
+    Array<Task> tasks;
+    m_nodes.next();
+    build(0, m_instances.size(), 0, m_nodes, &tasks);
+
+    Thread::runConcurrently(0, tasks.size(), [&](int t) {
+        Task& task = tasks[t];
+        task.nodes.next();
+        build(task.first, task.count, 0, task.nodes, nullptr);
+    });
+
+    // Splice the subtrees in. Each subtree's root goes into the node reserved for it and the rest is appended.
+    for (Task& task : tasks) {
+        const int offset = m_nodes.size() - 1;
+        for (int n = 0; n < task.nodes.size(); ++n) {
+            Node& node = task.nodes[n];
+            if (node.count == 0) {
+                node.index += offset;
+            }
+            if (n == 0) {
+                m_nodes[task.node] = node;
+            } else {
+                m_nodes.append(node);
+            }
+        }
+    }
+}
+
+AABox FoamTree::split(int first, int count, int& half) {
+    AABox bounds(m_instances[first].position);
+    AABox centers(m_instances[first].position);
+    for (int i = first; i < first + count; ++i) {
+        const FoamInstance& instance = m_instances[i];
+        const Vector3 r(instance.radius, instance.radius, instance.radius);
+        bounds.merge(AABox(instance.position - r, instance.position + r));
+        centers.merge(instance.position);
+    }
+
+    // Split at the median along the axis where the centers spread the most
+    half = count / 2;
+    if (count > LEAF_SIZE) {
+        const Vector3 extent = centers.extent();
+        const int axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+        FoamInstance* begin = m_instances.getCArray() + first;
+        std::nth_element(begin, begin + half, begin + count, [axis](const FoamInstance& a, const FoamInstance& b) {
+            return a.position[axis] < b.position[axis];
+        });
+    }
+    return bounds;
+}
+
+void FoamTree::build(int first, int count, int root, Array<Node>& nodes, Array<Task>* tasks) {
+    if (notNull(tasks) && (count < SERIAL_BUILD_SIZE)) {
+        Task& task = tasks->next();
+        task.node = root;
+        task.first = first;
+        task.count = count;
+        return;
+    }
+
+    int half;
+    nodes[root].bounds = split(first, count, half);
+    if (count <= LEAF_SIZE) {
+        nodes[root].index = first;
+        nodes[root].count = count;
+        return;
+    }
+
+    // Both children are allocated together so that the second always follows the first
+    const int child = nodes.size();
+    nodes.resize(child + 2);
+    nodes[root].index = child;
+    nodes[root].count = 0;
+    build(first, half, child, nodes, tasks);
+    build(first + half, count - half, child + 1, nodes, tasks);
+}
+
+/** Distance at which the ray enters the box, or infinity if it misses it within [tMin, tMax]. */
+static inline float enterBox(const AABox& box, const Point3& origin, const Vector3& invDirection, float tMin, float tMax) {
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (box.low()[a] - origin[a]) * invDirection[a];
+        float t1 = (box.high()[a] - origin[a]) * invDirection[a];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        tMin = max(tMin, t0);
+        tMax = min(tMax, t1);
+        if (tMin > tMax) {
+            return finf();
+        }
+    }
+    return tMin;
+}
+
+bool FoamTree::intersect(const Ray& ray, FoamHit& hit) const {
+    if (m_nodes.size() == 0) {
+        return false;
+    }
+
+    const Point3& origin = ray.origin();
+    const Vector3& direction = ray.direction();
+    const Vector3 invDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    float nearest = ray.maxDistance();
+    int nearestSphere = -1;
+
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const Node& node = m_nodes[stack[--top]];
+        if (enterBox(node.bounds, origin, invDirection, ray.minDistance(), nearest) > nearest) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            stack[top++] = node.index + 1;
+            stack[top++] = node.index;
+            continue;
+        }
+
+        for (int i = node.index; i < node.index + node.count; ++i) {
+            // Only the near side counts, as with the back-face culled triangles that foam used to be
+            const FoamInstance& sphere = m_instances[i];
+            const Vector3 oc = origin - sphere.position;
+            const float b = oc.dot(direction);
+            const float c = oc.dot(oc) - square(sphere.radius);
+            const float discriminant = b * b - c;
+            if (discriminant < 0.0f) { continue; }
+
+            const float t = -b - sqrt(discriminant);
+            if ((t >= ray.minDistance()) && (t < nearest)) {
+                nearest = t;
+                nearestSphere = i;
+            }
+        }
+    }
+
+    if (nearestSphere < 0) {
+        return false;
+    }
+
+    const FoamInstance& sphere = m_instances[nearestSphere];
+    hit.distance = nearest;
+    hit.index = nearestSphere;
+    hit.position = origin + direction * nearest;
+    hit.normal = (hit.position - sphere.position) / sphere.radius;
+    hit.radius = sphere.radius;
+    hit.age = sphere.age;
+    return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/** Name of the single entity that all diffuse particles are rasterized with. The path tracer hides it and intersects FoamInstances instead. */
+static const String FOAM_ENTITY_NAME = "diffuseParticles";
+
+/** One diffuse (foam, spray or bubble) particle. Foam is passed around as a flat buffer of these instead of as scene entities. */
+class FoamInstance {
+public:
+    Point3 position;
+    float radius;
+
+    /** Remaining lifetime reported by Flex, in [0, 1]. Foam fades out as it ages, so this doubles as its opacity. */
+    float age;
+
+    /** Vertices and triangle indices of the unit sphere that every foam particle is rasterized with. Built once. */
+    static void getSphereMesh(Array<Vector3>& vertices, Array<int>& indices);
+};
+
+/** Where a ray hit a foam sphere. Misses have an infinite distance. */
+class FoamHit {
+public:
+    float distance = finf();
+
+    /** Index of the sphere in the FoamTree. */
+    int index = -1;
+
+    Point3 position;
+
+    /** Outward unit normal of the sphere at position. */
+    Vector3 normal;
+
+    float radius = 0.0f;
+
+    /** Age of the particle that was hit. See FoamInstance::age. */
+    float age = 0.0f;
+
+    bool hit() const {
+        return distance < finf();
+    }
+};
+
+/** A bounding volume hierarchy over analytic foam spheres, for the path tracer. Built in parallel. */
+class FoamTree {
+protected:
+    /** Spheres per leaf. */
+    static const int LEAF_SIZE = 4;
+
+    /** Subtrees with fewer spheres than this are built on a single thread. */
+    static const int SERIAL_BUILD_SIZE = 4096;
+
+    class Node {
+    public:
+        AABox bounds;
+
+        /** Interior nodes: index of the first child. The second child follows it. Leaves: index of the first sphere. */
+        int index;
+
+        /** Number of spheres in a leaf, 0 for interior nodes. */
+        int count;
+    };
+
+    /** A subtree whose build was deferred so that it can run on another thread. */
+    class Task {
+    public:
+        /** Node that the subtree's root is written into. */
+        int node;
+        int first;
+        int count;
+        Array<Node> nodes;
+    };
+
+    Array<Node> m_nodes;
+
+    /** The spheres in leaf order. */
+    Array<FoamInstance> m_instances;
+
+    /** Partitions m_instances[first, first + count) at its median and returns the bounds of those spheres. */
+    AABox split(int first, int count, int& half);
+
+    /**
+     * Builds the subtree over m_instances[first, first + count) into nodes[root] and nodes appended after it.
+     * When tasks is not null, subtrees of fewer than SERIAL_BUILD_SIZE spheres are appended to it instead of built,
+     * so that the top of the tree is split on this thread and the subtrees below it are built concurrently.
+     */
+    void build(int first, int count, int root, Array<Node>& nodes, Array<Task>* tasks);
+
+public:
+
+    /** Replaces the tree's spheres. */
+    void setContents(const Array<FoamInstance>& instances);
+
+    int size() const {
+        return m_instances.size();
+    }
+
+    const FoamInstance& operator[](int i) const {
+        return m_instances[i];
+    }
+
+    /** Finds the nearest sphere that the ray enters between its min and max distance. Returns false and leaves hit untouched if there is none. */
+    bool intersect(const Ray& ray, FoamHit& hit) const;
+};
@@ -0,0 +1,58 @@
+#include "HitBuffer.h"
+
+/** Schlick's approximation of the Fresnel reflectance for reflectance F0 at normal incidence. */
+static Color3 schlickFresnel(const Color3& F0, float cosTheta) {
+    return F0 + (Color3::one() - F0) * pow(1.0f - clamp(cosTheta, 0.0f, 1.0f), 5.0f);
+}
+
+Color3 MaterialSample::finiteScatteringDensity(const Vector3& n, const Vector3& w_i, const Vector3& w_o) const {
+    Color3 f = lambertian / pif();
+    if ((smoothness < 1.0f) && glossy.nonZero()) {
+        const Vector3& h = (w_i + w_o).directionOrZero();
+        const float exponent = pow(2.0f, 13.0f * smoothness);
+        f += schlickFresnel(glossy, w_i.dot(h)) * ((exponent + 8.0f) / (8.0f * pif())) * pow(max(n.dot(h), 0.0f), exponent);
+    }
+    return f;
+}
+
+int MaterialSample::getImpulses(const Vector3& n, const Vector3& w_o, Impulse impulses[MAX_IMPULSES]) const {
+    const float cosO = n.dot(w_o);
+    const Color3& F = schlickFresnel(glossy, std::abs(cosO));
+
+    Color3 reflected = ((smoothness >= 1.0f) && glossy.nonZero()) ? F : Color3::black();
+    Impulse refraction;
+    refraction.magnitude = Color3::black();
+    if (transmits()) {
+        // Snell's law from the side the normal faces into the other side
+        const float eta = etaPos / etaNeg;
+        const float k = 1.0f - square(eta) * (1.0f - square(cosO));
+        if (k < 0.0f) {
+            // Total internal reflection
+            reflected += transmissive * (Color3::one() - F);
+        } else {
+            refraction.direction = (-w_o * eta + n * (eta * cosO - sqrt(k))).direction();
+            refraction.magnitude = transmissive * (Color3::one() - F);
+        }
+    }
+
+    // Reflection first, as UniversalSurfel orders them
+    int count = 0;
+    if (reflected.nonZero()) {
+        impulses[count].direction = n * (2.0f * cosO) - w_o;
+        impulses[count].magnitude = reflected;
+        ++count;
+    }
+    if (refraction.magnitude.nonZero()) {
+        impulses[count++] = refraction;
+    }
+    return count;
+}
+
+void HitBuffer::resize(int n) {
+    position.resize(n, false);
+    geometricNormal.resize(n, false);
+    shadingNormal.resize(n, false);
+    texCoord.resize(n, false);
+    material.resize(n, false);
+    flags.resize(n, false);
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * The scattering parameters of a surface at one hit: the parts of a UniversalSurfel that the path tracer uses,
+ * as plain values. A bounce fills one per pixel without allocating and evaluates it without virtual calls.
+ */
+class MaterialSample {
+public:
+    Color3 lambertian = Color3::black();
+
+    /** Glossy reflectance at normal incidence. Rises to 1 at grazing angles by Schlick's approximation. */
+    Color3 glossy = Color3::black();
+
+    /** 1 is a perfect mirror, which scatters only through impulses. */
+    float smoothness = 0.0f;
+
+    Color3 transmissive = Color3::black();
+    Radiance3 emissive = Radiance3::black();
+
+    /** Index of refraction and extinction on the side the normal faces (Pos) and the other side (Neg). */
+    float etaPos = 1.0f;
+    float etaNeg = 1.0f;
+    Color3 kappaPos = Color3::black();
+    Color3 kappaNeg = Color3::black();
+
+    /** A scattering direction with all of the probability mass. */
+    class Impulse {
+    public:
+        Vector3 direction;
+        Color3 magnitude;
+    };
+
+    /** At most a reflection and a refraction. */
+    static const int MAX_IMPULSES = 2;
+
+    /** Swaps the two sides, for a hit on the back of a two-sided surface. */
+    void flip() {
+        std::swap(etaPos, etaNeg);
+        std::swap(kappaPos, kappaNeg);
+    }
+
+    bool transmits() const {
+        return transmissive.nonZero();
+    }
+
+    /** Rough total reflectance, for the ambient term. */
+    Color3 reflectivity() const {
+        return lambertian + glossy;
+    }
+
+    /** The non-impulse part of the BSDF: Lambertian plus a normalized Blinn-Phong lobe for glossy surfaces that are not mirrors. */
+    Color3 finiteScatteringDensity(const Vector3& n, const Vector3& w_i, const Vector3& w_o) const;
+
+    /** Writes the mirror reflection and refraction of w_o about n, Fresnel weighted, and returns how many there are. */
+    int getImpulses(const Vector3& n, const Vector3& w_o, Impulse impulses[MAX_IMPULSES]) const;
+};
+
+/**
+ * The closest hit of every ray in the wavefront, structure of arrays. Each bounce overwrites the rows in place, so
+ * after the first bounce no memory is allocated. Normals face the side the ray came from, as a Surfel's do.
+ */
+class HitBuffer {
+public:
+    enum Flag {
+        /** The ray hit something. Rows without it hit the sky. */
+        HIT = 1,
+
+        /** The ray hit the back of a two-sided surface. Its material has been flipped. */
+        BACKFACE = 2,
+
+        /** The surface transmits, so the ray may go on into a medium. */
+        MEDIUM = 4,
+
+        /** The ray hit a foam particle. material is then the index of the particle in the foam tree. */
+        FOAM = 8
+    };
+
+    Array<Point3> position;
+    Array<Vector3> geometricNormal;
+    Array<Vector3> shadingNormal;
+    Array<Point2> texCoord;
+
+    /** Index into the path tracer's material table, or of the foam particle. */
+    Array<int> material;
+
+    Array<uint8> flags;
+
+    int size() const {
+        return flags.size();
+    }
+
+    /** Sizes every array to n rows without shrinking their storage. */
+    void resize(int n);
+
+    bool hit(int i) const {
+        return (flags[i] & HIT) != 0;
+    }
+
+    bool foam(int i) const {
+        return (flags[i] & FOAM) != 0;
+    }
+
+    /** Sets row i to a hit. */
+    void set(int i, const Point3& p, const Vector3& geometric, const Vector3& shading, const Point2& uv, int materialIndex, uint8 hitFlags) {
+        position[i] = p;
+        geometricNormal[i] = geometric;
+        shadingNormal[i] = shading;
+        texCoord[i] = uv;
+        material[i] = materialIndex;
+        flags[i] = uint8(HIT | hitFlags);
+    }
+};
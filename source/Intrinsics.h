@@ -0,0 +1,15 @@
+#pragma once
+#include <immintrin.h>
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+/**
+ * Marks a function that uses AVX intrinsics. MSVC compiles intrinsics for any instruction set; GCC and Clang need to be
+ * told per function. Callers must check FieldKernel::best() before calling one.
+ */
+#ifdef _MSC_VER
+#   define AVX_FUNCTION
+#else
+#   define AVX_FUNCTION __attribute__((target("avx")))
+#endif
@@ -0,0 +1,66 @@
+#include "LightSampler.h"
+
+void LightSampler::setContents(const Array<shared_ptr<Light>>& lights) {
+    m_lights = lights;
+    const int n = m_lights.size();
+    m_pdf.resize(n);
+    m_threshold.resize(n);
+    m_alias.resize(n);
+    if (n == 0) {
+        return;
+    }
+
+    float totalPower = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        m_pdf[i] = m_lights[i]->bulbPower().sum();
+        totalPower += m_pdf[i];
+    }
+    for (int i = 0; i < n; ++i) {
+        m_pdf[i] = (totalPower > 0.0f) ? m_pdf[i] / totalPower : 1.0f / float(n);
+    }
+
+    // Vose's method: pair each slot under the mean with a light over it, which fills the rest of the slot
+    Array<int> small;
+    Array<int> large;
+    for (int i = 0; i < n; ++i) {
+        m_threshold[i] = m_pdf[i] * float(n);
+        m_alias[i] = i;
+        if (m_threshold[i] < 1.0f) {
+            small.append(i);
+        } else {
+            large.append(i);
+        }
+    }
+    while ((small.size() > 0) && (large.size() > 0)) {
+        const int s = small.pop();
+        const int l = large.last();
+        m_alias[s] = l;
+        m_threshold[l] -= 1.0f - m_threshold[s];
+        if (m_threshold[l] < 1.0f) {
+            large.pop();
+            small.append(l);
+        }
+    }
+
+    // Whatever is left is 1 up to rounding
+    for (const int i : small) {
+        m_threshold[i] = 1.0f;
+    }
+    for (const int i : large) {
+        m_threshold[i] = 1.0f;
+    }
+}
+
+int LightSampler::sample(float u, float& pdf) const {
+    const int n = m_lights.size();
+    const float scaled = u * float(n);
+    const int slot = min(int(scaled), n - 1);
+    const int index = (scaled - float(slot) < m_threshold[slot]) ? slot : m_alias[slot];
+    pdf = m_pdf[index];
+    return index;
+}
+
+Ray LightSampler::shadowRay(const Point3& lightPosition, const Point3& point) {
+    const float len = (point - lightPosition).length() - 0.0001f;
+    return Ray::fromOriginAndDirection(lightPosition, (point - lightPosition) / len, 0.0f, len - 1e-3f).bumpedRay(0.0001f);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * Picks one light for each shading point in proportion to its power, in constant time, with Walker's alias table.
+ *
+ * The table is built once per frame. A shading point then evaluates only the light it picked, and divides that light's
+ * biradiance by the probability of picking it, so that the sum over lights stays unbiased. Lights with no power are
+ * never picked. If no light has power, every light is equally likely.
+ */
+class LightSampler {
+protected:
+    Array<shared_ptr<Light>> m_lights;
+
+    /** Probability of picking each light. */
+    Array<float> m_pdf;
+
+    /** Slot i of the table keeps light i with probability m_threshold[i] and gives way to light m_alias[i] otherwise. */
+    Array<float> m_threshold;
+    Array<int> m_alias;
+
+public:
+
+    /** Builds the table over lights. */
+    void setContents(const Array<shared_ptr<Light>>& lights);
+
+    int size() const {
+        return m_lights.size();
+    }
+
+    const shared_ptr<Light>& light(int index) const {
+        return m_lights[index];
+    }
+
+    /** Picks a light for a uniform random number u in [0, 1), and the probability it had of being picked. */
+    int sample(float u, float& pdf) const;
+
+    /** Ray from a point light to point, bumped off both ends, for testing whether point sees the light. */
+    static Ray shadowRay(const Point3& lightPosition, const Point3& point);
+};
@@ -1,12 +1,11 @@
 #include "MCubes.h"
+#include "WorkQueue.h"
+#include "FieldKernel.h"
+#include <atomic>
 
-void MCubes::Polygonise(const GRIDCELL& grid, const float isolevel, Array<CPUVertexArray::Vertex>& vertexArray)
-{
-   int i;
-   int cubeindex;
-   Point3 vertlist[12];
-
-int edgeTable[256] = {
+/* Paul Bourke's lookup tables. These live at file scope so that they are
+   initialized once instead of being rebuilt on the stack for every cell. */
+static const int edgeTable[256] = {
 0x0  , 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
 0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
 0x190, 0x99 , 0x393, 0x29a, 0x596, 0x49f, 0x795, 0x69c,
@@ -40,7 +39,7 @@ int edgeTable[256] = {
 0xf00, 0xe09, 0xd03, 0xc0a, 0xb06, 0xa0f, 0x905, 0x80c,
 0x70c, 0x605, 0x50f, 0x406, 0x30a, 0x203, 0x109, 0x0   };
 
-int triTable[256][16] =
+static const int triTable[256][16] =
 {{-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
 {0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
 {0, 1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
@@ -298,11 +297,8 @@ int triTable[256][16] =
 {0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
 {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}};
 
-   /*
-      Determine the index into the edge table which
-      tells us which vertices are inside of the surface
-   */
-   cubeindex = 0;
+int MCubes::cubeIndex(const GRIDCELL& grid, const float isolevel) {
+   int cubeindex = 0;
    if (grid.val[0] < isolevel) cubeindex |= 1;
    if (grid.val[1] < isolevel) cubeindex |= 2;
    if (grid.val[2] < isolevel) cubeindex |= 4;
@@ -311,10 +307,41 @@ int triTable[256][16] =
    if (grid.val[5] < isolevel) cubeindex |= 32;
    if (grid.val[6] < isolevel) cubeindex |= 64;
    if (grid.val[7] < isolevel) cubeindex |= 128;
+   return cubeindex;
+}
+
+int MCubes::triangleCount(const int cubeindex) {
+   int n = 0;
+   while (triTable[cubeindex][3 * n] != -1) {
+      ++n;
+   }
+   return n;
+}
+
+void MCubes::Polygonise(const GRIDCELL& grid, const float isolevel, Array<CPUVertexArray::Vertex>& vertexArray)
+{
+   CPUVertexArray::Vertex triangles[MAX_CELL_VERTICES];
+   const int numVertices = Polygonise(grid, isolevel, triangles);
+   for (int i = 0; i < numVertices; ++i) {
+      vertexArray.append(triangles[i]);
+   }
+}
+
+int MCubes::Polygonise(const GRIDCELL& grid, const float isolevel, CPUVertexArray::Vertex* vertices)
+{
+   int i;
+   int cubeindex;
+   Point3 vertlist[12];
+
+   /*
+      Determine the index into the edge table which
+      tells us which vertices are inside of the surface
+   */
+   cubeindex = cubeIndex(grid, isolevel);
 
    /* Cube is entirely in/out of the surface */
    if (edgeTable[cubeindex] == 0)
-      return;
+      return 0;
 
    /* Find the vertices where the surface intersects the cube */
    if (edgeTable[cubeindex] & 1)
@@ -355,26 +382,27 @@ int triTable[256][16] =
          VertexInterp(isolevel,grid.p[3],grid.p[7],grid.val[3],grid.val[7]);
 
    /* Create the triangle */
+   int numVertices = 0;
    for (i=0;triTable[cubeindex][i]!=-1;i+=3) {
 
 
-      CPUVertexArray::Vertex& v0 = vertexArray.next();
+      CPUVertexArray::Vertex& v0 = vertices[numVertices++];
       v0.position= vertlist[triTable[cubeindex][i  ]];
       v0.normal  = Vector3::nan();
       v0.tangent = Vector4::nan();
 
-	  CPUVertexArray::Vertex& v1 = vertexArray.next();
+	  CPUVertexArray::Vertex& v1 = vertices[numVertices++];
       v1.position= vertlist[triTable[cubeindex][i +1 ]];
       v1.normal  = Vector3::nan();
       v1.tangent = Vector4::nan();
 
-	  CPUVertexArray::Vertex& v2 = vertexArray.next();
+	  CPUVertexArray::Vertex& v2 = vertices[numVertices++];
       v2.normal  = Vector3::nan();
       v2.tangent = Vector4::nan();
       v2.position= vertlist[triTable[cubeindex][i+2 ]];
 
    }
-   return;
+   return numVertices;
 }
 
 Point3 MCubes::VertexInterp(const float isolevel,const Point3 p1,const Point3 p2,const float valp1,const float valp2){
@@ -398,49 +426,104 @@ Point3 MCubes::VertexInterp(const float isolevel,const Point3 p1,const Point3 p2
 
 
 //we start at bottom left back corner
-void MCubes::updateCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Vector3>& hashGrid){
+void MCubes::setCellCorners(GRIDCELL& grid, const Point3& p, const float size) const {
 	grid.p[0] = p;
-    grid.p[1] = p + Point3(step,0,0);
-    grid.p[2] = p + Point3(step,0,step);
-    grid.p[3] = p + Point3(0,0,step);
-    grid.p[4] = p + Point3(0,step,0);
-    grid.p[5] = p + Point3(step,step,0);
-    grid.p[6] = p + Point3(step,step,step);
-    grid.p[7] = p + Point3(0,step,step);
-
-	float tempVal0 = 1e10f;
-	float tempVal1 = 1e10f;
-	float tempVal2 = 1e10f;
-	float tempVal3 = 1e10f;
-	float tempVal4 = 1e10f;
-	float tempVal5 = 1e10f;
-	float tempVal6 = 1e10f;
-	float tempVal7 = 1e10f;
-
-    float bradius = radius+step;
+    grid.p[1] = p + Point3(size,0,0);
+    grid.p[2] = p + Point3(size,0,size);
+    grid.p[3] = p + Point3(0,0,size);
+    grid.p[4] = p + Point3(0,size,0);
+    grid.p[5] = p + Point3(size,size,0);
+    grid.p[6] = p + Point3(size,size,size);
+    grid.p[7] = p + Point3(0,size,size);
+}
+
+void MCubes::updateCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Vector3>& hashGrid){
+    updateCell(grid, p, hashGrid, step);
+}
+
+void MCubes::updateCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Vector3>& hashGrid, const float cellSize){
+    setCellCorners(grid, p, cellSize);
+
+    float bradius = radius+cellSize;
     Point3 low(p.x - bradius, p.y - bradius, p.z - bradius);
     Point3 high(p.x + bradius, p.y + bradius, p.z + bradius);
 
+    // Gather the nearby particles once so that the kernel can test each against all 8 corners at a time.
+    // One buffer per thread, reused across cells to avoid allocating.
+    static thread_local FieldKernel::NeighborBuffer neighbors;
+    neighbors.clear();
+
     AABox box(low, high);
     for(PointHashGrid<Vector3>::BoxIterator iter = hashGrid.beginBoxIntersection(box, false); iter != hashGrid.endBoxIntersection(); ++iter) {
-		tempVal0 = min(tempVal0,(grid.p[0] - *iter).squaredLength());
-		tempVal1 = min(tempVal1,(grid.p[1] - *iter).squaredLength());
-		tempVal2 = min(tempVal2,(grid.p[2] - *iter).squaredLength());
-		tempVal3 = min(tempVal3,(grid.p[3] - *iter).squaredLength());
-		tempVal4 = min(tempVal4,(grid.p[4] - *iter).squaredLength());
-		tempVal5 = min(tempVal5,(grid.p[5] - *iter).squaredLength());
-		tempVal6 = min(tempVal6,(grid.p[6] - *iter).squaredLength());
-		tempVal7 = min(tempVal7,(grid.p[7] - *iter).squaredLength());
-    }
-
-	grid.val[0] = sqrt(tempVal0) - radius;
-	grid.val[1] = sqrt(tempVal1) - radius;
-	grid.val[2] = sqrt(tempVal2) - radius;
-	grid.val[3] = sqrt(tempVal3) - radius;
-	grid.val[4] = sqrt(tempVal4) - radius;
-	grid.val[5] = sqrt(tempVal5) - radius;
-	grid.val[6] = sqrt(tempVal6) - radius;
-	grid.val[7] = sqrt(tempVal7) - radius;
+        neighbors.append(*iter);
+    }
+
+    FieldKernel::Corners corners;
+    for (int k = 0; k < 8; ++k) {
+        corners.x[k] = grid.p[k].x;
+        corners.y[k] = grid.p[k].y;
+        corners.z[k] = grid.p[k].z;
+    }
+
+    FieldKernel::evaluate(m_options.fieldKernel, corners, neighbors, radius, grid.val);
+}
+
+void MCubes::updateKernelCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Kernel, Kernel, Kernel>& kernelGrid, const float cellSize) {
+    setCellCorners(grid, p, cellSize);
+
+    float density[8] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+
+    const float bradius = fieldRadius + cellSize;
+    const AABox box(p - Vector3(bradius, bradius, bradius), p + Vector3(bradius, bradius, bradius));
+    for (PointHashGrid<Kernel, Kernel, Kernel>::BoxIterator iter = kernelGrid.beginBoxIntersection(box, false); iter != kernelGrid.endBoxIntersection(); ++iter) {
+        const Kernel& kernel = *iter;
+        for (int c = 0; c < 8; ++c) {
+            // Squared distance in the kernel's own space, where its support is the unit ball
+            const Vector3 d = grid.p[c] - kernel.center;
+            const float u = d.dot(kernel.axis[0]);
+            const float v = d.dot(kernel.axis[1]);
+            const float w = d.dot(kernel.axis[2]);
+            const float s = u * u + v * v + w * w;
+            if (s < 1.0f) {
+                const float t = 1.0f - s;
+                density[c] += t * t * t;
+            }
+        }
+    }
+
+    // Inside the water is negative, as with the sphere distance field
+    for (int c = 0; c < 8; ++c) {
+        grid.val[c] = m_options.isoThreshold - density[c];
+    }
+}
+
+float MCubes::sphereFieldAt(const Point3& p, const float padding, const PointHashGrid<Vector3>& hashGrid) const {
+    // Searching as far as a cell of size padding would keeps the value consistent with updateCell on edges that the surface crosses
+    const float bradius = radius + padding;
+    const AABox box(p - Vector3(bradius, bradius, bradius), p + Vector3(bradius, bradius, bradius));
+    float best = 1e10f;
+    for (PointHashGrid<Vector3>::BoxIterator iter = hashGrid.beginBoxIntersection(box, false); iter != hashGrid.endBoxIntersection(); ++iter) {
+        best = min(best, (p - *iter).squaredLength());
+    }
+    return sqrt(best) - radius;
+}
+
+float MCubes::kernelFieldAt(const Point3& p, const PointHashGrid<Kernel, Kernel, Kernel>& kernelGrid) const {
+    const AABox box(p - Vector3(fieldRadius, fieldRadius, fieldRadius), p + Vector3(fieldRadius, fieldRadius, fieldRadius));
+    float density = 0.0f;
+    for (PointHashGrid<Kernel, Kernel, Kernel>::BoxIterator iter = kernelGrid.beginBoxIntersection(box, false); iter != kernelGrid.endBoxIntersection(); ++iter) {
+        const Kernel& kernel = *iter;
+        const Vector3 d = p - kernel.center;
+        const float u = d.dot(kernel.axis[0]);
+        const float v = d.dot(kernel.axis[1]);
+        const float w = d.dot(kernel.axis[2]);
+        const float s = u * u + v * v + w * w;
+        if (s < 1.0f) {
+            const float t = 1.0f - s;
+            density += t * t * t;
+        }
+    }
+    return m_options.isoThreshold - density;
 }
 
 void MCubes::triangulateGrid(GRIDCELL& grid, const Point3& botCoord, Array<CPUVertexArray::Vertex>& vertexArray, const PointHashGrid<Vector3>& hashGrid){
@@ -449,24 +532,75 @@ void MCubes::triangulateGrid(GRIDCELL& grid, const Point3& botCoord, Array<CPUVe
     Polygonise(grid, 0, vertexArray );
 }
 
-void MCubes::marchCubes(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray){
-    PointHashGrid<Vector3> hashGrid(radius+step);
-    hashGrid.insert(m_points);
+void MCubes::marchCubes(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray, BrickCache* cache){
+    // Only the grid for the current field is populated. Cells up to twice as wide as the field's reach only add a few
+    // candidates to each search, so the grids are kept until the reach changes by more than that.
+    const float cellWidth = fieldRadius + step;
+    if (isNull(m_hashGrid) || (m_gridCellWidth < cellWidth) || (m_gridCellWidth > 2.0f * cellWidth)) {
+        m_gridCellWidth = 1.25f * cellWidth;
+        m_hashGrid = std::make_shared<PointHashGrid<Vector3>>(m_gridCellWidth);
+        m_kernelGrid = std::make_shared<PointHashGrid<Kernel, Kernel, Kernel>>(m_gridCellWidth);
+    } else {
+        m_hashGrid->clear(false);
+        m_kernelGrid->clear(false);
+    }
+    PointHashGrid<Vector3>& hashGrid = *m_hashGrid;
+    PointHashGrid<Kernel, Kernel, Kernel>& kernelGrid = *m_kernelGrid;
+    CellEvaluator evaluateCell;
+    PointEvaluator evaluatePoint;
+    if (m_options.field == ANISOTROPIC_KERNEL) {
+        kernelGrid.insert(m_kernels);
+        evaluateCell = [&](GRIDCELL& grid, const Point3& p, float cellSize) { updateKernelCell(grid, p, kernelGrid, cellSize); };
+        evaluatePoint = [&](const Point3& p, float padding) { return kernelFieldAt(p, kernelGrid); };
+    } else {
+        hashGrid.insert(m_points);
+        evaluateCell = [&](GRIDCELL& grid, const Point3& p, float cellSize) { updateCell(grid, p, hashGrid, cellSize); };
+        evaluatePoint = [&](const Point3& p, float padding) { return sphereFieldAt(p, padding, hashGrid); };
+    }
+
+    Array<Point3> seeds;
+    findSeedParticles(seeds);
+    m_stats = Stats();
+    m_stats.particles = m_points.size();
+    m_stats.skippedParticles = m_points.size() - seeds.size();
+
+    const bool incremental = m_options.parallel && m_options.incremental && (m_options.extractor == MARCHING_CUBES);
+    if (notNull(cache) && ! incremental) {
+        // Nothing maintains the cache this frame, so it must not be trusted next frame
+        cache->clear();
+    }
+
+    if (m_options.extractor == SURFACE_NETS) {
+        extractSurfaceNets(seeds, evaluateCell, vertexArray, indexArray);
+        return;
+    }
+
+    if (m_options.parallel) {
+        marchBricks(seeds, evaluateCell, evaluatePoint, incremental ? cache : nullptr, vertexArray, indexArray);
+        return;
+    }
 
 	GRIDCELL grid;
+    gridFlagTable.clear();
 	// Bounds search
-	int bound = radius* invStep + 1;
-    for (int i = 0; i < m_points.size(); ++i) {
-        int a = m_points[i].x * invStep;
-        int b = m_points[i].y * invStep;
-        int c = m_points[i].z * invStep;
+	int bound = fieldRadius* invStep + 1;
+    for (int i = 0; i < seeds.size(); ++i) {
+        int a = seeds[i].x * invStep;
+        int b = seeds[i].y * invStep;
+        int c = seeds[i].z * invStep;
 
         for (int x = a - bound; x < a + bound + 1; x++ ){
              for (int  y = b - bound; y < b + bound + 1; y++ ){
                 for (int z = c - bound; z < c + bound + 1; z++ ){
                     if (!gridFlagTable.containsKey(Point3(x,y,z))){
-                        triangulateGrid(grid,Point3(x*step,y*step,z*step), vertexArray, hashGrid);
                         gridFlagTable.set(Point3(x,y,z), true);
+
+                        // Cells are culled by the brick they fall in, as the parallel mesher does
+                        if (isBrickVisible(Point3int32(x >> BRICK_SHIFT, y >> BRICK_SHIFT, z >> BRICK_SHIFT))) {
+                            evaluateCell(grid, Point3(x*step,y*step,z*step), step);
+                            Polygonise(grid, 0, vertexArray);
+                            ++m_stats.visitedCells;
+                        }
                     }
                 }   
             }
@@ -478,11 +612,890 @@ void MCubes::marchCubes(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>&
     return;
 }
 
-MCubes::MCubes(Array<Point3> points, float _rad, float _step){
-    m_points = points;
+void MCubes::findSeedParticles(Array<Point3>& seeds) const {
+    if (! m_options.skipInteriorParticles) {
+        seeds = m_points;
+        return;
+    }
+
+    // Search the same neighborhood that a particle's cells see
+    const float searchRadius = fieldRadius + step;
+    PointHashGrid<Vector3> neighborGrid(searchRadius);
+    neighborGrid.insert(m_points);
+
+    Array<bool> isSurface;
+    isSurface.resize(m_points.size());
+    Thread::runConcurrently(0, m_points.size(), [&](int i) {
+        const Point3& p = m_points[i];
+        const AABox box(p - Vector3(searchRadius, searchRadius, searchRadius), p + Vector3(searchRadius, searchRadius, searchRadius));
+
+        int count = 0;
+        Vector3 offset(0, 0, 0);
+        for (PointHashGrid<Vector3>::BoxIterator iter = neighborGrid.beginBoxIntersection(box, false); iter != neighborGrid.endBoxIntersection(); ++iter) {
+            const Vector3 d = *iter - p;
+            if (d.squaredLength() <= square(searchRadius)) {
+                offset += d;
+                ++count;
+            }
+        }
+
+        // The neighbors of an interior particle surround it evenly, so their centroid is at the particle
+        isSurface[i] = (count < m_options.interiorNeighborCount) ||
+            (offset.length() > m_options.surfaceGradientThreshold * searchRadius * count);
+    });
+
+    seeds.fastClear();
+    for (int i = 0; i < m_points.size(); ++i) {
+        if (isSurface[i]) {
+            seeds.append(m_points[i]);
+        }
+    }
+}
+
+void MCubes::findActiveBricks(const Array<Point3>& seeds, Array<Brick>& brickArray) const {
+    Table<Point3int32, int> brickIndexTable;
+    const int bound = int(fieldRadius * invStep) + 1;
+
+    for (int i = 0; i < seeds.size(); ++i) {
+        // The same neighborhood of cells that the serial mesher visits
+        const Point3int32 lo(iFloor(seeds[i].x * invStep) - bound, iFloor(seeds[i].y * invStep) - bound, iFloor(seeds[i].z * invStep) - bound);
+        const Point3int32 hi(lo.x + 2 * bound, lo.y + 2 * bound, lo.z + 2 * bound);
+
+        // Mark the part of the neighborhood that falls in each overlapped brick
+        for (int bz = lo.z >> BRICK_SHIFT; bz <= hi.z >> BRICK_SHIFT; ++bz) {
+            for (int by = lo.y >> BRICK_SHIFT; by <= hi.y >> BRICK_SHIFT; ++by) {
+                for (int bx = lo.x >> BRICK_SHIFT; bx <= hi.x >> BRICK_SHIFT; ++bx) {
+                    const Point3int32 coord(bx, by, bz);
+                    bool created = false;
+                    int& index = brickIndexTable.getCreate(coord, created);
+                    if (created) {
+                        index = brickArray.size();
+                        Brick& brick = brickArray.next();
+                        brick.coord = coord;
+                        memset(brick.cellMask, 0, sizeof(brick.cellMask));
+                    }
+                    Brick& brick = brickArray[index];
+
+                    const Point3int32 base(bx << BRICK_SHIFT, by << BRICK_SHIFT, bz << BRICK_SHIFT);
+                    const int x0 = max(lo.x, base.x) - base.x;
+                    const int x1 = min(hi.x, base.x + BRICK_SIZE - 1) - base.x;
+                    const uint64 row = ((uint64(1) << (x1 + 1)) - 1) & ~((uint64(1) << x0) - 1);
+                    for (int z = max(lo.z, base.z); z <= min(hi.z, base.z + BRICK_SIZE - 1); ++z) {
+                        for (int y = max(lo.y, base.y); y <= min(hi.y, base.y + BRICK_SIZE - 1); ++y) {
+                            brick.cellMask[z - base.z] |= row << (BRICK_SIZE * (y - base.y));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Particle order changes from frame to frame, so sort to make the output order depend only on the geometry
+    brickArray.sort([](const Brick& a, const Brick& b) {
+        if (a.coord.z != b.coord.z) { return a.coord.z < b.coord.z; }
+        if (a.coord.y != b.coord.y) { return a.coord.y < b.coord.y; }
+        return a.coord.x < b.coord.x;
+    });
+}
+
+bool MCubes::isBrickVisible(const Point3int32& coord) const {
+    if (! m_options.frustumCulling) {
+        return true;
+    }
+
+    const Array<Plane>& planes = m_options.view.clipPlanes;
+    const float size = BRICK_SIZE * step;
+    const Point3 low(coord.x * size, coord.y * size, coord.z * size);
+    const Point3 high(low.x + size, low.y + size, low.z + size);
+    for (int i = 0; i < planes.size(); ++i) {
+        // The corner farthest along the inward normal is the last to leave the plane's half-space
+        const Vector3& n = planes[i].normal();
+        const Point3 corner(n.x >= 0 ? high.x : low.x, n.y >= 0 ? high.y : low.y, n.z >= 0 ? high.z : low.z);
+        if (planes[i].distance(corner) < -m_options.cullMargin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void MCubes::cullBricks(Array<Brick>& brickArray) {
+    if (! m_options.frustumCulling || (m_options.view.clipPlanes.size() == 0)) {
+        return;
+    }
+
+    int numVisible = 0;
+    for (int b = 0; b < brickArray.size(); ++b) {
+        if (isBrickVisible(brickArray[b].coord)) {
+            if (numVisible != b) {
+                brickArray[numVisible] = brickArray[b];
+            }
+            ++numVisible;
+        }
+    }
+    m_stats.culledBricks = brickArray.size() - numVisible;
+    brickArray.resize(numVisible);
+}
+
+void MCubes::markBricksNear(const Point3& p, int bound, Table<Point3int32, bool>& brickTable) const {
+    const Point3int32 lo(iFloor(p.x * invStep) - bound, iFloor(p.y * invStep) - bound, iFloor(p.z * invStep) - bound);
+    const Point3int32 hi(lo.x + 2 * bound, lo.y + 2 * bound, lo.z + 2 * bound);
+    for (int bz = lo.z >> BRICK_SHIFT; bz <= hi.z >> BRICK_SHIFT; ++bz) {
+        for (int by = lo.y >> BRICK_SHIFT; by <= hi.y >> BRICK_SHIFT; ++by) {
+            for (int bx = lo.x >> BRICK_SHIFT; bx <= hi.x >> BRICK_SHIFT; ++bx) {
+                brickTable.set(Point3int32(bx, by, bz), true);
+            }
+        }
+    }
+}
+
+bool MCubes::findDirtyBricks(BrickCache& cache, Table<Point3int32, bool>& dirtyBricks) {
+    const bool kernels = (m_options.field == ANISOTROPIC_KERNEL);
+    const bool compatible = (cache.step == step) && (cache.radius == radius) && (cache.field == m_options.field) &&
+        (! kernels || ((cache.kernelScale == m_options.kernelScale) && (cache.isoThreshold == m_options.isoThreshold))) &&
+        (cache.curvatureAngle == m_options.curvatureAngle);
+
+    // A particle influences the cells within the larger of the old and new field radii
+    const int bound = int(max(fieldRadius, cache.fieldRadius) * invStep) + 1;
+
+    cache.step = step;
+    cache.radius = radius;
+    cache.fieldRadius = fieldRadius;
+    cache.field = m_options.field;
+    cache.kernelScale = m_options.kernelScale;
+    cache.isoThreshold = m_options.isoThreshold;
+    cache.curvatureAngle = m_options.curvatureAngle;
+
+    if (! compatible) {
+        cache.clear();
+    }
+
+    const int oldCount = cache.points.size();
+    const float tolerance = m_options.remeshTolerance * step;
+
+    // Particles that disappeared leave their old neighborhood dirty
+    for (int i = m_points.size(); i < oldCount; ++i) {
+        markBricksNear(cache.points[i], bound, dirtyBricks);
+        ++m_stats.movedParticles;
+    }
+    cache.points.resize(m_points.size());
+    if (kernels) {
+        cache.semiAxes.resize(3 * m_points.size());
+    }
+
+    for (int i = 0; i < m_points.size(); ++i) {
+        const bool isNew = (i >= oldCount);
+        bool moved = isNew || ((m_points[i] - cache.points[i]).squaredLength() > square(tolerance));
+
+        // Kernel.axis stores axis / radius, so axis / |axis|^2 is the semi-axis with its radius as length
+        Vector3 semiAxis[3];
+        if (kernels) {
+            for (int a = 0; a < 3; ++a) {
+                const Vector3& axis = m_kernels[i].axis[a];
+                semiAxis[a] = axis / axis.squaredLength();
+                // The solver may flip an axis between frames without changing the ellipsoid
+                const Vector3& old = cache.semiAxes[3 * i + a];
+                moved = moved || (min((semiAxis[a] - old).squaredLength(), (semiAxis[a] + old).squaredLength()) > square(tolerance));
+            }
+        }
+
+        if (moved) {
+            if (! isNew) {
+                markBricksNear(cache.points[i], bound, dirtyBricks);
+            }
+            markBricksNear(m_points[i], bound, dirtyBricks);
+            cache.points[i] = m_points[i];
+            if (kernels) {
+                for (int a = 0; a < 3; ++a) {
+                    cache.semiAxes[3 * i + a] = semiAxis[a];
+                }
+            }
+            ++m_stats.movedParticles;
+        }
+    }
+
+    return compatible && (oldCount > 0);
+}
+
+/** Corner k of a GRIDCELL, in cells from its lowest corner. */
+static const int CORNER_OFFSET[8][3] = {
+    {0, 0, 0}, {1, 0, 0}, {1, 0, 1}, {0, 0, 1},
+    {0, 1, 0}, {1, 1, 0}, {1, 1, 1}, {0, 1, 1} };
+
+static const int NUM_NEIGHBORS = 26;
+
+/** The 26 bricks around a brick. The 6 face neighbors come first, in -x, +x, -y, +y, -z, +z order. */
+static const int NEIGHBOR_OFFSET[NUM_NEIGHBORS][3] = {
+    {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1},
+    {-1, -1, 0}, {1, -1, 0}, {-1, 1, 0}, {1, 1, 0},
+    {-1, 0, -1}, {1, 0, -1}, {-1, 0, 1}, {1, 0, 1},
+    {0, -1, -1}, {0, 1, -1}, {0, -1, 1}, {0, 1, 1},
+    {-1, -1, -1}, {1, -1, -1}, {-1, 1, -1}, {1, 1, -1},
+    {-1, -1, 1}, {1, -1, 1}, {-1, 1, 1}, {1, 1, 1} };
+
+static Point3int32 neighborCoord(const Point3int32& coord, int i) {
+    return Point3int32(coord.x + NEIGHBOR_OFFSET[i][0], coord.y + NEIGHBOR_OFFSET[i][1], coord.z + NEIGHBOR_OFFSET[i][2]);
+}
+
+bool MCubes::isCurved(const Brick& brick) {
+    const float cosAngle = cos(toRadians(m_options.curvatureAngle));
+
+    Array<Vector3> normals;
+    Vector3 sum(0, 0, 0);
+    CPUVertexArray::Vertex triangles[MAX_CELL_VERTICES];
+    for (int c = 0; c < brick.surfaceCells.size(); ++c) {
+        const int n = Polygonise(brick.surfaceCells[c], 0, triangles);
+        for (int t = 0; t < n; t += 3) {
+            const Vector3 normal = (triangles[t + 1].position - triangles[t].position).cross(triangles[t + 2].position - triangles[t].position);
+            if (normal.squaredLength() > 0.0f) {
+                normals.append(normal.direction());
+                sum += normals.last();
+            }
+        }
+    }
+
+    // A closed droplet has no average direction, so it always counts as curved
+    const Vector3 average = sum.directionOrZero();
+    for (int i = 0; i < normals.size(); ++i) {
+        if (normals[i].dot(average) < cosAngle) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MCubes::chooseBrickLevels(Array<Brick>& brickArray, Table<Point3int32, int>& levelTable, const CellEvaluator& evaluateCell) {
+    const bool adaptive = m_options.adaptive && (m_options.view.pixelsPerRadian > 0.0f);
+    const float brickWidth = BRICK_SIZE * step;
+    const float brickRadius = 0.5f * sqrt(3.0f) * brickWidth;
+
+    runDynamically(brickArray.size(), [&](int b) {
+        Brick& brick = brickArray[b];
+        brick.level = 0;
+        brick.distanceLevel = -1;
+        brick.preferredLevel = 0;
+        brick.coarserNeighbors = 0;
+        brick.projectedStep = 0.0f;
+        brick.evaluatedLevel = -1;
+        if (! adaptive) {
+            return;
+        }
+
+        const Point3 center = (Vector3(float(brick.coord.x), float(brick.coord.y), float(brick.coord.z)) + Vector3(0.5f, 0.5f, 0.5f)) * brickWidth;
+        const float distance = max((center - m_options.view.position).length() - brickRadius, step);
+        brick.projectedStep = step * m_options.view.pixelsPerRadian / distance;
+
+        // The coarsest level whose cells stay within the pixel error
+        brick.distanceLevel = 0;
+        while ((brick.distanceLevel + 1 < MAX_LOD_LEVELS) && (brick.projectedStep * (2 << brick.distanceLevel) <= m_options.pixelError)) {
+            ++brick.distanceLevel;
+        }
+
+        if (notNull(brick.cached) && (brick.cached->distanceLevel == brick.distanceLevel)) {
+            // Nothing near the brick moved, so the curvature test would come out the same
+            brick.preferredLevel = brick.cached->preferredLevel;
+        } else {
+            brick.preferredLevel = brick.distanceLevel;
+            if (brick.preferredLevel > 0) {
+                // Refine where the coarse surface bends
+                brick.level = brick.preferredLevel;
+                evaluateBrick(brick, evaluateCell, nullptr, PointEvaluator());
+                if (isCurved(brick)) {
+                    --brick.preferredLevel;
+                }
+            }
+        }
+        brick.level = brick.preferredLevel;
+    });
+
+    for (int b = 0; b < brickArray.size(); ++b) {
+        levelTable.set(brickArray[b].coord, brickArray[b].level);
+    }
+    if (! adaptive) {
+        return;
+    }
+
+    // Balance so that bricks that touch, even at a corner, differ by at most one level. Levels only decrease, so this terminates.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = 0; b < brickArray.size(); ++b) {
+            Brick& brick = brickArray[b];
+            for (int i = 0; i < NUM_NEIGHBORS; ++i) {
+                const int* neighborLevel = levelTable.getPointer(neighborCoord(brick.coord, i));
+                if (notNull(neighborLevel) && (*neighborLevel + 1 < brick.level)) {
+                    brick.level = *neighborLevel + 1;
+                    levelTable.set(brick.coord, brick.level);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    runDynamically(brickArray.size(), [&](int b) {
+        Brick& brick = brickArray[b];
+        for (int i = 0; i < NUM_NEIGHBORS; ++i) {
+            const int* neighborLevel = levelTable.getPointer(neighborCoord(brick.coord, i));
+            if (notNull(neighborLevel) && (*neighborLevel > brick.level)) {
+                brick.coarserNeighbors |= (1u << i);
+            }
+        }
+    });
+}
+
+bool MCubes::touchesCoarserBrick(const Point3int32& q, int level, const Table<Point3int32, int>& levelTable) const {
+    // Along axes where q is on a brick boundary it touches the bricks on both sides
+    const int c[3] = { q.x, q.y, q.z };
+    int lo[3];
+    int hi[3];
+    bool onBoundary = false;
+    for (int a = 0; a < 3; ++a) {
+        lo[a] = hi[a] = c[a] >> BRICK_SHIFT;
+        if ((c[a] & (BRICK_SIZE - 1)) == 0) {
+            --lo[a];
+            onBoundary = true;
+        }
+    }
+    if (! onBoundary) {
+        return false;
+    }
+
+    for (int bz = lo[2]; bz <= hi[2]; ++bz) {
+        for (int by = lo[1]; by <= hi[1]; ++by) {
+            for (int bx = lo[0]; bx <= hi[0]; ++bx) {
+                const int* neighborLevel = levelTable.getPointer(Point3int32(bx, by, bz));
+                if (notNull(neighborLevel) && (*neighborLevel > level)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+float MCubes::coarseLatticeValue(const Point3int32& q, int shift, const PointEvaluator& evaluatePoint) const {
+    const int width = 1 << shift;
+    const int c[3] = { q.x, q.y, q.z };
+    int cell[3];
+    float t[3];
+    for (int a = 0; a < 3; ++a) {
+        cell[a] = c[a] >> shift;
+        t[a] = float(c[a] - cell[a] * width) / width;
+    }
+
+    // Multilinear interpolation, which is what marching cubes assumes between the coarse brick's samples
+    float value = 0.0f;
+    for (int k = 0; k < 8; ++k) {
+        float weight = 1.0f;
+        int corner[3];
+        for (int a = 0; a < 3; ++a) {
+            const int bit = (k >> a) & 1;
+            weight *= bit ? t[a] : (1.0f - t[a]);
+            corner[a] = (cell[a] + bit) * width;
+        }
+        if (weight > 0.0f) {
+            value += weight * evaluatePoint(Point3(corner[0] * step, corner[1] * step, corner[2] * step), width * step);
+        }
+    }
+    return value;
+}
+
+void MCubes::evaluateLatticeCell(GRIDCELL& grid, const Point3int32& q, int level, const CellEvaluator& evaluateCell, const Table<Point3int32, int>* levelTable, const PointEvaluator& evaluatePoint) {
+    evaluateCell(grid, Point3(q.x * step, q.y * step, q.z * step), step * (1 << level));
+    if (isNull(levelTable)) {
+        return;
+    }
+
+    // Match the coarser brick's samples on the shared boundary
+    for (int k = 0; k < 8; ++k) {
+        const Point3int32 corner(q.x + (CORNER_OFFSET[k][0] << level), q.y + (CORNER_OFFSET[k][1] << level), q.z + (CORNER_OFFSET[k][2] << level));
+        if (touchesCoarserBrick(corner, level, *levelTable)) {
+            grid.val[k] = coarseLatticeValue(corner, level + 1, evaluatePoint);
+        }
+    }
+}
+
+void MCubes::snapToCoarseBrick(Point3& v, const Brick& brick, const CellEvaluator& evaluateCell, const PointEvaluator& evaluatePoint,
+    const Table<Point3int32, int>& levelTable, Array<CoarseFace>& faces) {
+
+    const int coarseLevel = brick.level + 1;
+    const int width = 1 << coarseLevel;
+    const float epsilon = 1e-4f * step;
+    const int coord[3] = { brick.coord.x, brick.coord.y, brick.coord.z };
+
+    for (int i = 0; i < NUM_NEIGHBORS; ++i) {
+        if ((brick.coarserNeighbors & (1u << i)) == 0) {
+            continue;
+        }
+
+        // The coarse cell of the neighbor that touches v, if v is on the boundary they share
+        int cell[3];
+        int axis = -1;
+        int plane = 0;
+        bool onBoundary = true;
+        for (int a = 0; (a < 3) && onBoundary; ++a) {
+            const int offset = NEIGHBOR_OFFSET[i][a];
+            if (offset == 0) {
+                const int lo = coord[a] * BRICK_SIZE;
+                cell[a] = iClamp(iFloor(v[a] / (width * step)) * width, lo, lo + BRICK_SIZE - width);
+                continue;
+            }
+            const int p = (coord[a] + ((offset > 0) ? 1 : 0)) * BRICK_SIZE;
+            onBoundary = std::abs(v[a] - p * step) <= epsilon;
+            cell[a] = (offset > 0) ? p : (p - width);
+            if (axis == -1) {
+                axis = a;
+                plane = p;
+            }
+        }
+        if (! onBoundary) {
+            continue;
+        }
+
+        const Point3int32 q(cell[0], cell[1], cell[2]);
+        const CoarseFace* face = nullptr;
+        for (int f = 0; f < faces.size(); ++f) {
+            if ((faces[f].cell == q) && (faces[f].axis == axis)) {
+                face = &faces[f];
+                break;
+            }
+        }
+
+        if (isNull(face)) {
+            // Polygonise the cell exactly as the coarse brick does, so that saddles resolve the same way
+            CoarseFace& created = faces.next();
+            created.cell = q;
+            created.axis = axis;
+            created.plane = plane;
+            created.edges.fastClear();
+
+            GRIDCELL grid;
+            evaluateLatticeCell(grid, q, coarseLevel, evaluateCell, &levelTable, evaluatePoint);
+            CPUVertexArray::Vertex triangles[MAX_CELL_VERTICES];
+            const int numVertices = Polygonise(grid, 0, triangles);
+            for (int t = 0; t < numVertices; t += 3) {
+                for (int e = 0; e < 3; ++e) {
+                    const Point3& p0 = triangles[t + e].position;
+                    const Point3& p1 = triangles[t + (e + 1) % 3].position;
+                    if ((std::abs(p0[axis] - plane * step) <= epsilon) && (std::abs(p1[axis] - plane * step) <= epsilon)) {
+                        created.edges.append(p0, p1);
+                    }
+                }
+            }
+            face = &created;
+        }
+
+        // Collapse onto the nearer end of the nearest coarse edge
+        float bestDistance = finf();
+        Point3 best = v;
+        for (int e = 0; e + 1 < face->edges.size(); e += 2) {
+            const Point3& p0 = face->edges[e];
+            const Point3& p1 = face->edges[e + 1];
+            const float distance = (LineSegment::fromTwoPoints(p0, p1).closestPoint(v) - v).squaredLength();
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = ((p0 - v).squaredLength() <= (p1 - v).squaredLength()) ? p0 : p1;
+            }
+        }
+        v = best;
+        return;
+    }
+}
+
+int MCubes::evaluateBrick(Brick& brick, const CellEvaluator& evaluateCell, const Table<Point3int32, int>* levelTable, const PointEvaluator& evaluatePoint) {
+    brick.triangleCount = 0;
+    brick.surfaceCells.fastClear();
+
+    const int level = brick.level;
+    const int cells = BRICK_SIZE >> level;
+    const Point3int32 base(brick.coord.x << BRICK_SHIFT, brick.coord.y << BRICK_SHIFT, brick.coord.z << BRICK_SHIFT);
+
+    // A coarse cell is active if any of the step-sized cells it covers is
+    bool active[BRICK_SIZE * BRICK_SIZE * BRICK_SIZE];
+    memset(active, 0, sizeof(active));
+    for (int z = 0; z < BRICK_SIZE; ++z) {
+        const uint64 slab = brick.cellMask[z];
+        for (int bit = 0; (bit < BRICK_SIZE * BRICK_SIZE) && (slab >> bit); ++bit) {
+            if ((slab & (uint64(1) << bit)) == 0) { continue; }
+
+            const int x = bit & (BRICK_SIZE - 1);
+            const int y = bit >> BRICK_SHIFT;
+            active[((z >> level) * cells + (y >> level)) * cells + (x >> level)] = true;
+        }
+    }
+
+    const bool stitch = notNull(levelTable) && (brick.coarserNeighbors != 0);
+    brick.evaluatedLevel = stitch ? -1 : level;
+    int visitedCells = 0;
+    GRIDCELL grid;
+    for (int z = 0; z < cells; ++z) {
+        for (int y = 0; y < cells; ++y) {
+            for (int x = 0; x < cells; ++x) {
+                if (! active[(z * cells + y) * cells + x]) { continue; }
+
+                const Point3int32 q(base.x + (x << level), base.y + (y << level), base.z + (z << level));
+                evaluateLatticeCell(grid, q, level, evaluateCell, stitch ? levelTable : nullptr, evaluatePoint);
+                ++visitedCells;
+
+                const int n = triangleCount(cubeIndex(grid, 0));
+                if (n > 0) {
+                    brick.surfaceCells.append(grid);
+                    brick.triangleCount += n;
+                }
+            }
+        }
+    }
+    return visitedCells;
+}
+
+void MCubes::marchBricks(const Array<Point3>& seeds, const CellEvaluator& evaluateCell, const PointEvaluator& evaluatePoint, BrickCache* cache, Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray) {
+    Array<Brick> brickArray;
+    findActiveBricks(seeds, brickArray);
+    cullBricks(brickArray);
+    std::atomic<int> visitedCells(0);
+
+    Table<Point3int32, bool> dirtyBricks;
+    const bool reuse = notNull(cache) && findDirtyBricks(*cache, dirtyBricks);
+
+    // Nothing near a clean brick moved, so its triangles are still good as long as the same cells are active
+    runDynamically(brickArray.size(), [&](int b) {
+        Brick& brick = brickArray[b];
+        brick.cached = nullptr;
+        if (reuse && ! dirtyBricks.containsKey(brick.coord)) {
+            const CachedBrick* cached = cache->bricks.getPointer(brick.coord);
+            if (notNull(cached) && (memcmp(cached->cellMask, brick.cellMask, sizeof(brick.cellMask)) == 0)) {
+                brick.cached = cached;
+            }
+        }
+    });
+
+    Table<Point3int32, int> levelTable;
+    chooseBrickLevels(brickArray, levelTable, evaluateCell);
+
+    // The cached triangles are only valid at the same level with the same transitions
+    runDynamically(brickArray.size(), [&](int b) {
+        Brick& brick = brickArray[b];
+        if (notNull(brick.cached) && ((brick.cached->level != brick.level) || (brick.cached->coarserNeighbors != brick.coarserNeighbors))) {
+            brick.cached = nullptr;
+        }
+    });
+
+    if (reuse && m_options.adaptive) {
+        // The finer side of a transition snaps to the coarser side's triangles, so both must come from the same frame
+        Table<Point3int32, int> brickIndex;
+        for (int b = 0; b < brickArray.size(); ++b) {
+            brickIndex.set(brickArray[b].coord, b);
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int b = 0; b < brickArray.size(); ++b) {
+                Brick& brick = brickArray[b];
+                for (int i = 0; i < NUM_NEIGHBORS; ++i) {
+                    if ((brick.coarserNeighbors & (1u << i)) == 0) { continue; }
+
+                    Brick& neighbor = brickArray[brickIndex[neighborCoord(brick.coord, i)]];
+                    if (isNull(brick.cached) != isNull(neighbor.cached)) {
+                        brick.cached = nullptr;
+                        neighbor.cached = nullptr;
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // Pass 1: evaluate every marked cell and count the triangles each brick will produce
+    runDynamically(brickArray.size(), [&](int b) {
+        Brick& brick = brickArray[b];
+        if (notNull(brick.cached)) {
+            brick.triangleCount = brick.cached->vertices.size() / 3;
+            return;
+        }
+
+        // The curvature test already evaluated the brick at this level, and there is nothing to stitch
+        if ((brick.evaluatedLevel == brick.level) && (brick.coarserNeighbors == 0)) {
+            return;
+        }
+
+        visitedCells += evaluateBrick(brick, evaluateCell, &levelTable, evaluatePoint);
+    });
+    m_stats.visitedCells = visitedCells;
+
+    // Exclusive prefix sum over the counts gives every brick its own slice of the output
+    const int start = vertexArray.size();
+    int numVertices = start;
+    for (int b = 0; b < brickArray.size(); ++b) {
+        const Brick& brick = brickArray[b];
+        brickArray[b].firstVertex = numVertices;
+        numVertices += 3 * brick.triangleCount;
+        if (notNull(brick.cached)) {
+            ++m_stats.reusedBricks;
+        } else {
+            ++m_stats.remeshedBricks;
+        }
+        ++m_stats.lodBricks[brick.level];
+        m_stats.lodTriangles[brick.level] += brick.triangleCount;
+        m_stats.lodPixelError[brick.level] = max(m_stats.lodPixelError[brick.level], brick.projectedStep * (1 << brick.level));
+    }
+    // Never shrink, so that a caller reusing the arrays from frame to frame keeps their capacity
+    vertexArray.resize(numVertices, false);
+
+    // Pass 2: write the triangles straight into the pre-sized array
+    CPUVertexArray::Vertex* vertices = vertexArray.getCArray();
+    runDynamically(brickArray.size(), [&](int b) {
+        const Brick& brick = brickArray[b];
+        CPUVertexArray::Vertex* out = vertices + brick.firstVertex;
+        if (notNull(brick.cached)) {
+            memcpy(out, brick.cached->vertices.getCArray(), sizeof(CPUVertexArray::Vertex) * brick.cached->vertices.size());
+            return;
+        }
+        for (int c = 0; c < brick.surfaceCells.size(); ++c) {
+            out += Polygonise(brick.surfaceCells[c], 0, out);
+        }
+
+        // Share the coarser neighbors' boundary edges
+        if (brick.coarserNeighbors != 0) {
+            Array<CoarseFace> faces;
+            for (CPUVertexArray::Vertex* v = vertices + brick.firstVertex; v < out; ++v) {
+                snapToCoarseBrick(v->position, brick, evaluateCell, evaluatePoint, levelTable, faces);
+            }
+        }
+    });
+
+    const int firstIndex = indexArray.size();
+    indexArray.resize(firstIndex + numVertices, false);
+    Thread::runConcurrently(0, numVertices, [&](int i) {
+        indexArray[firstIndex + i] = i;
+    });
+
+    if (notNull(cache)) {
+        // Rebuild the cache from this frame's bricks, which are done reading it. Bricks that are no longer active drop out.
+        cache->bricks.clear();
+        Array<CachedBrick*> entries;
+        entries.resize(brickArray.size());
+        for (int b = 0; b < brickArray.size(); ++b) {
+            entries[b] = &cache->bricks.getCreate(brickArray[b].coord);
+        }
+        runDynamically(brickArray.size(), [&](int b) {
+            const Brick& brick = brickArray[b];
+            CachedBrick& entry = *entries[b];
+            memcpy(entry.cellMask, brick.cellMask, sizeof(brick.cellMask));
+            entry.level = brick.level;
+            entry.coarserNeighbors = brick.coarserNeighbors;
+            entry.distanceLevel = brick.distanceLevel;
+            entry.preferredLevel = brick.preferredLevel;
+            entry.vertices.resize(3 * brick.triangleCount);
+            memcpy(entry.vertices.getCArray(), vertices + brick.firstVertex, sizeof(CPUVertexArray::Vertex) * entry.vertices.size());
+        });
+    }
+}
+
+/** The corners at either end of each of Bourke's 12 cell edges. */
+static const int EDGE_CORNER[12][2] = {
+    {0, 1}, {1, 2}, {2, 3}, {3, 0},
+    {4, 5}, {5, 6}, {6, 7}, {7, 4},
+    {0, 4}, {1, 5}, {2, 6}, {3, 7} };
+
+/** The corner one cell from corner 0 along x, y and z. */
+static const int AXIS_CORNER[3] = { 1, 4, 3 };
+
+/** The four cells around the edge leaving a cell's lowest corner along axis a, counterclockwise about a, as offsets subtracted along the next two axes. */
+static const int QUAD_OFFSET[4][2] = { {0, 0}, {1, 0}, {1, 1}, {0, 1} };
+
+static const int CELLS_PER_BRICK = MCubes::BRICK_SIZE * MCubes::BRICK_SIZE * MCubes::BRICK_SIZE;
+
+Point3 MCubes::netVertex(const GRIDCELL& grid, const float isolevel) {
+    Point3 sum(0, 0, 0);
+    int n = 0;
+    for (int e = 0; e < 12; ++e) {
+        const int a = EDGE_CORNER[e][0];
+        const int b = EDGE_CORNER[e][1];
+        if ((grid.val[a] < isolevel) != (grid.val[b] < isolevel)) {
+            sum += VertexInterp(isolevel, grid.p[a], grid.p[b], grid.val[a], grid.val[b]);
+            ++n;
+        }
+    }
+    return sum / float(max(n, 1));
+}
+
+void MCubes::extractSurfaceNets(const Array<Point3>& seeds, const CellEvaluator& evaluateCell, Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray) {
+    Array<Brick> brickArray;
+    findActiveBricks(seeds, brickArray);
+    cullBricks(brickArray);
+    const auto forEachBrick = [&](const std::function<void(int)>& callback) {
+        if (m_options.parallel) {
+            runDynamically(brickArray.size(), callback);
+        } else {
+            for (int b = 0; b < brickArray.size(); ++b) {
+                callback(b);
+            }
+        }
+    };
+
+    // Pass 1: evaluate every marked cell and keep those the surface passes through
+    std::atomic<int> visitedCells(0);
+    forEachBrick([&](int b) {
+        Brick& brick = brickArray[b];
+        brick.level = 0;
+        brick.coarserNeighbors = 0;
+        brick.cached = nullptr;
+        visitedCells += evaluateBrick(brick, evaluateCell, nullptr, PointEvaluator());
+    });
+    m_stats.visitedCells = visitedCells;
+
+    // One vertex per surface cell, in brick order
+    Table<Point3int32, int> brickIndexTable;
+    int numVertices = vertexArray.size();
+    for (int b = 0; b < brickArray.size(); ++b) {
+        brickArray[b].firstVertex = numVertices;
+        numVertices += brickArray[b].surfaceCells.size();
+        brickIndexTable.set(brickArray[b].coord, b);
+    }
+    vertexArray.resize(numVertices, false);
+    m_stats.remeshedBricks = brickArray.size();
+    m_stats.lodBricks[0] = brickArray.size();
+
+    // Pass 2: place the vertices and record which vertex belongs to each cell, -1 where the surface does not pass
+    Array<int> cellVertex;
+    cellVertex.resize(brickArray.size() * CELLS_PER_BRICK);
+    CPUVertexArray::Vertex* vertices = vertexArray.getCArray();
+    forEachBrick([&](int b) {
+        const Brick& brick = brickArray[b];
+        int* brickCells = cellVertex.getCArray() + b * CELLS_PER_BRICK;
+        for (int i = 0; i < CELLS_PER_BRICK; ++i) {
+            brickCells[i] = -1;
+        }
+
+        for (int c = 0; c < brick.surfaceCells.size(); ++c) {
+            const GRIDCELL& grid = brick.surfaceCells[c];
+            const int x = iRound(grid.p[0].x * invStep) & (BRICK_SIZE - 1);
+            const int y = iRound(grid.p[0].y * invStep) & (BRICK_SIZE - 1);
+            const int z = iRound(grid.p[0].z * invStep) & (BRICK_SIZE - 1);
+            brickCells[(z * BRICK_SIZE + y) * BRICK_SIZE + x] = brick.firstVertex + c;
+
+            CPUVertexArray::Vertex& v = vertices[brick.firstVertex + c];
+            v.position = netVertex(grid, 0);
+            v.normal = Vector3::nan();
+            v.tangent = Vector4::nan();
+        }
+    });
+
+    const auto vertexOfCell = [&](const int q[3]) {
+        const int* b = brickIndexTable.getPointer(Point3int32(q[0] >> BRICK_SHIFT, q[1] >> BRICK_SHIFT, q[2] >> BRICK_SHIFT));
+        if (isNull(b)) {
+            return -1;
+        }
+        const int mask = BRICK_SIZE - 1;
+        return cellVertex[*b * CELLS_PER_BRICK + (((q[2] & mask) * BRICK_SIZE + (q[1] & mask)) * BRICK_SIZE + (q[0] & mask))];
+    };
+
+    // Pass 3: each cell owns the three edges leaving its lowest corner. A crossed edge becomes a quad over the four cells around it.
+    Array<Array<int>> brickTriangles;
+    brickTriangles.resize(brickArray.size());
+    forEachBrick([&](int b) {
+        const Brick& brick = brickArray[b];
+        Array<int>& triangles = brickTriangles[b];
+        for (int c = 0; c < brick.surfaceCells.size(); ++c) {
+            const GRIDCELL& grid = brick.surfaceCells[c];
+            const int cell[3] = { iRound(grid.p[0].x * invStep), iRound(grid.p[0].y * invStep), iRound(grid.p[0].z * invStep) };
+            const bool inside = (grid.val[0] < 0);
+
+            for (int a = 0; a < 3; ++a) {
+                if ((grid.val[AXIS_CORNER[a]] < 0) == inside) { continue; }
+
+                int quad[4];
+                bool complete = true;
+                for (int k = 0; k < 4; ++k) {
+                    int q[3] = { cell[0], cell[1], cell[2] };
+                    q[(a + 1) % 3] -= QUAD_OFFSET[k][0];
+                    q[(a + 2) % 3] -= QUAD_OFFSET[k][1];
+                    quad[k] = vertexOfCell(q);
+                    complete = complete && (quad[k] >= 0);
+                }
+                // The edge lies on the boundary of the cells near particles
+                if (! complete) { continue; }
+
+                // Counterclockwise about the axis faces along it, which is outward when the edge leaves the water
+                if (! inside) {
+                    std::swap(quad[1], quad[3]);
+                }
+
+                // Split along the shorter diagonal for better shaped triangles
+                if ((vertices[quad[0]].position - vertices[quad[2]].position).squaredLength() <=
+                    (vertices[quad[1]].position - vertices[quad[3]].position).squaredLength()) {
+                    triangles.append(quad[0], quad[1], quad[2]);
+                    triangles.append(quad[0], quad[2], quad[3]);
+                } else {
+                    triangles.append(quad[0], quad[1], quad[3]);
+                    triangles.append(quad[1], quad[2], quad[3]);
+                }
+            }
+        }
+    });
+
+    const int firstIndex = indexArray.size();
+    Array<int> brickFirstIndex;
+    brickFirstIndex.resize(brickArray.size());
+    int numIndices = firstIndex;
+    for (int b = 0; b < brickArray.size(); ++b) {
+        brickFirstIndex[b] = numIndices;
+        numIndices += brickTriangles[b].size();
+    }
+    indexArray.resize(numIndices, false);
+    m_stats.lodTriangles[0] = (numIndices - firstIndex) / 3;
+
+    forEachBrick([&](int b) {
+        memcpy(indexArray.getCArray() + brickFirstIndex[b], brickTriangles[b].getCArray(), sizeof(int) * brickTriangles[b].size());
+    });
+}
+
+MCubes::MCubes(const Array<Point3>& points, float _rad, float _step, const Options& options) : MCubes(points, Anisotropy(), _rad, _step, options) {}
+
+MCubes::MCubes(const Array<Point3>& points, const Anisotropy& anisotropy, float _rad, float _step, const Options& options){
+    setParticles(points, anisotropy, _rad, _step, options);
+}
+
+void MCubes::setParticles(const Array<Point3>& points, const Anisotropy& anisotropy, float _rad, float _step, const Options& options) {
+    // Never shrink, so that the memory of a larger earlier frame is kept
+    m_points.resize(points.size(), false);
+    if (points.size() > 0) {
+        memcpy(m_points.getCArray(), points.getCArray(), sizeof(Point3) * points.size());
+    }
 	radius = _rad;
 	step = _step;
 	invStep = 1/step;
+    m_options = options;
+    fieldRadius = radius;
+
+    if (m_options.field == ANISOTROPIC_KERNEL) {
+        buildKernels(anisotropy);
+    }
+}
+
+void MCubes::buildKernels(const Anisotropy& anisotropy) {
+    // Flex already clamps the ellipsoid radii to a fraction of the particle radius, but keep degenerate axes from dividing by zero
+    const float minRadius = 0.05f * radius;
+    const bool hasAnisotropy = (anisotropy.q1.size() >= m_points.size()) && (anisotropy.q2.size() >= m_points.size()) && (anisotropy.q3.size() >= m_points.size());
+
+    fieldRadius = 0.0f;
+    m_kernels.resize(m_points.size(), false);
+    for (int i = 0; i < m_points.size(); ++i) {
+        // Without solver output every particle gets a spherical kernel
+        const Vector4 q[3] = {
+            hasAnisotropy ? anisotropy.q1[i] : Vector4(1, 0, 0, radius),
+            hasAnisotropy ? anisotropy.q2[i] : Vector4(0, 1, 0, radius),
+            hasAnisotropy ? anisotropy.q3[i] : Vector4(0, 0, 1, radius) };
+
+        Kernel& kernel = m_kernels[i];
+        kernel.center = m_points[i];
+        kernel.support = 0.0f;
+        for (int a = 0; a < 3; ++a) {
+            const float r = m_options.kernelScale * max(q[a].w, minRadius);
+            kernel.axis[a] = q[a].xyz() / r;
+            kernel.support = max(kernel.support, r);
+        }
+        fieldRadius = max(fieldRadius, kernel.support);
+    }
 }
 
 void MCubes::trianglesToVertAndInd(const Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray){
@@ -1,6 +1,7 @@
 #pragma once
 #include <G3D/G3DAll.h>
 #include <Math.h>
+#include "FieldKernel.h"
 
 /** A marching cubes implementation based off of Paul Bourke's.
  *  See http://paulbourke.net/geometry/polygonise/.
@@ -12,23 +13,339 @@ public:
        float val[8];
     } GRIDCELL;
 
+    /** The most vertices Polygonise can emit for a single cell (5 triangles). */
+    static const int MAX_CELL_VERTICES = 15;
+
+    /** log2 of BRICK_SIZE. */
+    static const int BRICK_SHIFT = 3;
+
+    /** Edge length, in cells, of the cubic bricks that the parallel mesher hands out to threads. */
+    static const int BRICK_SIZE = 1 << BRICK_SHIFT;
+
+    /** Number of resolutions the adaptive mesher chooses between. Level L meshes a brick with cells 2^L steps wide. */
+    static const int MAX_LOD_LEVELS = 3;
+
+    /** Where the mesh will be seen from, for choosing levels of detail. */
+    class View {
+    public:
+        Point3 position;
+
+        /** Pixels subtended by one radian at the center of the image. 0 when there is no camera, which disables adaptive meshing. */
+        float pixelsPerRadian = 0.0f;
+
+        /** Planes bounding the camera's view volume, facing inward. Empty when there is no camera, which disables culling. */
+        Array<Plane> clipPlanes;
+    };
+
+    /** The scalar field whose zero set is meshed. */
+    enum FieldMode {
+        /** Distance to the nearest particle sphere. Cheap, but bumpy, and needs a fine step to avoid holes. */
+        SPHERE_DISTANCE,
+
+        /** Sum of smoothing kernels stretched along each particle's anisotropy ellipsoid (Yu and Turk 2013). Smooth, and holds up at a coarser step. */
+        ANISOTROPIC_KERNEL
+    };
+
+    /** How the zero set of the field is turned into triangles. */
+    enum Extractor {
+        /** Bourke's tables. Up to 5 triangles per cell, many of them slivers, and no vertex is shared. */
+        MARCHING_CUBES,
+
+        /**
+         * Naive Surface Nets: one vertex per surface cell at the mean of its edge crossings, and a quad
+         * across every lattice edge the surface crosses. About half the triangles, better shaped, indexed.
+         */
+        SURFACE_NETS
+    };
+
+    /**
+     * Principal axes of each particle's neighborhood, as reported by flexGetAnisotropy.
+     * xyz is a unit axis and w is the ellipsoid radius along it.
+     */
+    class Anisotropy {
+    public:
+        Array<Vector4> q1;
+        Array<Vector4> q2;
+        Array<Vector4> q3;
+    };
+
+    /** A particle's smoothing kernel for ANISOTROPIC_KERNEL. Also serves as the position and equality traits for PointHashGrid. */
+    class Kernel {
+    public:
+        Point3 center;
+
+        /** Axes of the support ellipsoid divided by their radii, so that dot(axis[i], x - center) is 1 on the boundary. */
+        Vector3 axis[3];
+
+        /** Largest radius of the support ellipsoid. */
+        float support;
+
+        static void getPosition(const Kernel& k, Vector3& p) {
+            p = k.center;
+        }
+
+        static bool equals(const Kernel& a, const Kernel& b) {
+            return &a == &b;
+        }
+    };
+
+    /** Parameters that select between the meshing strategies. */
+    class Options {
+    public:
+        Options() {}
+
+        FieldMode field = SPHERE_DISTANCE;
+
+        /** SURFACE_NETS does not support incremental or adaptive meshing and ignores them. */
+        Extractor extractor = MARCHING_CUBES;
+
+        /** Kernel support radius as a multiple of the anisotropy ellipsoid radius. 2.2 puts the surface of a lone particle at its ellipsoid. */
+        float kernelScale = 2.2f;
+
+        /** Summed kernel density at the surface for ANISOTROPIC_KERNEL. Each kernel is 1 at its center. */
+        float isoThreshold = 0.5f;
+
+        /** Only let particles near the surface seed cell visits. Interior particles of a deep pool never produce triangles. */
+        bool skipInteriorParticles = true;
+
+        /** Particles with fewer neighbors than this are always on the surface. */
+        int interiorNeighborCount = 20;
+
+        /**
+         * Particles whose neighbors' centroid is offset by more than this fraction of the search
+         * radius are on the surface (a normalized color field gradient). It is about 0 deep inside
+         * the fluid and 3/8 at a flat surface.
+         */
+        float surfaceGradientThreshold = 0.1f;
+
+        /** Reuse the triangles of bricks that no particle moved through since the previous frame. Requires parallel and a BrickCache. */
+        bool incremental = true;
+
+        /**
+         * Particles that moved less than this fraction of the step, and whose kernel ellipsoid axes moved less than it, do not cause
+         * remeshing. The mesh stays within twice this of the exact one.
+         */
+        float remeshTolerance = 0.1f;
+
+        /**
+         * Mesh each brick at the coarsest level whose cells project to at most pixelError pixels,
+         * refined where the surface bends sharply. Neighboring bricks differ by at most one level.
+         * The finer side of each transition collapses its boundary vertices onto the coarser side's,
+         * so both sides share the coarse boundary edges. Requires parallel.
+         */
+        bool adaptive = false;
+
+        /** Camera for adaptive meshing and culling. Set by the caller every frame. */
+        View view;
+
+        /** Skip bricks that lie entirely outside view.clipPlanes, pushed out by cullMargin. The serial mesher skips the cells of those bricks. */
+        bool frustumCulling = false;
+
+        /**
+         * Distance, in meters, that bricks may lie outside the view volume and still be meshed, so that water
+         * just off screen still shows up in reflections and refractions. Offline renders want more than the preview.
+         */
+        float cullMargin = 0.5f;
+
+        /** Largest projected cell size, in pixels, allowed for coarse levels. */
+        float pixelError = 1.0f;
+
+        /** A coarse brick whose triangle normals are farther than this from their average, in degrees, is meshed one level finer. */
+        float curvatureAngle = 35.0f;
+
+        /** Mesh bricks of cells on all cores. The output is identical from run to run regardless of the number of threads. */
+        bool parallel = true;
+
+        /** Which implementation evaluates the distance field at cell corners. Defaults to the fastest the CPU supports. */
+        FieldKernel::Implementation fieldKernel = FieldKernel::best();
+    };
+
+    /** Work counters from the last call to marchCubes. */
+    class Stats {
+    public:
+        int particles = 0;
+
+        /** Interior particles that did not seed any cells. */
+        int skippedParticles = 0;
+
+        /** Cells whose corners were evaluated. */
+        int visitedCells = 0;
+
+        /** Particles that moved more than the remesh tolerance. */
+        int movedParticles = 0;
+
+        /** Bricks whose triangles were copied from the BrickCache. */
+        int reusedBricks = 0;
+
+        /** Bricks whose cells were evaluated. */
+        int remeshedBricks = 0;
+
+        /** Bricks skipped because they lie outside the view volume and its margin. */
+        int culledBricks = 0;
+
+        /** Bricks meshed at each level of detail. */
+        int lodBricks[MAX_LOD_LEVELS] = {};
+
+        /** Triangles produced at each level of detail. */
+        int lodTriangles[MAX_LOD_LEVELS] = {};
+
+        /** Largest projected cell size, in pixels, at each level of detail. This bounds the screen-space error of that level. */
+        float lodPixelError[MAX_LOD_LEVELS] = {};
+    };
+
+    /** A brick's triangles from a previous frame. */
+    class CachedBrick {
+    public:
+        uint64 cellMask[BRICK_SIZE];
+        int level;
+        uint32 coarserNeighbors;
+
+        /** Level chosen from distance alone, and from distance and curvature before balancing. Reused while the brick is clean and the camera has not changed the former. */
+        int distanceLevel;
+        int preferredLevel;
+        Array<CPUVertexArray::Vertex> vertices;
+    };
+
+    /** The triangle edges that a coarse cell's surface has in one of its faces, as the coarser brick meshes them. */
+    class CoarseFace {
+    public:
+        /** Lattice coordinate of the coarse cell's lowest corner, in units of step. */
+        Point3int32 cell;
+
+        /** Axis and lattice coordinate of the face's plane. */
+        int axis;
+        int plane;
+
+        /** Pairs of endpoints. */
+        Array<Point3> edges;
+    };
+
+    /** A BRICK_SIZE^3 block of grid cells. The unit of work for the parallel mesher. */
+    class Brick {
+    public:
+        /** Brick coordinate, i.e. the coordinate of its first cell divided by BRICK_SIZE. */
+        Point3int32 coord;
+
+        /** One bit per cell that lies near a particle. Bit x + BRICK_SIZE * y of cellMask[z] is cell (x, y, z). */
+        uint64 cellMask[BRICK_SIZE];
+
+        /** The cells of this brick that the surface passes through, with their corner values already evaluated. */
+        Array<GRIDCELL> surfaceCells;
+
+        /** Number of triangles the surface cells produce. */
+        int triangleCount;
+
+        /** Index of this brick's first vertex in the output vertex array. */
+        int firstVertex;
+
+        /** Level of detail. Cells are 2^level steps wide. */
+        int level;
+
+        /** Level chosen from distance alone, and from distance and curvature before balancing with the neighbors. */
+        int distanceLevel;
+        int preferredLevel;
+
+        /** Projected size, in pixels, of a cell one step wide at the brick's nearest point. */
+        float projectedStep;
+
+        /** Level that surfaceCells were last evaluated at without stitching, or -1. Lets the curvature test's evaluation be reused. */
+        int evaluatedLevel;
+
+        /** Bit i is set when the neighbor at NEIGHBOR_OFFSET[i] is meshed one level coarser, so the shared boundary must be stitched. */
+        uint32 coarserNeighbors;
+
+        /** The previous frame's triangles for this brick when they can be reused, otherwise null. */
+        const CachedBrick* cached;
+    };
+
+    /**
+     * Mesher state that persists from frame to frame so that only the bricks near particles
+     * that moved are remeshed. Owned by the caller, which passes it to every marchCubes call.
+     */
+    class BrickCache {
+    public:
+        /** Per-particle positions as of the last time each particle counted as moved. */
+        Array<Point3> points;
+
+        /**
+         * Three semi-axes of each particle's support ellipsoid as of the same time, scaled to their radii, so that
+         * a rotation or stretch that keeps the largest radius still counts as a move. Only used for ANISOTROPIC_KERNEL.
+         */
+        Array<Vector3> semiAxes;
+
+        Table<Point3int32, CachedBrick> bricks;
+
+        /** Settings the cached bricks were meshed with. Any change invalidates them. */
+        float step = 0.0f;
+        float radius = 0.0f;
+        float fieldRadius = 0.0f;
+        FieldMode field = SPHERE_DISTANCE;
+        float kernelScale = 0.0f;
+        float isoThreshold = 0.0f;
+        float curvatureAngle = 0.0f;
+
+        void clear() {
+            points.clear();
+            semiAxes.clear();
+            bricks.clear();
+        }
+    };
+
     Array<Point3> m_points;
 
     /** Radius of particles. */
     float radius;
 
+    /** Distance beyond which a particle no longer affects the field. radius for SPHERE_DISTANCE, the largest kernel support otherwise. */
+    float fieldRadius;
+
+    /** One kernel per point for ANISOTROPIC_KERNEL. */
+    Array<Kernel> m_kernels;
+
     /** Marching cubes grid increment. */
     float step;
 	float invStep;
 
 	Table<Point3, bool> gridFlagTable;
 
+    /**
+     * The particle grids that marchCubes evaluates the field with, kept from call to call so that a mesher reused
+     * through setParticles does not build new ones. Only the grid for the current field is populated.
+     */
+    shared_ptr<PointHashGrid<Vector3>> m_hashGrid;
+    shared_ptr<PointHashGrid<Kernel, Kernel, Kernel>> m_kernelGrid;
+
+    /** Cell width that m_hashGrid and m_kernelGrid were created with. */
+    float m_gridCellWidth = 0.0f;
+
+    Options m_options;
+
+    Stats m_stats;
+
     /**
      * Linearly interpolate the position where an isosurface cuts
      * an edge between two vertices, each with their own scalar value
      */
     Point3 MCubes::VertexInterp(const float isolevel,const Point3 p1,const Point3 p2,const float valp1,const float valp2);
-    MCubes(Array<Point3> points, float _rad, float _step);
+    MCubes(const Array<Point3>& points, float _rad, float _step, const Options& options = Options());
+
+    /** Meshes the anisotropic kernel field when options.field is ANISOTROPIC_KERNEL. points should be the solver's smoothed positions. */
+    MCubes(const Array<Point3>& points, const Anisotropy& anisotropy, float _rad, float _step, const Options& options = Options());
+
+    /** A mesher without particles, to be kept from frame to frame and filled by setParticles. */
+    MCubes() : radius(0.0f), fieldRadius(0.0f), step(1.0f), invStep(1.0f) {}
+
+    /**
+     * Replaces the particles and settings as the constructor would. The particle, kernel and grid memory of earlier
+     * calls is reused, so a mesher kept from frame to frame stops allocating it once it fits the most particles.
+     */
+    void setParticles(const Array<Point3>& points, const Anisotropy& anisotropy, float _rad, float _step, const Options& options);
+
+    /** Index into Bourke's edge and triangle tables for a cell: bit k is set when corner k is inside the surface. */
+    static int cubeIndex(const GRIDCELL& grid, const float isolevel);
+
+    /** Number of triangles Polygonise emits for a cell with the given cube index. */
+    static int triangleCount(const int cubeindex);
 
     /**
      *  Taken from:
@@ -42,15 +359,126 @@ public:
      */
     void MCubes::Polygonise(const GRIDCELL& grid, const float isolevel,Array<CPUVertexArray::Vertex>& vertexArray);
 
-    /** Populates the passed arrays with the output geometry data. */
-    void marchCubes(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray);
+    /** Writes the triangles for the cell to vertices, which must have room for MAX_CELL_VERTICES. Returns the number of vertices written. */
+    int MCubes::Polygonise(const GRIDCELL& grid, const float isolevel, CPUVertexArray::Vertex* vertices);
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+    /** Populates the passed arrays with the output geometry data. When a cache is passed and m_options.incremental is set, unchanged bricks reuse their previous triangles. */
+    void marchCubes(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray, BrickCache* cache = nullptr);
 
     /** Populates the index array. */
     void trianglesToVertAndInd(const Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray);
 
+    /** Fills in the corner positions of the cell of the given edge length whose lowest corner is p. */
+    void setCellCorners(GRIDCELL& grid, const Point3& p, const float size) const;
+
     /** Helper for triangulate grid. */
 	void MCubes::updateCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Vector3>& hashGrid);
-    
+
+    /** updateCell for a cell of any size, for the coarser levels of the adaptive mesher. */
+    void updateCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Vector3>& hashGrid, const float cellSize);
+
+    /** Helper for triangulate grid in ANISOTROPIC_KERNEL mode. */
+    void updateKernelCell(GRIDCELL& grid, const Point3& p, const PointHashGrid<Kernel, Kernel, Kernel>& kernelGrid, const float cellSize);
+
+    /** The SPHERE_DISTANCE field at a single point. Particles up to padding beyond the radius are searched, as updateCell does for a cell of that size. */
+    float sphereFieldAt(const Point3& p, const float padding, const PointHashGrid<Vector3>& hashGrid) const;
+
+    /** The ANISOTROPIC_KERNEL field at a single point. */
+    float kernelFieldAt(const Point3& p, const PointHashGrid<Kernel, Kernel, Kernel>& kernelGrid) const;
+
     /** Updates the geometry for the corresponding marching cubes grid cell. */
     void triangulateGrid(GRIDCELL& grid, const Point3& botCoord, Array<CPUVertexArray::Vertex>& vertexArray, const PointHashGrid<Vector3>& hashGrid);
-};
\ No newline at end of file
+
+protected:
+
+    /** Evaluates the field at the corners of the cell whose lowest corner is the point, with the given edge length. */
+    typedef std::function<void(GRIDCELL&, const Point3&, float)> CellEvaluator;
+
+    /** Evaluates the field at a point, consistently with a CellEvaluator for cells of the given size. */
+    typedef std::function<float(const Point3&, float)> PointEvaluator;
+
+    /** Creates m_kernels and sets fieldRadius. Particles without anisotropy data get spherical kernels of the particle radius. */
+    void buildKernels(const Anisotropy& anisotropy);
+
+    /**
+     * The particles whose cell neighborhoods the mesher visits: all of them, or only those
+     * classified as near the surface by neighbor count and color field gradient when
+     * m_options.skipInteriorParticles is set.
+     */
+    void findSeedParticles(Array<Point3>& seeds) const;
+
+    /**
+     * Chooses every brick's level from its projected cell size and surface curvature, then limits
+     * neighbors to differ by at most one level. All bricks are level 0 unless m_options.adaptive.
+     */
+    void chooseBrickLevels(Array<Brick>& brickArray, Table<Point3int32, int>& levelTable, const CellEvaluator& evaluateCell);
+
+    /** True if the brick's triangles at its current level bend further than m_options.curvatureAngle from their average normal. */
+    bool isCurved(const Brick& brick);
+
+    /**
+     * Evaluates the brick's active cells at its level, keeping those the surface passes through.
+     * When levelTable is given, field values on the boundary shared with a coarser brick are replaced by
+     * interpolation of the coarse lattice so that the two sides agree. Returns the number of cells evaluated.
+     */
+    int evaluateBrick(Brick& brick, const CellEvaluator& evaluateCell, const Table<Point3int32, int>* levelTable, const PointEvaluator& evaluatePoint);
+
+    /** True if a brick touching the lattice point q (in units of step) is coarser than level. */
+    bool touchesCoarserBrick(const Point3int32& q, int level, const Table<Point3int32, int>& levelTable) const;
+
+    /** The field at lattice point q (in units of step), interpolated from the lattice of cells 2^shift steps wide as a brick at that level sees it. */
+    float coarseLatticeValue(const Point3int32& q, int shift, const PointEvaluator& evaluatePoint) const;
+
+    /**
+     * Evaluates the cell 2^level steps wide whose lowest corner is the lattice point q (in units of step).
+     * When levelTable is given, corners touching a coarser brick take the coarse lattice's values.
+     */
+    void evaluateLatticeCell(GRIDCELL& grid, const Point3int32& q, int level, const CellEvaluator& evaluateCell, const Table<Point3int32, int>* levelTable, const PointEvaluator& evaluatePoint);
+
+    /**
+     * Moves a vertex on the boundary shared with a coarser brick to the nearest endpoint of the coarse brick's
+     * triangle edges on that boundary. The fine boundary edges then either coincide with coarse ones or
+     * collapse to a point, so there are no T-junctions. faces caches the coarse cells already polygonised.
+     */
+    void snapToCoarseBrick(Point3& v, const Brick& brick, const CellEvaluator& evaluateCell, const PointEvaluator& evaluatePoint,
+        const Table<Point3int32, int>& levelTable, Array<CoarseFace>& faces);
+
+    /** The Surface Nets vertex of a cell: the mean of the points where the surface crosses its edges. */
+    Point3 netVertex(const GRIDCELL& grid, const float isolevel);
+
+    /**
+     * Surface Nets version of marchBricks. Bricks are evaluated in parallel, every surface cell gets one
+     * vertex, and every crossed edge owned by a cell is joined to the vertices of the four cells around it.
+     */
+    void extractSurfaceNets(const Array<Point3>& seeds, const CellEvaluator& evaluateCell, Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray);
+
+    /** True if the brick overlaps the view volume pushed out by m_options.cullMargin, or culling is off. */
+    bool isBrickVisible(const Point3int32& coord) const;
+
+    /** Removes the bricks outside the view volume, keeping the order of the rest. */
+    void cullBricks(Array<Brick>& brickArray);
+
+    /** Sets every brick that contains a cell in the neighborhood of p, out to bound cells, in brickTable. */
+    void markBricksNear(const Point3& p, int bound, Table<Point3int32, bool>& brickTable) const;
+
+    /**
+     * Returns true if the cached bricks were meshed with the current settings. If so, fills
+     * dirtyBricks with the bricks near particles that moved more than the tolerance and
+     * updates the cache's reference positions for them.
+     */
+    bool findDirtyBricks(BrickCache& cache, Table<Point3int32, bool>& dirtyBricks);
+
+    /** Collects every brick containing a cell near a seed particle, sorted by coordinate so that the output order is deterministic. */
+    void findActiveBricks(const Array<Point3>& seeds, Array<Brick>& brickArray) const;
+
+    /**
+     * Parallel version of marchCubes. Bricks are first evaluated and their triangles counted,
+     * then a prefix sum over the counts gives each brick its range of the output, which is
+     * sized once and written without locks.
+     */
+    void marchBricks(const Array<Point3>& seeds, const CellEvaluator& evaluateCell, const PointEvaluator& evaluatePoint, BrickCache* cache, Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray);
+};
@@ -0,0 +1,472 @@
+#include "MeshDecimator.h"
+#include "WorkQueue.h"
+
+/** Vertices closer than this fraction of the step are merged when welding. */
+static const float WELD_TOLERANCE = 1e-3f;
+
+MeshDecimator::Quadric MeshDecimator::Quadric::plane(const Vector3& n, const Point3& p, double weight) {
+    const double d = -n.dot(p);
+    const double v[4] = { n.x, n.y, n.z, d };
+    Quadric q;
+    int i = 0;
+    for (int r = 0; r < 4; ++r) {
+        for (int c = r; c < 4; ++c) {
+            q.a[i++] = weight * v[r] * v[c];
+        }
+    }
+    return q;
+}
+
+double MeshDecimator::Quadric::error(const Point3& p) const {
+    const double x = p.x;
+    const double y = p.y;
+    const double z = p.z;
+    return a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x +
+        a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y +
+        a[7] * z * z + 2.0 * a[8] * z +
+        a[9];
+}
+
+bool MeshDecimator::Quadric::minimize(Point3& p) const {
+    // Solve A p = -b, where A is the upper left 3x3 block and b the last column, by Cramer's rule
+    const double m00 = a[0], m01 = a[1], m02 = a[2];
+    const double m11 = a[4], m12 = a[5];
+    const double m22 = a[7];
+    const double b0 = -a[3], b1 = -a[6], b2 = -a[8];
+
+    const double c00 = m11 * m22 - m12 * m12;
+    const double c01 = m02 * m12 - m01 * m22;
+    const double c02 = m01 * m12 - m02 * m11;
+    const double det = m00 * c00 + m01 * c01 + m02 * c02;
+
+    // Planes that are nearly parallel leave the point free to slide along them
+    const double trace = m00 + m11 + m22;
+    if (std::abs(det) <= 1e-6 * trace * trace * trace) {
+        return false;
+    }
+
+    const double c11 = m00 * m22 - m02 * m02;
+    const double c12 = m01 * m02 - m00 * m12;
+    const double c22 = m00 * m11 - m01 * m01;
+    p.x = float((c00 * b0 + c01 * b1 + c02 * b2) / det);
+    p.y = float((c01 * b0 + c11 * b1 + c12 * b2) / det);
+    p.z = float((c02 * b0 + c12 * b1 + c22 * b2) / det);
+    return true;
+}
+
+void MeshDecimator::weld(const Array<CPUVertexArray::Vertex>& vertexArray, const Array<int>& indexArray, float step) {
+    const float invQuantum = 1.0f / (WELD_TOLERANCE * step);
+    Table<Point3int32, int> vertexTable;
+    Array<int>& welded = m_welded;
+    welded.resize(vertexArray.size(), false);
+
+    m_position.fastClear();
+    m_vertex.fastClear();
+    for (int i = 0; i < vertexArray.size(); ++i) {
+        const Point3& p = vertexArray[i].position;
+        bool created = false;
+        int& index = vertexTable.getCreate(Point3int32(iRound(p.x * invQuantum), iRound(p.y * invQuantum), iRound(p.z * invQuantum)), created);
+        if (created) {
+            index = m_position.size();
+            m_position.append(p);
+            m_vertex.append(vertexArray[i]);
+        }
+        welded[i] = index;
+    }
+
+    m_triangles.fastClear();
+    for (int i = 0; i + 2 < indexArray.size(); i += 3) {
+        const int a = welded[indexArray[i]];
+        const int b = welded[indexArray[i + 1]];
+        const int c = welded[indexArray[i + 2]];
+        // Marching cubes emits slivers that collapse to a line once their vertices are merged
+        if ((a != b) && (b != c) && (c != a)) {
+            m_triangles.append(a, b, c);
+        }
+    }
+}
+
+Vector3 MeshDecimator::triangleNormal(int t, int replaced, const Point3& replacement) const {
+    Point3 p[3];
+    for (int k = 0; k < 3; ++k) {
+        const int v = m_triangles[3 * t + k];
+        p[k] = (v == replaced) ? replacement : m_position[v];
+    }
+    return (p[1] - p[0]).cross(p[2] - p[0]);
+}
+
+void MeshDecimator::neighbors(int v, Array<int>& result) const {
+    result.fastClear();
+    const Array<int>& triangles = m_vertexTriangles[v];
+    for (int i = 0; i < triangles.size(); ++i) {
+        const int t = triangles[i];
+        if (! m_triangleAlive[t]) { continue; }
+        for (int k = 0; k < 3; ++k) {
+            const int u = m_triangles[3 * t + k];
+            if ((u != v) && ! result.contains(u)) {
+                result.append(u);
+            }
+        }
+    }
+}
+
+void MeshDecimator::initialize() {
+    const int numVertices = m_position.size();
+    const int numTriangles = m_triangles.size() / 3;
+
+    // Never shrink, so that a decimator reused from frame to frame keeps the memory
+    m_triangleAlive.resize(numTriangles, false);
+    m_triangleAlive.setAll(true);
+    m_vertexTriangles.resize(numVertices, false);
+    for (int v = 0; v < numVertices; ++v) {
+        m_vertexTriangles[v].fastClear();
+    }
+    for (int t = 0; t < numTriangles; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            m_vertexTriangles[m_triangles[3 * t + k]].append(t);
+        }
+    }
+
+    m_quadric.resize(numVertices, false);
+    m_version.resize(numVertices, false);
+    m_version.setAll(0);
+    m_removed.resize(numVertices, false);
+    m_removed.setAll(false);
+    m_fixed.resize(numVertices, false);
+
+    const bool hasView = (m_options.view.pixelsPerRadian > 0.0f);
+    const float sinSilhouette = sin(toRadians(m_options.silhouetteAngle));
+    const auto initializeVertex = [&](int v) {
+        const Array<int>& triangles = m_vertexTriangles[v];
+        Quadric q;
+        Vector3 normalSum(0, 0, 0);
+        for (int i = 0; i < triangles.size(); ++i) {
+            const Vector3 n = triangleNormal(triangles[i], -1, Point3());
+            const float area2 = n.length();
+            if (area2 > 0.0f) {
+                // Unweighted, so that the error is a sum of squared distances and maxError has units
+                q += Quadric::plane(n / area2, m_position[v], 1.0);
+            }
+            normalSum += n;
+        }
+        m_quadric[v] = q;
+
+        // Every edge of a closed surface borders exactly two triangles. Anything else is a boundary of the mesh
+        bool fixed = false;
+        Array<int> around;
+        neighbors(v, around);
+        for (int j = 0; (j < around.size()) && ! fixed; ++j) {
+            int shared = 0;
+            for (int i = 0; i < triangles.size(); ++i) {
+                const int* tri = m_triangles.getCArray() + 3 * triangles[i];
+                if ((tri[0] == around[j]) || (tri[1] == around[j]) || (tri[2] == around[j])) {
+                    ++shared;
+                }
+            }
+            fixed = (shared != 2);
+        }
+
+        if (! fixed && hasView) {
+            const Vector3 toVertex = m_position[v] - m_options.view.position;
+            fixed = std::abs(normalSum.dot(toVertex)) < sinSilhouette * normalSum.length() * toVertex.length();
+        }
+        m_fixed[v] = fixed;
+    };
+
+    if (m_options.parallel) {
+        Thread::runConcurrently(0, numVertices, initializeVertex);
+    } else {
+        for (int v = 0; v < numVertices; ++v) {
+            initializeVertex(v);
+        }
+    }
+}
+
+void MeshDecimator::queueEdge(int a, int b, const Array<bool>& movable, std::priority_queue<Collapse>& queue) const {
+    if (! movable[a] || ! movable[b] || (m_fixed[a] && m_fixed[b])) {
+        return;
+    }
+
+    Quadric q = m_quadric[a];
+    q += m_quadric[b];
+
+    Collapse collapse;
+    if (m_fixed[a] || m_fixed[b]) {
+        // Fixed vertices stay where they are
+        collapse.keep = m_fixed[a] ? a : b;
+        collapse.remove = m_fixed[a] ? b : a;
+        collapse.target = m_position[collapse.keep];
+        collapse.cost = q.error(collapse.target);
+    } else {
+        collapse.keep = min(a, b);
+        collapse.remove = max(a, b);
+
+        // The optimum of the quadric, unless it is ill-conditioned or wanders off the edge, in which case the best of the ends and middle
+        const Point3 midpoint = (m_position[a] + m_position[b]) * 0.5f;
+        const float edgeLength = (m_position[a] - m_position[b]).length();
+        Point3 optimum;
+        if (q.minimize(optimum) && ((optimum - midpoint).length() <= edgeLength)) {
+            collapse.target = optimum;
+            collapse.cost = q.error(optimum);
+        } else {
+            const Point3 candidates[3] = { midpoint, m_position[a], m_position[b] };
+            collapse.cost = finf();
+            for (int i = 0; i < 3; ++i) {
+                const double cost = q.error(candidates[i]);
+                if (cost < collapse.cost) {
+                    collapse.cost = cost;
+                    collapse.target = candidates[i];
+                }
+            }
+        }
+    }
+
+    // Roundoff can make a sum of squares slightly negative
+    collapse.cost = max(collapse.cost, 0.0);
+    collapse.keepVersion = m_version[collapse.keep];
+    collapse.removeVersion = m_version[collapse.remove];
+    queue.push(collapse);
+}
+
+bool MeshDecimator::isValid(const Collapse& collapse) const {
+    // Link condition: the edge's two triangles must be the only ones its ends share, or the collapse pinches the surface
+    Array<int> keepNeighbors;
+    Array<int> removeNeighbors;
+    neighbors(collapse.keep, keepNeighbors);
+    neighbors(collapse.remove, removeNeighbors);
+    int shared = 0;
+    for (int i = 0; i < removeNeighbors.size(); ++i) {
+        if (keepNeighbors.contains(removeNeighbors[i])) {
+            ++shared;
+        }
+    }
+    if (shared != 2) {
+        return false;
+    }
+
+    const float cosMaxChange = cos(toRadians(m_options.maxNormalChange));
+    const int ends[2] = { collapse.keep, collapse.remove };
+    for (int e = 0; e < 2; ++e) {
+        const Array<int>& triangles = m_vertexTriangles[ends[e]];
+        for (int i = 0; i < triangles.size(); ++i) {
+            const int t = triangles[i];
+            if (! m_triangleAlive[t]) { continue; }
+
+            const int* tri = m_triangles.getCArray() + 3 * t;
+            const bool hasKeep = (tri[0] == collapse.keep) || (tri[1] == collapse.keep) || (tri[2] == collapse.keep);
+            const bool hasRemove = (tri[0] == collapse.remove) || (tri[1] == collapse.remove) || (tri[2] == collapse.remove);
+            if (hasKeep && hasRemove) {
+                // Removed by the collapse
+                continue;
+            }
+
+            const Vector3 before = triangleNormal(t, -1, Point3());
+            const Vector3 after = triangleNormal(t, ends[e], collapse.target);
+            const float lengths = before.length() * after.length();
+            if ((after.squaredLength() <= 0.0f) || (before.dot(after) < cosMaxChange * lengths)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int MeshDecimator::apply(const Collapse& collapse) {
+    const int keep = collapse.keep;
+    const int remove = collapse.remove;
+    m_position[keep] = collapse.target;
+    m_quadric[keep] += m_quadric[remove];
+    m_removed[remove] = true;
+    ++m_version[keep];
+    ++m_version[remove];
+
+    int removedTriangles = 0;
+    Array<int>& keepTriangles = m_vertexTriangles[keep];
+    const Array<int>& removeTriangles = m_vertexTriangles[remove];
+    for (int i = 0; i < removeTriangles.size(); ++i) {
+        const int t = removeTriangles[i];
+        if (! m_triangleAlive[t]) { continue; }
+
+        int* tri = m_triangles.getCArray() + 3 * t;
+        if ((tri[0] == keep) || (tri[1] == keep) || (tri[2] == keep)) {
+            m_triangleAlive[t] = false;
+            ++removedTriangles;
+        } else {
+            for (int k = 0; k < 3; ++k) {
+                if (tri[k] == remove) {
+                    tri[k] = keep;
+                }
+            }
+            keepTriangles.append(t);
+        }
+    }
+    m_vertexTriangles[remove].fastClear();
+
+    // Drop the dead triangles so that the list does not grow with every collapse
+    int live = 0;
+    for (int i = 0; i < keepTriangles.size(); ++i) {
+        if (m_triangleAlive[keepTriangles[i]]) {
+            keepTriangles[live++] = keepTriangles[i];
+        }
+    }
+    keepTriangles.resize(live);
+
+    return removedTriangles;
+}
+
+int MeshDecimator::decimatePartition(const Array<int>& partitionVertices, const Array<bool>& movable, float keepFraction) {
+    // Count each triangle once, at its first vertex
+    int count = 0;
+    for (int i = 0; i < partitionVertices.size(); ++i) {
+        const int v = partitionVertices[i];
+        const Array<int>& triangles = m_vertexTriangles[v];
+        for (int j = 0; j < triangles.size(); ++j) {
+            if (m_triangleAlive[triangles[j]] && (m_triangles[3 * triangles[j]] == v)) {
+                ++count;
+            }
+        }
+    }
+
+    const int target = iCeil(count * keepFraction);
+
+    std::priority_queue<Collapse> queue;
+    Array<int> around;
+    for (int i = 0; i < partitionVertices.size(); ++i) {
+        const int v = partitionVertices[i];
+        if (! movable[v]) { continue; }
+        neighbors(v, around);
+        for (int j = 0; j < around.size(); ++j) {
+            if (around[j] > v) {
+                queueEdge(v, around[j], movable, queue);
+            }
+        }
+    }
+
+    int removed = 0;
+    while ((count - removed > target) && ! queue.empty()) {
+        const Collapse collapse = queue.top();
+        queue.pop();
+
+        // Skip collapses queued before either end moved
+        if (m_removed[collapse.keep] || m_removed[collapse.remove] ||
+            (m_version[collapse.keep] != collapse.keepVersion) || (m_version[collapse.remove] != collapse.removeVersion)) {
+            continue;
+        }
+        if (collapse.cost > m_maxError) {
+            break;
+        }
+        if (! isValid(collapse)) {
+            continue;
+        }
+
+        removed += apply(collapse);
+        neighbors(collapse.keep, around);
+        for (int j = 0; j < around.size(); ++j) {
+            queueEdge(collapse.keep, around[j], movable, queue);
+        }
+    }
+    return removed;
+}
+
+void MeshDecimator::decimate(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray, float step) {
+    Stopwatch clock;
+    clock.tick();
+    m_stats = Stats();
+    m_stats.inputTriangles = indexArray.size() / 3;
+    m_maxError = square(double(m_options.maxError) * step);
+
+    weld(vertexArray, indexArray, step);
+    initialize();
+
+    const int target = int(m_options.targetRatio * m_stats.inputTriangles);
+    int alive = m_triangles.size() / 3;
+    Array<int>& vertexPartition = m_vertexPartition;
+    vertexPartition.resize(m_position.size(), false);
+    Array<bool>& movable = m_movable;
+    movable.resize(m_position.size(), false);
+
+    for (int round = 0; (round < m_options.rounds) && (alive > target); ++round) {
+        // Odd rounds shift the partitions by half so that the previous seams fall inside them
+        const float partitionSize = m_options.partitionCells * step;
+        const float offset = (round & 1) ? 0.5f : 0.0f;
+        Table<Point3int32, int> partitionTable;
+        Array<Array<int>>& partitionVertices = m_partitionVertices;
+        int partitionCount = 0;
+        for (int v = 0; v < m_position.size(); ++v) {
+            if (m_removed[v]) {
+                vertexPartition[v] = -1;
+                continue;
+            }
+            const Point3& p = m_position[v];
+            const Point3int32 coord(iFloor(p.x / partitionSize + offset), iFloor(p.y / partitionSize + offset), iFloor(p.z / partitionSize + offset));
+            bool created = false;
+            int& index = partitionTable.getCreate(coord, created);
+            if (created) {
+                // The vertex lists of earlier rounds and frames are reused
+                index = partitionCount++;
+                if (index == partitionVertices.size()) {
+                    partitionVertices.next();
+                }
+                partitionVertices[index].fastClear();
+            }
+            partitionVertices[index].append(v);
+            vertexPartition[v] = index;
+        }
+
+        // Only vertices whose triangles all lie in their own partition may move, so partitions never touch each other's data
+        Thread::runConcurrently(0, m_position.size(), [&](int v) {
+            bool inside = ! m_removed[v];
+            const Array<int>& triangles = m_vertexTriangles[v];
+            for (int i = 0; (i < triangles.size()) && inside; ++i) {
+                if (! m_triangleAlive[triangles[i]]) { continue; }
+                const int* tri = m_triangles.getCArray() + 3 * triangles[i];
+                inside = (vertexPartition[tri[0]] == vertexPartition[v]) && (vertexPartition[tri[1]] == vertexPartition[v]) && (vertexPartition[tri[2]] == vertexPartition[v]);
+            }
+            movable[v] = inside;
+        });
+
+        // Every partition keeps the same share of its triangles
+        const float keepFraction = float(target) / float(alive);
+        std::atomic<int> removed(0);
+        const auto decimateOne = [&](int p) {
+            removed += decimatePartition(partitionVertices[p], movable, keepFraction);
+        };
+        if (m_options.parallel) {
+            runDynamically(partitionCount, decimateOne);
+        } else {
+            for (int p = 0; p < partitionCount; ++p) {
+                decimateOne(p);
+            }
+        }
+        alive -= removed;
+    }
+
+    // Write the surviving triangles back, numbering vertices in order of first use
+    Array<int>& newIndex = m_newIndex;
+    newIndex.resize(m_position.size(), false);
+    newIndex.setAll(-1);
+    vertexArray.fastClear();
+    indexArray.fastClear();
+    for (int t = 0; t < m_triangleAlive.size(); ++t) {
+        if (! m_triangleAlive[t]) { continue; }
+        for (int k = 0; k < 3; ++k) {
+            const int v = m_triangles[3 * t + k];
+            if (newIndex[v] < 0) {
+                newIndex[v] = vertexArray.size();
+                CPUVertexArray::Vertex& vertex = vertexArray.next();
+                vertex = m_vertex[v];
+                vertex.position = m_position[v];
+            }
+            indexArray.append(newIndex[v]);
+        }
+    }
+
+    m_stats.outputTriangles = indexArray.size() / 3;
+    for (int v = 0; v < m_removed.size(); ++v) {
+        if (m_removed[v]) {
+            ++m_stats.collapses;
+        }
+    }
+    clock.tock();
+    m_stats.time = clock.elapsedTime();
+}
@@ -0,0 +1,192 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include "MCubes.h"
+#include <queue>
+
+/**
+ * Simplifies the water mesh after extraction with quadric error metric edge collapses (Garland and Heckbert 1997),
+ * so that flat water costs fewer triangles in the TriTree, in ray traversal, and in recorded video frames.
+ *
+ * The mesh is split into cubic partitions that are decimated in parallel. A partition only collapses edges
+ * whose triangles all lie inside it, so vertices on partition seams stay put. Later rounds shift the partitions
+ * by half their size so that the seams of the first round get decimated too.
+ */
+class MeshDecimator {
+public:
+    class Options {
+    public:
+        Options() {}
+
+        /** Whether WaterModel runs the decimator after meshing. */
+        bool enabled = false;
+
+        /** Fraction of the triangles to keep. Decimation stops earlier if every remaining collapse exceeds maxError. */
+        float targetRatio = 0.5f;
+
+        /** Largest distance, as a fraction of the marching cubes step, that a collapse may move the surface from its original planes. */
+        float maxError = 0.1f;
+
+        /** Collapses that turn a triangle's normal further than this, in degrees, are rejected. This keeps the interpolated vertex normals close to the original ones. */
+        float maxNormalChange = 20.0f;
+
+        /** Where the mesh will be seen from. Vertices on the silhouette are never moved when a camera is set. */
+        MCubes::View view;
+
+        /** Vertices whose normal is within this many degrees of perpendicular to the view direction are on the silhouette. */
+        float silhouetteAngle = 15.0f;
+
+        /** Edge length of a partition, in marching cubes steps. */
+        int partitionCells = 16;
+
+        /** Number of passes over the partitions. Each pass shifts them by half a partition. */
+        int rounds = 2;
+
+        /** Decimate the partitions on all cores. The output is identical from run to run regardless of the number of threads. */
+        bool parallel = true;
+    };
+
+    /** Work counters from the last call to decimate. */
+    class Stats {
+    public:
+        int inputTriangles = 0;
+        int outputTriangles = 0;
+        int collapses = 0;
+
+        /** Wall-clock time of the last call, in seconds. */
+        RealTime time = 0;
+
+        /** Fraction of the input triangles that remain. */
+        float ratio() const {
+            return (inputTriangles > 0) ? float(outputTriangles) / float(inputTriangles) : 1.0f;
+        }
+    };
+
+protected:
+
+    /** Symmetric 4x4 matrix summing squared distances to planes, stored as its upper triangle. */
+    class Quadric {
+    public:
+        double a[10];
+
+        Quadric() {
+            for (int i = 0; i < 10; ++i) {
+                a[i] = 0.0;
+            }
+        }
+
+        /** The squared distance to the plane through p with unit normal n, scaled by weight. */
+        static Quadric plane(const Vector3& n, const Point3& p, double weight);
+
+        void operator+=(const Quadric& q) {
+            for (int i = 0; i < 10; ++i) {
+                a[i] += q.a[i];
+            }
+        }
+
+        /** Weighted sum of squared plane distances at p. */
+        double error(const Point3& p) const;
+
+        /** The point of least error, if the quadric is well conditioned. */
+        bool minimize(Point3& p) const;
+    };
+
+    /** A candidate collapse of vertex remove into vertex keep at target. */
+    class Collapse {
+    public:
+        double cost;
+        int keep;
+        int remove;
+        uint32 keepVersion;
+        uint32 removeVersion;
+        Point3 target;
+
+        /** Lowest cost first for std::priority_queue. Ties are broken by index so that the order is deterministic. */
+        bool operator<(const Collapse& other) const {
+            if (cost != other.cost) { return cost > other.cost; }
+            if (keep != other.keep) { return keep > other.keep; }
+            return remove > other.remove;
+        }
+    };
+
+    Options m_options;
+    Stats m_stats;
+
+    /** Welded vertex positions. */
+    Array<Point3> m_position;
+
+    /** The original vertex of each welded vertex, for its other attributes. */
+    Array<CPUVertexArray::Vertex> m_vertex;
+
+    Array<Quadric> m_quadric;
+
+    /** Bumped whenever a vertex moves or is removed, to invalidate queued collapses. */
+    Array<uint32> m_version;
+
+    /** Vertices on a mesh boundary or the silhouette. They never move. */
+    Array<bool> m_fixed;
+
+    Array<bool> m_removed;
+
+    /** Three vertex indices per triangle. */
+    Array<int> m_triangles;
+
+    Array<bool> m_triangleAlive;
+
+    /** The live and dead triangles around each vertex. Dead ones are skipped. */
+    Array<Array<int>> m_vertexTriangles;
+
+    /** Scratch for decimate, kept so that a decimator reused from frame to frame does not reallocate it. */
+    Array<int> m_welded;
+    Array<int> m_vertexPartition;
+    Array<bool> m_movable;
+    Array<Array<int>> m_partitionVertices;
+    Array<int> m_newIndex;
+
+    /** Largest squared error allowed, in world units. */
+    double m_maxError;
+
+    /** Merges vertices that marching cubes emitted once per triangle. */
+    void weld(const Array<CPUVertexArray::Vertex>& vertexArray, const Array<int>& indexArray, float step);
+
+    /** Sets the quadrics and fixes the boundary and silhouette vertices. */
+    void initialize();
+
+    /** Unnormalized normal of a triangle, with one vertex optionally replaced. */
+    Vector3 triangleNormal(int t, int replaced, const Point3& replacement) const;
+
+    /** The vertices sharing a live triangle with v. */
+    void neighbors(int v, Array<int>& result) const;
+
+    /** Queues the cheapest way to collapse the edge between a and b, if it is allowed to move. */
+    void queueEdge(int a, int b, const Array<bool>& movable, std::priority_queue<Collapse>& queue) const;
+
+    /** True if the collapse keeps the mesh manifold and no triangle's normal turns by more than maxNormalChange. */
+    bool isValid(const Collapse& collapse) const;
+
+    /** Performs the collapse. Returns the number of triangles removed. */
+    int apply(const Collapse& collapse);
+
+    /**
+     * Collapses edges in the partition until keepFraction of its triangles remain or no collapse is cheap enough.
+     * movable marks the vertices whose every triangle is in the partition. Returns the number of triangles removed.
+     */
+    int decimatePartition(const Array<int>& partitionVertices, const Array<bool>& movable, float keepFraction);
+
+public:
+
+    MeshDecimator(const Options& options = Options()) : m_options(options) {}
+
+    Options& options() {
+        return m_options;
+    }
+
+    /**
+     * Replaces the mesh with a simplified, indexed one. The mesh may be indexed or a triangle soup, as
+     * marching cubes emits. step is the marching cubes step, which sets the scale of the partitions and errors.
+     */
+    void decimate(Array<CPUVertexArray::Vertex>& vertexArray, Array<int>& indexArray, float step);
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+};
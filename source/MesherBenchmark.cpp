@@ -0,0 +1,199 @@
+#include "MesherBenchmark.h"
+
+const String MesherBenchmark::FRAME_DIRECTORY = "particleFrames";
+
+/** Number of times each kernel is run over the cells. The fastest run is reported. */
+static const int REPETITIONS = 5;
+
+/** Triangles whose smallest angle is below this, in degrees, count as slivers. */
+static const float SLIVER_ANGLE = 10.0f;
+
+static bool isSliver(const Point3& a, const Point3& b, const Point3& c) {
+    const Point3 corner[3] = { a, b, c };
+    const float cosSliver = cos(toRadians(SLIVER_ANGLE));
+    for (int k = 0; k < 3; ++k) {
+        const Vector3 u = corner[(k + 1) % 3] - corner[k];
+        const Vector3 v = corner[(k + 2) % 3] - corner[k];
+        const float lengths = u.length() * v.length();
+        if ((lengths <= 0.0f) || (u.dot(v) > cosSliver * lengths)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void MesherBenchmark::saveFrame(const Array<Point3>& points, int frameIndex) {
+    if (!FileSystem::exists(FRAME_DIRECTORY)) {
+        FileSystem::createDirectory(FRAME_DIRECTORY);
+    }
+
+    BinaryOutput out(format("%s/frame_%05d.bin", FRAME_DIRECTORY.c_str(), frameIndex), G3D_LITTLE_ENDIAN);
+    out.writeInt32(points.size());
+    for (int i = 0; i < points.size(); ++i) {
+        out.writeVector3(points[i]);
+    }
+    out.commit();
+}
+
+void MesherBenchmark::loadFrames(Array<Array<Point3>>& frames) {
+    frames.fastClear();
+
+    Array<String> filenames;
+    FileSystem::getFiles(FRAME_DIRECTORY + "/frame_*.bin", filenames, true);
+    // The frame index is zero-padded, so lexicographic order is recording order
+    filenames.sort();
+
+    for (int f = 0; f < filenames.size(); ++f) {
+        BinaryInput in(filenames[f], G3D_LITTLE_ENDIAN);
+        Array<Point3>& points = frames.next();
+        points.resize(in.readInt32());
+        for (int i = 0; i < points.size(); ++i) {
+            points[i] = in.readVector3();
+        }
+    }
+}
+
+String MesherBenchmark::benchmarkFieldKernels(const Array<Array<Point3>>& frames, float radius, float step) {
+    if (frames.size() == 0) {
+        return format("No particle frames found in %s. Record some first.\n", FRAME_DIRECTORY.c_str());
+    }
+
+    // Gather the corners and neighbors of every cell that contains a particle, the same query MCubes::updateCell makes
+    Array<FieldKernel::Corners> cellCorners;
+    Array<int> firstNeighbor;
+    Array<int> neighborCount;
+    FieldKernel::NeighborBuffer neighbors;
+
+    const float invStep = 1.0f / step;
+    const float bradius = radius + step;
+    for (int f = 0; f < frames.size(); ++f) {
+        const Array<Point3>& points = frames[f];
+        PointHashGrid<Vector3> hashGrid(bradius);
+        hashGrid.insert(points);
+
+        Table<Point3int32, bool> visited;
+        for (int i = 0; i < points.size(); ++i) {
+            const Point3int32 cell(iFloor(points[i].x * invStep), iFloor(points[i].y * invStep), iFloor(points[i].z * invStep));
+            bool created = false;
+            visited.getCreate(cell, created);
+            if (! created) {
+                continue;
+            }
+
+            const Point3 p(cell.x * step, cell.y * step, cell.z * step);
+            FieldKernel::Corners& corners = cellCorners.next();
+            for (int k = 0; k < 8; ++k) {
+                // Same corner order as MCubes::GRIDCELL
+                const int dx = (k == 1 || k == 2 || k == 5 || k == 6) ? 1 : 0;
+                const int dy = (k >= 4) ? 1 : 0;
+                const int dz = (k == 2 || k == 3 || k == 6 || k == 7) ? 1 : 0;
+                corners.x[k] = p.x + dx * step;
+                corners.y[k] = p.y + dy * step;
+                corners.z[k] = p.z + dz * step;
+            }
+
+            firstNeighbor.append(neighbors.size());
+            const AABox box(p - Vector3(bradius, bradius, bradius), p + Vector3(bradius, bradius, bradius));
+            for (PointHashGrid<Vector3>::BoxIterator iter = hashGrid.beginBoxIntersection(box, false); iter != hashGrid.endBoxIntersection(); ++iter) {
+                neighbors.append(*iter);
+            }
+            neighborCount.append(neighbors.size() - firstNeighbor.last());
+        }
+    }
+
+    const int numCells = cellCorners.size();
+    String report = format("Field kernel benchmark: %d frames, %d cells, %.1f neighbors per cell\n",
+        frames.size(), numCells, float(neighbors.size()) / max(numCells, 1));
+
+    Array<float> reference;
+    Array<float> values;
+    values.resize(numCells * 8);
+    RealTime scalarTime = 0;
+    for (int impl = FieldKernel::SCALAR; impl <= FieldKernel::best(); ++impl) {
+        const FieldKernel::Implementation implementation = FieldKernel::Implementation(impl);
+
+        RealTime fastest = finf();
+        for (int r = 0; r < REPETITIONS; ++r) {
+            Stopwatch clock;
+            clock.tick();
+            for (int c = 0; c < numCells; ++c) {
+                const int first = firstNeighbor[c];
+                const float* nx = neighbors.x.getCArray() + first;
+                const float* ny = neighbors.y.getCArray() + first;
+                const float* nz = neighbors.z.getCArray() + first;
+                float* val = values.getCArray() + 8 * c;
+                switch (implementation) {
+                case FieldKernel::AVX:
+                    FieldKernel::evaluateAVX(cellCorners[c], nx, ny, nz, neighborCount[c], radius, val);
+                    break;
+                case FieldKernel::SSE:
+                    FieldKernel::evaluateSSE(cellCorners[c], nx, ny, nz, neighborCount[c], radius, val);
+                    break;
+                default:
+                    FieldKernel::evaluateScalar(cellCorners[c], nx, ny, nz, neighborCount[c], radius, val);
+                    break;
+                }
+            }
+            clock.tock();
+            fastest = min(fastest, clock.elapsedTime());
+        }
+
+        float maxError = 0.0f;
+        if (implementation == FieldKernel::SCALAR) {
+            reference = values;
+            scalarTime = fastest;
+        } else {
+            for (int i = 0; i < values.size(); ++i) {
+                maxError = max(maxError, fabsf(values[i] - reference[i]));
+            }
+        }
+
+        report += format("  %-6s %8.2f ns/cell  %5.2fx  max error %g\n", FieldKernel::name(implementation),
+            1e9 * fastest / max(numCells, 1), scalarTime / fastest, maxError);
+    }
+
+    return report;
+}
+
+String MesherBenchmark::benchmarkExtractors(const Array<Array<Point3>>& frames, float radius, float step) {
+    if (frames.size() == 0) {
+        return format("No particle frames found in %s. Record some first.\n", FRAME_DIRECTORY.c_str());
+    }
+
+    static const char* EXTRACTOR_NAMES[] = { "Marching cubes", "Surface nets" };
+    String report = format("Extractor benchmark: %d frames\n", frames.size());
+    for (int e = MCubes::MARCHING_CUBES; e <= MCubes::SURFACE_NETS; ++e) {
+        MCubes::Options options;
+        options.extractor = MCubes::Extractor(e);
+
+        RealTime totalTime = 0;
+        int64 triangles = 0;
+        int64 vertices = 0;
+        int64 slivers = 0;
+        for (int f = 0; f < frames.size(); ++f) {
+            Array<CPUVertexArray::Vertex> vertexArray;
+            Array<int> indexArray;
+
+            Stopwatch clock;
+            clock.tick();
+            MCubes mesher(frames[f], radius, step, options);
+            mesher.marchCubes(vertexArray, indexArray);
+            clock.tock();
+            totalTime += clock.elapsedTime();
+
+            triangles += indexArray.size() / 3;
+            vertices += vertexArray.size();
+            for (int i = 0; i + 2 < indexArray.size(); i += 3) {
+                if (isSliver(vertexArray[indexArray[i]].position, vertexArray[indexArray[i + 1]].position, vertexArray[indexArray[i + 2]].position)) {
+                    ++slivers;
+                }
+            }
+        }
+
+        report += format("  %-14s %8.2f ms/frame  %8d triangles  %8d vertices  %5.1f%% slivers\n", EXTRACTOR_NAMES[e],
+            1e3 * totalTime / frames.size(), int(triangles / frames.size()), int(vertices / frames.size()),
+            100.0f * float(slivers) / float(max(triangles, int64(1))));
+    }
+
+    return report;
+}
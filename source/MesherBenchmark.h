@@ -0,0 +1,34 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include "FieldKernel.h"
+#include "MCubes.h"
+
+/**
+ * Offline measurements of the water mesher on particle frames recorded from the simulation,
+ * so that optimizations can be compared on the same real data from run to run.
+ */
+class MesherBenchmark {
+public:
+    /** Directory that recorded particle frames are written to and read from. */
+    static const String FRAME_DIRECTORY;
+
+    /** Saves one frame of water particle positions to FRAME_DIRECTORY. */
+    static void saveFrame(const Array<Point3>& points, int frameIndex);
+
+    /** Loads every frame in FRAME_DIRECTORY in recording order. */
+    static void loadFrames(Array<Array<Point3>>& frames);
+
+    /**
+     * Times every FieldKernel implementation that the CPU supports on the cells around the particles
+     * of each frame and checks that they agree with the scalar kernel. Neighbors are gathered up front
+     * so that only the kernel is timed. Returns a human-readable report.
+     */
+    static String benchmarkFieldKernels(const Array<Array<Point3>>& frames, float radius, float step);
+
+    /**
+     * Meshes every frame with each MCubes::Extractor and reports the time per frame, the triangle and
+     * vertex counts, and the share of sliver triangles (smallest angle under 10 degrees), which are what
+     * make TriTree builds and traversal expensive. Returns a human-readable report.
+     */
+    static String benchmarkExtractors(const Array<Array<Point3>>& frames, float radius, float step);
+};
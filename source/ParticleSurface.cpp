@@ -0,0 +1,204 @@
+#include "ParticleSurface.h"
+#include <atomic>
+
+ParticleSurface::ParticleSurface(const Array<Point3>& points, const MCubes::Anisotropy& anisotropy, float radius, float step, const MCubes::Options& meshOptions, const Options& options) :
+    m_options(options),
+    m_field(points, anisotropy, radius, step, meshOptions),
+    m_hashGrid(m_field.fieldRadius + step),
+    m_kernelGrid(m_field.fieldRadius + step),
+    m_brickSize(step * MCubes::BRICK_SIZE) {
+
+    Stopwatch clock;
+    clock.tick();
+
+    const bool anisotropic = (m_field.m_options.field == MCubes::ANISOTROPIC_KERNEL);
+    if (anisotropic) {
+        m_kernelGrid.insert(m_field.m_kernels);
+    } else {
+        m_hashGrid.insert(m_field.m_points);
+    }
+
+    // Mark every brick that a particle's field reaches
+    m_bounds = AABox();
+    for (int i = 0; i < m_field.m_points.size(); ++i) {
+        const Point3& p = m_field.m_points[i];
+        const float reach = anisotropic ? m_field.m_kernels[i].support : m_field.fieldRadius;
+        const Point3int32 low = brickCoord(p - Vector3(reach, reach, reach));
+        const Point3int32 high = brickCoord(p + Vector3(reach, reach, reach));
+        for (int z = low.z; z <= high.z; ++z) {
+            for (int y = low.y; y <= high.y; ++y) {
+                for (int x = low.x; x <= high.x; ++x) {
+                    m_occupiedBricks.set(Point3int32(x, y, z), true);
+                }
+            }
+        }
+
+        const AABox brickBounds(Point3(float(low.x), float(low.y), float(low.z)) * m_brickSize, Point3(float(high.x + 1), float(high.y + 1), float(high.z + 1)) * m_brickSize);
+        if (i == 0) {
+            m_bounds = brickBounds;
+        } else {
+            m_bounds.merge(brickBounds);
+        }
+    }
+
+    clock.tock();
+    m_stats.buildTime = clock.elapsedTime();
+}
+
+float ParticleSurface::fieldAt(const Point3& p, int& evaluations) const {
+    ++evaluations;
+    if (m_field.m_options.field == MCubes::ANISOTROPIC_KERNEL) {
+        return m_field.kernelFieldAt(p, m_kernelGrid);
+    }
+    // Particles are searched out to one step past their radius, which bounds how far a single sphere tracing step can go
+    return min(m_field.sphereFieldAt(p, m_field.step, m_hashGrid), m_field.step);
+}
+
+Vector3 ParticleSurface::normalAt(const Point3& p, int& evaluations) const {
+    const float h = 0.1f * m_field.step;
+    const Vector3 gradient(
+        fieldAt(p + Vector3(h, 0, 0), evaluations) - fieldAt(p - Vector3(h, 0, 0), evaluations),
+        fieldAt(p + Vector3(0, h, 0), evaluations) - fieldAt(p - Vector3(0, h, 0), evaluations),
+        fieldAt(p + Vector3(0, 0, h), evaluations) - fieldAt(p - Vector3(0, 0, h), evaluations));
+    return gradient.directionOrZero();
+}
+
+Point3int32 ParticleSurface::brickCoord(const Point3& p) const {
+    return Point3int32(iFloor(p.x / m_brickSize), iFloor(p.y / m_brickSize), iFloor(p.z / m_brickSize));
+}
+
+float ParticleSurface::exitBrick(const Ray& ray, const Point3int32& coord) const {
+    float t = finf();
+    for (int a = 0; a < 3; ++a) {
+        const float d = ray.direction()[a];
+        if (d != 0.0f) {
+            const float plane = (coord[a] + ((d > 0.0f) ? 1 : 0)) * m_brickSize;
+            t = min(t, (plane - ray.origin()[a]) / d);
+        }
+    }
+    return t;
+}
+
+bool ParticleSurface::intersect(const Ray& ray, float& distance, Vector3& normal, bool& entering, int& evaluations) const {
+    if (m_occupiedBricks.size() == 0) {
+        return false;
+    }
+
+    // Clip to the occupied bricks
+    float tMin = ray.minDistance();
+    float tMax = ray.maxDistance();
+    for (int a = 0; a < 3; ++a) {
+        const float invD = 1.0f / ray.direction()[a];
+        float t0 = (m_bounds.low()[a] - ray.origin()[a]) * invD;
+        float t1 = (m_bounds.high()[a] - ray.origin()[a]) * invD;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        tMin = max(tMin, t0);
+        tMax = min(tMax, t1);
+    }
+    if (tMin > tMax) {
+        return false;
+    }
+
+    const bool sphereTracing = (m_field.m_options.field == MCubes::SPHERE_DISTANCE);
+    const float minStep = m_options.intervalStep * m_field.step;
+    const float tolerance = m_options.hitTolerance * m_field.step;
+    const int firstEvaluation = evaluations;
+
+    float t = tMin;
+    float previousT = t;
+    float previousF = 0.0f;
+    bool havePrevious = false;
+    while ((t <= tMax) && (evaluations - firstEvaluation < m_options.maxEvaluations)) {
+        const Point3& p = ray.origin() + ray.direction() * t;
+        const Point3int32& coord = brickCoord(p);
+        const bool occupied = m_occupiedBricks.containsKey(coord);
+
+        // The field is positive in empty bricks, so there is no need to evaluate it there
+        const float f = occupied ? fieldAt(p, evaluations) : m_field.step;
+
+        // A sample on the surface counts as a hit, but not the first one, which may be where the ray was bumped off the surface.
+        // Only the sphere distance field is in units of distance.
+        const bool onSurface = sphereTracing && havePrevious && (std::abs(f) < tolerance);
+        const bool crossed = havePrevious && ((f < 0.0f) != (previousF < 0.0f));
+        if (onSurface || crossed) {
+            entering = (previousF >= 0.0f);
+            if (crossed && ! onSurface) {
+                // Bisect between the two samples
+                float lo = previousT;
+                float hi = t;
+                for (int i = 0; i < m_options.refineIterations; ++i) {
+                    const float mid = 0.5f * (lo + hi);
+                    const float fMid = fieldAt(ray.origin() + ray.direction() * mid, evaluations);
+                    if ((fMid < 0.0f) == (previousF < 0.0f)) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                t = 0.5f * (lo + hi);
+            }
+            distance = t;
+            normal = normalAt(ray.origin() + ray.direction() * t, evaluations);
+            return true;
+        }
+
+        previousT = t;
+        previousF = f;
+        havePrevious = true;
+        if (! occupied) {
+            t = max(exitBrick(ray, coord), t) + 1e-4f * m_brickSize;
+        } else if (sphereTracing) {
+            t += max(std::abs(f), minStep);
+        } else {
+            t += minStep;
+        }
+    }
+    return false;
+}
+
+void ParticleSurface::getMaterial(MaterialSample& material) const {
+    material = MaterialSample();
+    material.glossy = Color3(m_options.reflectance);
+    material.smoothness = 1.0f;
+    material.transmissive = m_options.transmissive;
+    material.kappaNeg = m_options.extinction;
+}
+
+void ParticleSurface::intersectRays(const Array<Ray>& rayBuffer, HitBuffer& hitBuffer, int materialIndex, bool singleThread) {
+    Stopwatch clock;
+    clock.tick();
+    std::atomic<int64> hits(0);
+    std::atomic<int64> fieldEvaluations(0);
+
+    Thread::runConcurrently(0, rayBuffer.size(), [&](int i) {
+        Ray ray = rayBuffer[i];
+        if (hitBuffer.hit(i)) {
+            // Only water in front of the triangle hit can replace it
+            ray.set(ray.origin(), ray.direction(), ray.minDistance(), (hitBuffer.position[i] - ray.origin()).dot(ray.direction()));
+        }
+
+        float distance;
+        Vector3 normal;
+        bool entering;
+        int evaluations = 0;
+        const bool hit = intersect(ray, distance, normal, entering, evaluations);
+        fieldEvaluations += evaluations;
+        if (! hit) {
+            return;
+        }
+
+        const Vector3& facing = entering ? normal : -normal;
+        hitBuffer.set(i, ray.origin() + ray.direction() * distance, facing, facing, Point2(0, 0), materialIndex,
+            uint8(HitBuffer::MEDIUM | (entering ? 0 : HitBuffer::BACKFACE)));
+        ++hits;
+    }, singleThread);
+
+    clock.tock();
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    m_stats.rays += rayBuffer.size();
+    m_stats.hits += hits;
+    m_stats.fieldEvaluations += fieldEvaluations;
+    m_stats.traceTime += clock.elapsedTime();
+}
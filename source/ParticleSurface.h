@@ -0,0 +1,124 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include "MCubes.h"
+#include "HitBuffer.h"
+#include <mutex>
+
+/**
+ * The water surface as the zero set of the particle field itself, for the path tracer to intersect without meshing.
+ * The field is MCubes' (sphere distance or anisotropic kernels, per MCubes::Options::field), so the surface matches
+ * the one marching cubes would extract in the limit of a small step.
+ *
+ * Rays skip bricks of MCubes::BRICK_SIZE cells that no particle reaches. Inside occupied bricks they are sphere traced
+ * through the sphere distance field, which is a true distance, or stepped at a fixed interval through the kernel field,
+ * which is not. Crossings are refined by bisection.
+ */
+class ParticleSurface {
+public:
+    class Options {
+    public:
+        Options() {}
+
+        /** A point whose field value is within this fraction of the step of zero is on the surface. */
+        float hitTolerance = 0.01f;
+
+        /** Interval between field samples for ANISOTROPIC_KERNEL, and the smallest sphere tracing step, as a fraction of the step. */
+        float intervalStep = 0.5f;
+
+        /** Bisection iterations used to refine a sign change between two samples. */
+        int refineIterations = 8;
+
+        /** Rays give up and miss after this many field evaluations. */
+        int maxEvaluations = 512;
+
+        /** Water material, matching the one WaterModel gives the mesh. */
+        Color3 transmissive = Color3(0.8f, 0.9f, 1.0f);
+        Color3 extinction = Color3(1.0f, 1.0f, 1.0f);
+
+        /** Glossy reflectance at normal incidence. Rises to 1 at grazing angles by Schlick's approximation. */
+        float reflectance = 0.1f;
+    };
+
+    /** Work counters, accumulated over every call to intersectRays. */
+    class Stats {
+    public:
+        int64 rays = 0;
+        int64 hits = 0;
+        int64 fieldEvaluations = 0;
+
+        /** Time spent building the brick grid, in seconds. */
+        RealTime buildTime = 0;
+
+        /** Wall-clock time spent in intersectRays, in seconds, summed over the threads that call it concurrently. */
+        RealTime traceTime = 0;
+
+        float raysPerSecond() const {
+            return (traceTime > 0) ? float(double(rays) / traceTime) : 0.0f;
+        }
+    };
+
+protected:
+    Options m_options;
+
+    /** Holds the particles, kernels and field parameters. Only its field evaluation is used. */
+    MCubes m_field;
+
+    /** Only the grid for the current field is populated, as in MCubes::marchCubes. */
+    PointHashGrid<Vector3> m_hashGrid;
+    PointHashGrid<MCubes::Kernel, MCubes::Kernel, MCubes::Kernel> m_kernelGrid;
+
+    /** Bricks that some particle's field reaches. The field is positive everywhere else. */
+    Table<Point3int32, bool> m_occupiedBricks;
+
+    /** Bounds of the occupied bricks. */
+    AABox m_bounds;
+
+    float m_brickSize;
+
+    Stats m_stats;
+
+    /** Guards m_stats when several threads trace at once. */
+    std::mutex m_statsMutex;
+
+    /** The field at p. Negative inside the water. Increments evaluations. */
+    float fieldAt(const Point3& p, int& evaluations) const;
+
+    /** Outward unit normal at p from central differences of the field. */
+    Vector3 normalAt(const Point3& p, int& evaluations) const;
+
+    /** The brick containing p. */
+    Point3int32 brickCoord(const Point3& p) const;
+
+    /** Distance along the ray at which it leaves the brick. */
+    float exitBrick(const Ray& ray, const Point3int32& coord) const;
+
+public:
+
+    ParticleSurface(const Array<Point3>& points, const MCubes::Anisotropy& anisotropy, float radius, float step, const MCubes::Options& meshOptions, const Options& options = Options());
+
+    /**
+     * Finds the nearest crossing of the surface between the ray's min and max distance, in either direction.
+     * On a hit, sets distance and the outward normal and returns true. entering is true if the ray goes from outside to inside.
+     * The number of field evaluations is added to evaluations.
+     */
+    bool intersect(const Ray& ray, float& distance, Vector3& normal, bool& entering, int& evaluations) const;
+
+    /**
+     * Replaces each hit with a water hit where the surface is closer than it, or where there is no hit. Runs on all cores.
+     * Hits from inside face the ray and are flagged as back faces, as for a transmissive mesh.
+     * With singleThread, runs on the calling thread instead, so that several threads can each trace their own rays.
+     */
+    void intersectRays(const Array<Ray>& rayBuffer, HitBuffer& hitBuffer, int materialIndex, bool singleThread = false);
+
+    /** The water material, seen from outside. */
+    void getMaterial(MaterialSample& material) const;
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+    /** Bounds of the bricks that the field reaches. Empty without particles. */
+    const AABox& bounds() const {
+        return m_bounds;
+    }
+};
@@ -15,7 +15,10 @@ PathTracer::PathTracer(
     const shared_ptr<Camera>& c, 
     const shared_ptr<Image>& i,
     const Options& o,
-    const shared_ptr<Image>& m
+    const shared_ptr<CausticAtlas>& caustics,
+    const Array<FoamInstance>& foam,
+    ParticleSurface* water,
+    const shared_ptr<SceneTree>& trees
 ) : m_scene(s),
     m_camera(c),
     m_image(i),
@@ -23,87 +26,534 @@ PathTracer::PathTracer(
     m_lightArray(m_scene->lightingEnvironment().lightArray),
     m_width(m_image->width()),
     m_height(m_image->height()),
-    m_causticMap(m)
+    m_caustics(caustics),
+    m_causticFrame(caustics->frameAt(o.time)),
+    m_water(o.traceParticles ? water : nullptr),
+    m_trees(notNull(trees) ? trees : std::make_shared<SceneTree>()),
+    m_cancelled(false),
+    m_tilesDone(0),
+    m_tileCount(0),
+    m_convergedPixels(0)
 {
-    // Set up the TriTree for the scene
-    Array<shared_ptr<Surface>> surfaceArray;
-    m_scene->onPose(surfaceArray);
-    m_tritree.setContents(surfaceArray); 
+    // Set up the TriTrees for the scene. Foam is traced as spheres rather than as its rasterized triangles,
+    // and the water as the particle field when there is a ParticleSurface.
+    Array<String> excluded;
+    excluded.append(FOAM_ENTITY_NAME);
+    if (notNull(m_water)) {
+        excluded.append("water");
+    }
+    m_trees->update(m_scene, excluded, m_options.intersectionBackend);
+    m_lightSampler.setContents(m_lightArray);
 
-    // Set up a separate TriTree with only solid surfaces for shadow-casting
-    Array<shared_ptr<Surface>> rigidSurfaces;
-    for (int m = 0; m < surfaceArray.size(); ++m) {
-        if (!surfaceArray[m]->hasTransmission()) {
-            rigidSurfaces.append(surfaceArray[m]);
-        }
+    // Reading the skybox back from its texture needs the GL context, which pathTrace may not have
+    m_skybox = m_scene->skyboxAsCubeMap();
+
+    Stopwatch clock;
+    clock.tick();
+    m_foamTree.setContents(foam);
+    clock.tock();
+    debugPrintf("Foam tree: %d spheres in %.3f s\n", m_foamTree.size(), clock.elapsedTime());
+
+    if (notNull(m_water)) {
+        MaterialSample material;
+        m_water->getMaterial(material);
+        m_waterMaterial = m_trees->addMaterial(material);
     }
-    m_rigidTriTree.setContents(rigidSurfaces);
-    m_rigidTriTreeSize = m_rigidTriTree.size();
 }
 
 void PathTracer::pathTrace() {
-    m_skybox = m_scene->skyboxAsCubeMap();
+    Stopwatch clock;
+    clock.tick();
+    m_framebuffer.resize(m_width * m_height);
+    m_framebuffer.setAll(Radiance3::black());
+    m_samplesPerPixel.resize(m_width * m_height);
+    m_samplesPerPixel.setAll(0);
+    m_denoiseBuffers.resize(m_width, m_height);
+    m_denoiseBuffers.surface.setAll(DenoiseBuffers::SKY);
+    m_tilesDone = 0;
+    m_convergedPixels = 0;
+    m_stats = Stats();
+
+    // The photon map is shared by every sample of every tile
+    tracePhotons();
+
+    if (m_options.tileSize <= 0) {
+        // One wavefront over the whole image
+        Tile image;
+        image.width = m_width;
+        image.height = m_height;
+        m_tileCount = 1;
+        traceTile(image);
+    } else {
+        Array<Tile> tiles;
+        for (int y = 0; y < m_height; y += m_options.tileSize) {
+            for (int x = 0; x < m_width; x += m_options.tileSize) {
+                Tile& tile = tiles.next();
+                tile.origin = Point2int32(x, y);
+                tile.width = min(m_options.tileSize, m_width - x);
+                tile.height = min(m_options.tileSize, m_height - y);
+            }
+        }
+        m_tileCount = tiles.size();
+
+        // Tiles cost very different amounts (sky vs. water), so each core takes the next one as soon as it is free
+        m_tilesConcurrent = true;
+        runDynamically(tiles.size(), [&](int t) {
+            if (! m_cancelled) {
+                traceTile(tiles[t]);
+            }
+        });
+        m_tilesConcurrent = false;
+    }
+    if (m_options.writeImage) {
+        resolveImage();
+    }
 
-    // buffers
+    clock.tock();
+    m_stats.pixels = m_samplesPerPixel.size();
+    m_stats.renderTime = clock.elapsedTime();
+    m_stats.convergedPixels = m_convergedPixels;
+    for (const int samples : m_samplesPerPixel) {
+        m_stats.samples += samples;
+    }
+    debugPrintf("Sampling: %.1f rays per pixel (%.0f%% of %d), %d of %d pixels reached %.1f%% noise early, %.3f s\n",
+        m_stats.samplesPerPixel(), 100.0f * m_stats.samplesPerPixel() / float(max(m_options.raysPerPixel, 1)), m_options.raysPerPixel,
+        m_stats.convergedPixels, m_stats.pixels, 100.0f * m_options.noiseThreshold, m_stats.renderTime);
+    if (m_stats.photonsEmitted > 0) {
+        debugPrintf("Caustic photons: %d of %d stored, traced in %.3f s, kd-tree built in %.3f s, gathered in %.3f s\n",
+            m_stats.photonsStored, m_stats.photonsEmitted, m_stats.photonTraceTime, m_stats.photonBuildTime, m_stats.photonGatherTime);
+    }
+
+    if (notNull(m_water)) {
+        const ParticleSurface::Stats& stats = m_water->stats();
+        debugPrintf("Particle surface: %.2f Mrays/s, %lld of %lld rays hit, %.1f field evaluations per ray\n",
+            stats.raysPerSecond() / 1e6f, stats.hits, stats.rays, (stats.rays > 0) ? double(stats.fieldEvaluations) / double(stats.rays) : 0.0);
+    }
+}
+
+void PathTracer::traceTile(const Tile& tile) {
+    // buffers. Paths that are still live are packed at the front of pathBuffer, which holds the pixel of the tile each one started at.
+    // The per-bounce buffers are indexed the same way and shrink with it. The per-path state (modulation, extinction point
+    // and medium) stays indexed by pixel, so that it never has to move.
+    Array<int> pathBuffer;
+    Array<int> nextPathBuffer;
+    Array<Ray> nextRayBuffer;
     Array<Ray> rayBuffer;
     Array<Radiance3> modulationBuffer;
-    Array<shared_ptr<Surfel>> surfelBuffer; 
+    Array<TriTree::Hit> triHitBuffers[SceneTree::LEVEL_COUNT];
+    HitBuffer hitBuffer;
+    Array<MaterialSample> materialBuffer;
     Array<Biradiance3> biradianceBuffer;
     Array<Ray> shadowRayBuffer;
     Array<bool> lightShadowedBuffer;
     Array<Point3> extinctionPointBuffer;
     Array<bool> inMediumBuffer;
-
-    // init all buffers to m_image.width*m_image.height
-    const int imageDim = m_width * m_height;
+    Array<Radiance3> causticBuffer;
+
+    // Per pixel sample statistics. varianceBuffer holds the running sum of squared deviations of luminance from the mean.
+    // Only the pixels in activePixelBuffer are still being sampled.
+    Array<Radiance3> radianceBuffer;
+    Array<Radiance3> meanBuffer;
+    Array<float> varianceBuffer;
+    Array<int> sampleCountBuffer;
+    Array<int> activePixelBuffer;
+
+    // init all buffers to the number of pixels in the tile
+    const int imageDim = tile.size();
+    pathBuffer.resize(imageDim);
+    nextPathBuffer.resize(imageDim);
+    nextRayBuffer.resize(imageDim);
     rayBuffer.resize(imageDim);
     modulationBuffer.resize(imageDim);
-    surfelBuffer.resize(imageDim);
+    for (Array<TriTree::Hit>& triHitBuffer : triHitBuffers) {
+        triHitBuffer.resize(imageDim);
+    }
+    hitBuffer.resize(imageDim);
+    materialBuffer.resize(imageDim);
     biradianceBuffer.resize(imageDim);
     shadowRayBuffer.resize(imageDim);
     lightShadowedBuffer.resize(imageDim);
     extinctionPointBuffer.resize(imageDim);
     inMediumBuffer.resize(imageDim);
+    causticBuffer.resize(imageDim);
+    radianceBuffer.resize(imageDim);
+    meanBuffer.resize(imageDim);
+    varianceBuffer.resize(imageDim);
+    sampleCountBuffer.resize(imageDim);
+    activePixelBuffer.resize(imageDim);
 
     // No point hit on the first cast should be in Medium
     inMediumBuffer.setAll(false);
 
-    m_image->setAll(Radiance3::black());
+    // Stays black without photons. It only ever shrinks, so it is not reset.
+    causticBuffer.setAll(Radiance3::black());
 
-    for(int r = 0; r < m_options.raysPerPixel; ++r){
-        initializeModulationBuffer(modulationBuffer);
-        generateRayBuffer(rayBuffer);
+    meanBuffer.setAll(Radiance3::black());
+    varianceBuffer.setAll(0.0f);
+    sampleCountBuffer.setAll(0);
+    for (int i = 0; i < imageDim; ++i) {
+        activePixelBuffer[i] = i;
+    }
+
+    int convergedPixels = 0;
+    for(int r = 0; (r < m_options.raysPerPixel) && (activePixelBuffer.size() > 0) && ! m_cancelled; ++r){
+        initializeModulationBuffer(modulationBuffer, radianceBuffer);
+        pathBuffer.resize(activePixelBuffer.size(), false);
+        rayBuffer.resize(activePixelBuffer.size(), false);
+        generateRayBuffer(tile, activePixelBuffer, rayBuffer, pathBuffer);
 
         // Progress bar
-        debugPrintf("Rendering... %f percent done \n", 100 * (float)r / (float)m_options.raysPerPixel);
+        if (m_options.tileSize <= 0) {
+            debugPrintf("Rendering... %f percent done, %d pixels still sampled \n", 100 * (float)r / (float)m_options.raysPerPixel, activePixelBuffer.size());
+        }
 
         for(int d = 0; d < m_options.maxRayDepth; ++d){
-            findIntersection(rayBuffer, surfelBuffer);
-            chooseLight(surfelBuffer, biradianceBuffer, shadowRayBuffer);
+            // Only the live paths are traced. Resizing keeps the storage, so this does not allocate.
+            const int liveCount = pathBuffer.size();
+            for (Array<TriTree::Hit>& triHitBuffer : triHitBuffers) {
+                triHitBuffer.resize(liveCount, false);
+            }
+            hitBuffer.resize(liveCount);
+            materialBuffer.resize(liveCount, false);
+            biradianceBuffer.resize(liveCount, false);
+            shadowRayBuffer.resize(liveCount, false);
+            lightShadowedBuffer.resize(liveCount, false);
+            causticBuffer.resize(liveCount, false);
+
+            // Only the camera rays are coherent. After a bounce they scatter.
+            findIntersection(rayBuffer, triHitBuffers, hitBuffer, d == 0);
+            sampleMaterials(hitBuffer, materialBuffer);
+            if ((r == 0) && (d == 0)) {
+                captureDenoiseBuffers(tile, pathBuffer, rayBuffer, hitBuffer, materialBuffer);
+            }
+            chooseLight(hitBuffer, biradianceBuffer, shadowRayBuffer);
             testVisibilty(shadowRayBuffer, lightShadowedBuffer);
+            if (m_photonMap.size() > 0) {
+                gatherCaustics(hitBuffer, materialBuffer, causticBuffer);
+            }
             
-            L_i(modulationBuffer,surfelBuffer, rayBuffer, biradianceBuffer, lightShadowedBuffer, shadowRayBuffer, extinctionPointBuffer, inMediumBuffer);
+            L_i(pathBuffer, radianceBuffer, modulationBuffer, hitBuffer, materialBuffer, rayBuffer, biradianceBuffer, lightShadowedBuffer, shadowRayBuffer, extinctionPointBuffer, inMediumBuffer, causticBuffer);
             
-            generateRecursiveRay(surfelBuffer, rayBuffer, modulationBuffer, r, d, extinctionPointBuffer, inMediumBuffer);
+            generateRecursiveRay(pathBuffer, hitBuffer, materialBuffer, rayBuffer, radianceBuffer, modulationBuffer, r, d, extinctionPointBuffer, inMediumBuffer);
+
+            // Paths that escaped to the sky or stopped at a surface without impulses have black modulation and contribute nothing more
+            if ((d + 1 < m_options.maxRayDepth) && (compactPaths(modulationBuffer, pathBuffer, rayBuffer, nextPathBuffer, nextRayBuffer) == 0)) {
+                break;
+            }
+        }
+
+        convergedPixels += accumulateSample(tile, r, radianceBuffer, meanBuffer, varianceBuffer, sampleCountBuffer, activePixelBuffer);
+    }
+    writeTile(tile, meanBuffer, sampleCountBuffer);
+    m_convergedPixels += convergedPixels;
+
+    // Progress bar, at every tenth of the tiles
+    const int tilesDone = ++m_tilesDone;
+    if ((m_tileCount > 1) && ((tilesDone * 10) / m_tileCount != ((tilesDone - 1) * 10) / m_tileCount)) {
+        debugPrintf("Rendering... %f percent done \n", 100 * (float)tilesDone / (float)m_tileCount);
+    }
+    if (m_options.onTileDone) {
+        m_options.onTileDone(Rect2D::xywh(float(tile.origin.x), float(tile.origin.y), float(tile.width), float(tile.height)), tilesDone, m_tileCount);
+    }
+}
+
+void PathTracer::tracePhotons() {
+    m_photonMap.clear();
+    if ((m_options.causticPhotons <= 0) || (m_lightArray.size() == 0)) {
+        return;
+    }
+
+    Stopwatch clock;
+    clock.tick();
+
+    // Photons are only useful if they pass through the water, so they are aimed at the bounds of everything that transmits
+    AABox target;
+    bool haveTarget = false;
+    const auto addToTarget = [&](const AABox& box) {
+        if (haveTarget) {
+            target.merge(box);
+        } else {
+            target = box;
+            haveTarget = true;
+        }
+    };
+    for (int l = 0; l < SceneTree::LEVEL_COUNT; ++l) {
+        const SceneTree::Level& level = m_trees->level(l);
+        const CPUVertexArray& vertexArray = level.tris.vertexArray();
+        for (int t = 0; t < level.tris.size(); ++t) {
+            if (m_trees->materials()[level.triMaterial[t]].transmits()) {
+                for (int k = 0; k < 3; ++k) {
+                    addToTarget(AABox(level.tris[t].position(vertexArray, k)));
+                }
+            }
+        }
+    }
+    if (notNull(m_water) && ! m_water->bounds().isEmpty()) {
+        addToTarget(m_water->bounds());
+    }
+    if (! haveTarget) {
+        return;
+    }
+    const Point3& targetCenter = target.center();
+    const float targetRadius = 0.5f * target.extent().length();
+
+    // Emit every photon toward the sphere around the water, uniformly over the cone that it subtends from its light
+    const int count = m_options.causticPhotons;
+    const int lightCount = m_lightArray.size();
+    Array<Ray> rayBuffer;
+    Array<Power3> powerBuffer;
+    Array<Point3> extinctionPointBuffer;
+    Array<bool> inMediumBuffer;
+    rayBuffer.resize(count);
+    powerBuffer.resize(count);
+    extinctionPointBuffer.resize(count);
+    inMediumBuffer.resize(count);
+    Thread::runConcurrently(0, count, [&](int p) {
+        const shared_ptr<Light>& light = m_lightArray[p % lightCount];
+        const Point3& origin = light->position().xyz();
+        const Vector3& toTarget = targetCenter - origin;
+        const float distance = toTarget.length();
+        const float cosMax = (distance > targetRadius) ? sqrt(1.0f - square(targetRadius / distance)) : -1.0f;
+        const Vector3& axis = (distance > 0.0f) ? toTarget / distance : Vector3(0, -1, 0);
+        Vector3 tangent;
+        Vector3 bitangent;
+        axis.getTangents(tangent, bitangent);
+
+        Random& rng = Random::threadCommon();
+        const float cosTheta = 1.0f - rng.uniform() * (1.0f - cosMax);
+        const float sinTheta = sqrt(max(0.0f, 1.0f - square(cosTheta)));
+        const float phi = 2.0f * pif() * rng.uniform();
+        const Vector3& direction = axis * cosTheta + (tangent * cos(phi) + bitangent * sin(phi)) * sinTheta;
+
+        // A light's biradiance one meter away is its intensity in that direction. Dividing by the density of the
+        // direction and the number of photons from this light gives each photon's share of the power.
+        const float pdf = 1.0f / (2.0f * pif() * (1.0f - cosMax));
+        powerBuffer[p] = light->biradiance(origin + direction) * (float(lightCount) / (pdf * float(count)));
+        rayBuffer[p] = Ray::fromOriginAndDirection(origin, direction);
+        inMediumBuffer[p] = false;
+    });
+
+    Array<TriTree::Hit> triHitBuffers[SceneTree::LEVEL_COUNT];
+    HitBuffer hitBuffer;
+    Array<MaterialSample> materialBuffer;
+    Array<Photon> landedBuffer;
+    Array<bool> passedWaterBuffer;
+    Array<bool> landedFlagBuffer;
+    passedWaterBuffer.resize(count);
+    passedWaterBuffer.setAll(false);
+
+    Array<Photon> photons;
+    for (int d = 0; (d < m_options.maxRayDepth) && (rayBuffer.size() > 0); ++d) {
+        const int liveCount = rayBuffer.size();
+        for (Array<TriTree::Hit>& triHitBuffer : triHitBuffers) {
+            triHitBuffer.resize(liveCount, false);
+        }
+        hitBuffer.resize(liveCount);
+        materialBuffer.resize(liveCount, false);
+        landedBuffer.resize(liveCount, false);
+        landedFlagBuffer.resize(liveCount, false);
+
+        findIntersection(rayBuffer, triHitBuffers, hitBuffer, false);
+        sampleMaterials(hitBuffer, materialBuffer);
+
+        Thread::runConcurrently(0, liveCount, [&](int j) {
+            landedFlagBuffer[j] = false;
+            if (! hitBuffer.hit(j) || hitBuffer.foam(j)) {
+                powerBuffer[j] = Power3::black();
+                return;
+            }
+
+            const MaterialSample& material = materialBuffer[j];
+            const Point3& position = hitBuffer.position[j];
+            if (inMediumBuffer[j]) {
+                powerBuffer[j] *= extinctionFunction((position - extinctionPointBuffer[j]).length());
+            }
+
+            // Light that reaches a diffuse surface without passing through the water is direct light, which the path tracer already samples
+            if (passedWaterBuffer[j] && material.lambertian.nonZero()) {
+                landedBuffer[j].position = position;
+                landedBuffer[j].direction = rayBuffer[j].direction();
+                landedBuffer[j].power = powerBuffer[j];
+                landedFlagBuffer[j] = true;
+            }
+
+            // Go on through a mirror reflection or refraction, chosen in proportion to their magnitudes. The photon
+            // is absorbed with the probability that neither is chosen.
+            MaterialSample::Impulse impulses[MaterialSample::MAX_IMPULSES];
+            const int impulseCount = material.getImpulses(hitBuffer.shadingNormal[j], -rayBuffer[j].direction(), impulses);
+            float total = 0.0f;
+            for (int a = 0; a < impulseCount; ++a) {
+                total += impulses[a].magnitude.average();
+            }
+            float u = Random::threadCommon().uniform() * max(total, 1.0f);
+            int chosen = -1;
+            for (int a = 0; (a < impulseCount) && (chosen < 0); ++a) {
+                u -= impulses[a].magnitude.average();
+                if (u < 0.0f) {
+                    chosen = a;
+                }
+            }
+            if (chosen < 0) {
+                powerBuffer[j] = Power3::black();
+                return;
+            }
+
+            const MaterialSample::Impulse& impulse = impulses[chosen];
+            powerBuffer[j] *= impulse.magnitude * (max(total, 1.0f) / impulse.magnitude.average());
+
+            const Vector3& geometricNormal = hitBuffer.geometricNormal[j];
+            const float k = sign(impulse.direction.dot(geometricNormal));
+            inMediumBuffer[j] = (k <= 0) ? material.kappaNeg.nonZero() : material.kappaPos.nonZero();
+            extinctionPointBuffer[j] = position;
+            passedWaterBuffer[j] = passedWaterBuffer[j] || material.transmits();
+            rayBuffer[j] = Ray::fromOriginAndDirection(position + geometricNormal * .01f * k, impulse.direction);
+        });
+
+        // Store the photons that landed and pack the ones still travelling at the front
+        int live = 0;
+        for (int j = 0; j < liveCount; ++j) {
+            if (landedFlagBuffer[j]) {
+                photons.append(landedBuffer[j]);
+            }
+            if (powerBuffer[j].nonZero()) {
+                rayBuffer[live] = rayBuffer[j];
+                powerBuffer[live] = powerBuffer[j];
+                extinctionPointBuffer[live] = extinctionPointBuffer[j];
+                inMediumBuffer[live] = inMediumBuffer[j];
+                passedWaterBuffer[live] = passedWaterBuffer[j];
+                ++live;
+            }
+        }
+        rayBuffer.resize(live, false);
+        powerBuffer.resize(live, false);
+        extinctionPointBuffer.resize(live, false);
+        inMediumBuffer.resize(live, false);
+        passedWaterBuffer.resize(live, false);
+    }
+
+    clock.tock();
+    m_stats.photonsEmitted = count;
+    m_stats.photonsStored = photons.size();
+    m_stats.photonTraceTime = clock.elapsedTime();
+
+    m_photonMap.setContents(photons);
+    m_stats.photonBuildTime = m_photonMap.buildTime();
+}
+
+void PathTracer::gatherCaustics(const HitBuffer& hitBuffer, const Array<MaterialSample>& materialBuffer, Array<Radiance3>& causticBuffer) {
+    Stopwatch clock;
+    clock.tick();
+    runOverPaths(hitBuffer.size(), [&](int j) {
+        causticBuffer[j] = Radiance3::black();
+        if (hitBuffer.hit(j) && ! hitBuffer.foam(j) && materialBuffer[j].lambertian.nonZero()) {
+            // Lambertian reflection of the photons' irradiance
+            causticBuffer[j] = materialBuffer[j].lambertian / pif() *
+                m_photonMap.irradiance(hitBuffer.position[j], hitBuffer.geometricNormal[j], m_options.photonRadius);
+        }
+    });
+    clock.tock();
+
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    m_stats.photonGatherTime += clock.elapsedTime();
+}
+
+void PathTracer::captureDenoiseBuffers(const Tile& tile, const Array<int>& pathBuffer, const Array<Ray>& rayBuffer, const HitBuffer& hitBuffer, const Array<MaterialSample>& materialBuffer) {
+    runOverPaths(pathBuffer.size(), [&](int j) {
+        const Point2int32& point = tile.pixel(pathBuffer[j]);
+        const int p = point.x + point.y * m_width;
+        if (! hitBuffer.hit(j)) {
+            m_denoiseBuffers.surface[p] = DenoiseBuffers::SKY;
+            m_denoiseBuffers.normal[p] = -rayBuffer[j].direction();
+            m_denoiseBuffers.depth[p] = finf();
+            m_denoiseBuffers.albedo[p] = Color3::one();
+            return;
+        }
+
+        const bool water = ! hitBuffer.foam(j) && materialBuffer[j].transmits();
+        m_denoiseBuffers.surface[p] = hitBuffer.foam(j) ? DenoiseBuffers::FOAM : (water ? DenoiseBuffers::WATER : DenoiseBuffers::SOLID);
+        m_denoiseBuffers.normal[p] = hitBuffer.shadingNormal[j];
+        m_denoiseBuffers.depth[p] = (hitBuffer.position[j] - rayBuffer[j].origin()).length();
+        m_denoiseBuffers.position[p] = hitBuffer.position[j];
+        m_denoiseBuffers.albedo[p] = (m_denoiseBuffers.surface[p] == DenoiseBuffers::SOLID) ? materialBuffer[j].reflectivity().min(Color3::one()) : Color3::one();
+    });
+}
+
+void PathTracer::runOverPaths(int count, const std::function<void(int)>& callback) const {
+    // When tiles are traced concurrently every core already has one
+    Thread::runConcurrently(0, count, callback, m_tilesConcurrent);
+}
+
+int PathTracer::accumulateSample(const Tile& tile, int r, const Array<Radiance3>& radianceBuffer, Array<Radiance3>& meanBuffer, Array<float>& varianceBuffer, Array<int>& sampleCountBuffer, Array<int>& activePixelBuffer) const {
+    // Every active pixel has had the same number of samples
+    const int n = r + 1;
+    runOverPaths(activePixelBuffer.size(), [&](int j) {
+        const int i = activePixelBuffer[j];
+        const Radiance3 delta = radianceBuffer[i] - meanBuffer[i];
+        meanBuffer[i] += delta / float(n);
+        varianceBuffer[i] += delta.average() * (radianceBuffer[i] - meanBuffer[i]).average();
+        sampleCountBuffer[i] = n;
+    });
+
+    const bool budgeted = (m_options.pixelRayBudget.size() == m_width * m_height);
+    const bool testNoise = m_options.adaptiveSampling && (n >= max(m_options.minRaysPerPixel, 2));
+    if (! budgeted && ! testNoise) {
+        return 0;
+    }
+
+    // Keep the pixels with rays left whose standard error is still above the threshold, in order
+    int k = 0;
+    int converged = 0;
+    for (int j = 0; j < activePixelBuffer.size(); ++j) {
+        const int i = activePixelBuffer[j];
+        if (budgeted) {
+            const Point2int32& point = tile.pixel(i);
+            if (n >= m_options.pixelRayBudget[point.x + point.y * m_width]) {
+                continue;
+            }
+        }
+        const float standardError = testNoise ? sqrt(varianceBuffer[i] / float((n - 1) * n)) : finf();
+        if (standardError > m_options.noiseThreshold * max(meanBuffer[i].average(), 1e-3f)) {
+            activePixelBuffer[k++] = i;
+        } else if (n < m_options.raysPerPixel) {
+            ++converged;
         }
     }
-    lowerCameraSensitivity();
+    activePixelBuffer.resize(k, false);
+    return converged;
+}
+
+void PathTracer::writeTile(const Tile& tile, const Array<Radiance3>& meanBuffer, const Array<int>& sampleCountBuffer) {
+    runOverPaths(tile.size(), [&](int i) {
+        const Point2int32& point = tile.pixel(i);
+        m_framebuffer[point.x + point.y * m_width] = meanBuffer[i];
+        m_samplesPerPixel[point.x + point.y * m_width] = sampleCountBuffer[i];
+    });
 }
 
-void PathTracer::lowerCameraSensitivity() const {
-    if (!m_options.lowerCameraSensitivity) { return; }
+void PathTracer::resolveImage() {
+    const float scale = sensitivityScale();
+    Thread::runConcurrently(0, m_height, [&](int y) {
+        const Radiance3* row = m_framebuffer.getCArray() + y * m_width;
+        for (int x = 0; x < m_width; ++x) {
+            m_image->set(Point2int32(x, y), row[x] * scale);
+        }
+    });
+}
+
+shared_ptr<Image> PathTracer::samplesPerPixelImage() const {
+    const shared_ptr<Image>& image = Image::create(m_width, m_height, ImageFormat::RGB32F());
     Thread::runConcurrently(Point2int32(0, 0), Point2int32(m_width, m_height), [&](Point2int32 point) {
-        Color3 color;
-        m_image->get(point, color);
-        m_image->set(point, color / (float) 2);
+        image->set(point, Color3(float(m_samplesPerPixel[point.x + point.y * m_width]) / float(max(m_options.raysPerPixel, 1))));
     });
+    return image;
 }
 
-void PathTracer::L_i(Array<Radiance3>& modulationBuffer, const Array<shared_ptr<Surfel>>& surfelBuffer, const Array<Ray>& rayBuffer, const Array<Biradiance3>& biradianceBuffer, Array<bool>& lightShadowedBuffer, Array<Ray>& shadowRayBuffer, const Array<Point3>& extinctionPointBuffer, Array<bool>& inMediumBuffer) const {
-    Thread::runConcurrently(Point2int32(0, 0), Point2int32(m_width, m_height),[&](Point2int32 point) {
-        const int i = point.x + (m_width * point.y);
-        const Vector3 w_i = -1 * shadowRayBuffer[i].direction();
-        const Vector3 w_o = -1 * rayBuffer[i].direction();
+void PathTracer::L_i(const Array<int>& pathBuffer, Array<Radiance3>& radianceBuffer, Array<Radiance3>& modulationBuffer, const HitBuffer& hitBuffer, const Array<MaterialSample>& materialBuffer, const Array<Ray>& rayBuffer, const Array<Biradiance3>& biradianceBuffer, Array<bool>& lightShadowedBuffer, Array<Ray>& shadowRayBuffer, const Array<Point3>& extinctionPointBuffer, Array<bool>& inMediumBuffer, const Array<Radiance3>& causticBuffer) const {
+    runOverPaths(pathBuffer.size(), [&](int j) {
+        // j indexes the per-bounce buffers and i the per-pixel ones
+        const int i = pathBuffer[j];
+        const Vector3 w_i = -1 * shadowRayBuffer[j].direction();
+        const Vector3 w_o = -1 * rayBuffer[j].direction();
         Color3 c(0.0f);
         float alpha = 1.0f;
 
@@ -113,84 +563,87 @@ void PathTracer::L_i(Array<Radiance3>& modulationBuffer, const Array<shared_ptr<
         Color3 foamColor(0.95f, 0.95f, 1.0f);
 
         // Check to see if we hit the sky
-        if (isNull(surfelBuffer[i])) {  
-            m_image->increment(point, backgroundRadiance(rayBuffer[i]) * modulationBuffer[i]);
+        if (! hitBuffer.hit(j)) {  
+            radianceBuffer[i] += backgroundRadiance(rayBuffer[j]) * modulationBuffer[i];
             return;
         }
-        
-        // Check the kappaPos tag to see did we hit a foam particle?
-        if (surfelBuffer[i]->kappaPos == foamParticleTag) {
-            // Between 0 and 1. is 1 when shadingNormal and eyeRay are exactly opposite.
-            float cosTerm = surfelBuffer[i]->shadingNormal.dot(-rayBuffer[i].direction());
+
+        // Did we hit a foam particle?
+        if (hitBuffer.foam(j)) {
+            // Between 0 and 1. is 1 when the normal and eyeRay are exactly opposite.
+            float cosTerm = hitBuffer.shadingNormal[j].dot(-rayBuffer[j].direction());
             cosTerm *= cosTerm;
 
             // Shade foam particles such that they are whiter in the center and fade to the color behind them on the edges based on how transmissive they are.
             // This is a hack to avoid the rendering cost of making each foam particle transmissive with an extinction coefficient.
-            m_image->increment(point, cosTerm * foamColor * surfelBuffer[i]->kappaNeg.r * modulationBuffer[i]);
+            radianceBuffer[i] += cosTerm * foamColor * m_foamTree[hitBuffer.material[j]].age * modulationBuffer[i];
             return;
         }
+
+        // Light focused here through the water. The water in front of the point dims it like the rest of its light.
+        const float causticAlpha = inMediumBuffer[i] ? extinctionFunction((hitBuffer.position[j] - extinctionPointBuffer[i]).length()) : 1.0f;
+        radianceBuffer[i] += causticAlpha * causticBuffer[j] * modulationBuffer[i];
         
         // If the point is in the liquid, shade for light absorption
         if (inMediumBuffer[i]) {
-            inMediumBuffer[i] = surfelBuffer[i]->transmissive(); // we've probably exited the liquid
+            inMediumBuffer[i] = materialBuffer[j].transmits(); // we've probably exited the liquid
             
             // Calculate the Beer-Lambert modifier
-            const Vector3& inMediumVector = surfelBuffer[i]->position - extinctionPointBuffer[i];
+            const Vector3& inMediumVector = hitBuffer.position[j] - extinctionPointBuffer[i];
             const float inMediumDistance = inMediumVector.length();
             alpha = extinctionFunction(inMediumDistance);
 
             // Add color as the light is absorbed
             c += (1.0f - alpha) * waterColor;
 
-            // Map to the caustic texture when hit a roughly horizontal surface
-            Color3 causticLight;
-            int width = m_causticMap->width();
-            int height = m_causticMap->height();
-            const int inverseCausticSize = 150; // multiply by more to go smaller
-            m_causticMap->get(Point2int32(int(abs(surfelBuffer[i]->position.x * inverseCausticSize)) % width, int(abs(surfelBuffer[i]->position.z * inverseCausticSize)) % height), causticLight);
-            c += max(alpha * causticLight * surfelBuffer[i]->geometricNormal.dot(Vector3(0,1,0)), Color3(0.0f)); //caustics are brightest when the surfel's normal == Vector3(0,1,0)
+            // Without photons, map to the caustic texture when hit a roughly horizontal surface
+            if (m_options.causticPhotons <= 0) {
+                const Color3& causticLight = m_caustics->sample(m_causticFrame, hitBuffer.position[j]);
+                c += max(alpha * causticLight * hitBuffer.geometricNormal[j].dot(Vector3(0,1,0)), Color3(0.0f)); //caustics are brightest when the surfel's normal == Vector3(0,1,0)
+            }
             
             // Handle areas of liquid in shadow
-            if (lightShadowedBuffer[i]) {  
+            if (lightShadowedBuffer[j]) {  
                 // Add ambient light
-                m_image->increment(point, ((1.0f - alpha) * shadowColor + alpha * surfelBuffer[i]->reflectivity(Random::threadCommon()) * 0.05f) * modulationBuffer[i]);
+                radianceBuffer[i] += ((1.0f - alpha) * shadowColor + alpha * materialBuffer[j].reflectivity() * 0.05f) * modulationBuffer[i];
 
                 // Any future light contributed will be as if seen through the water so we need to weight it appropriately.
                 // This is not physically accurate but looks good.
                 modulationBuffer[i] *= alpha;
-                modulationBuffer[i] += (1.0f-alpha) * shadowColor / m_options.raysPerPixel;
+                modulationBuffer[i] += (1.0f-alpha) * shadowColor;
                 return;
             }
         } 
-        else if(lightShadowedBuffer[i]) {    
+        else if(lightShadowedBuffer[j]) {    
             // Handle shadows outside of the liquid
-            m_image->increment(point, alpha * surfelBuffer[i]->reflectivity(Random::threadCommon()) * 0.05f*modulationBuffer[i]);
+            radianceBuffer[i] += alpha * materialBuffer[j].reflectivity() * 0.05f*modulationBuffer[i];
             return;
         }
         
         // Calculate surfel color
-        const Radiance3& emit = surfelBuffer[i]->emittedRadiance(w_o);
-        const Radiance3& birad = biradianceBuffer[i];
-        const float cosTerm = abs(surfelBuffer[i]->shadingNormal.dot(w_i));
-        const Color3& bsdf = surfelBuffer[i]->finiteScatteringDensity(w_i, w_o);
+        const Radiance3& emit = materialBuffer[j].emissive;
+        const Radiance3& birad = biradianceBuffer[j];
+        const float cosTerm = abs(hitBuffer.shadingNormal[j].dot(w_i));
+        const Color3& bsdf = materialBuffer[j].finiteScatteringDensity(hitBuffer.shadingNormal[j], w_i, w_o);
 
         Color3 temp_c = (emit + birad * bsdf * cosTerm);
-        temp_c += surfelBuffer[i]->reflectivity(Random::threadCommon()) * 0.05f;
+        temp_c += materialBuffer[j].reflectivity() * 0.05f;
 
         // Beer-Lambert shading
         c += alpha * temp_c;
-        m_image->increment(point, c * modulationBuffer[i]);
+        radianceBuffer[i] += c * modulationBuffer[i];
 
         // Any future light contributed will be as if seen through the water so we need to weight it appropriately.
         // This is not physically accurate but looks good.
         modulationBuffer[i] *= alpha;
-        modulationBuffer[i] += (1.0f-alpha) * waterColor / m_options.raysPerPixel;
+        modulationBuffer[i] += (1.0f-alpha) * waterColor;
     });
 }
 
-void PathTracer::initializeModulationBuffer(Array<Radiance3>& modulationBuffer) const {
-    Thread::runConcurrently(0, modulationBuffer.size(), [&](int i) {
-        modulationBuffer[i] = Radiance3( 1 / (float)m_options.raysPerPixel );
+void PathTracer::initializeModulationBuffer(Array<Radiance3>& modulationBuffer, Array<Radiance3>& radianceBuffer) const {
+    runOverPaths( modulationBuffer.size(), [&](int i) {
+        modulationBuffer[i] = Radiance3(1.0f);
+        radianceBuffer[i] = Radiance3::black();
     });
 }
 
@@ -199,11 +652,13 @@ Radiance3 PathTracer::backgroundRadiance(const Ray& ray) const {
      return m_skybox->bilinear(ray.direction()).rgb();
 }
 
-void PathTracer::generateRayBuffer(Array<Ray>& rayBuffer) const {
-    Thread::runConcurrently(Point2int32(0, 0), Point2int32(m_width, m_height), [&](Point2int32 point) {
+void PathTracer::generateRayBuffer(const Tile& tile, const Array<int>& activePixelBuffer, Array<Ray>& rayBuffer, Array<int>& pathBuffer) const {
+    runOverPaths(activePixelBuffer.size(), [&](int j) {
+        const Point2int32& point = tile.pixel(activePixelBuffer[j]);
+        pathBuffer[j] = activePixelBuffer[j];
         if (m_options.raysPerPixel == 1) {
             // Start in the center of the pixel
-            rayBuffer[point.x + point.y * m_width] = m_camera->worldRay(
+            rayBuffer[j] = m_camera->worldRay(
                 point.x + 0.5f,
                 point.y + 0.5f,
                 m_image->bounds()
@@ -211,7 +666,7 @@ void PathTracer::generateRayBuffer(Array<Ray>& rayBuffer) const {
         } else {
             // Start at random points within the pixel
             Random& rng = Random::threadCommon();
-            rayBuffer[point.x+(point.y*m_width)] = m_camera->worldRay(
+            rayBuffer[j] = m_camera->worldRay(
                 point.x + rng.uniform(),
                 point.y + rng.uniform(),
                 m_image->bounds()
@@ -220,76 +675,240 @@ void PathTracer::generateRayBuffer(Array<Ray>& rayBuffer) const {
     });
 }
 
-void PathTracer::findIntersection( const Array<Ray>& rayBuffer, Array<shared_ptr<Surfel>>& surfelBuffer) const {
-    m_tritree.intersectRays(rayBuffer, surfelBuffer, TriTree::COHERENT_RAY_HINT); 
+int PathTracer::compactPaths(const Array<Radiance3>& modulationBuffer, Array<int>& pathBuffer, Array<Ray>& rayBuffer, Array<int>& nextPathBuffer, Array<Ray>& nextRayBuffer) const {
+    // Large enough that a block is worth a thread, small enough that there are many blocks per core
+    const int blockSize = 4096;
+    const int pathCount = pathBuffer.size();
+    const int blockCount = (pathCount + blockSize - 1) / blockSize;
+
+    // Count the live paths in each block. blockOffset[b + 1] receives block b's count.
+    Array<int> blockOffset;
+    blockOffset.resize(blockCount + 1);
+    blockOffset[0] = 0;
+    runOverPaths(blockCount, [&](int b) {
+        int count = 0;
+        for (int j = b * blockSize; j < min((b + 1) * blockSize, pathCount); ++j) {
+            if (modulationBuffer[pathBuffer[j]].nonZero()) {
+                ++count;
+            }
+        }
+        blockOffset[b + 1] = count;
+    });
+
+    // There are few blocks, so the prefix sum over them is serial
+    for (int b = 0; b < blockCount; ++b) {
+        blockOffset[b + 1] += blockOffset[b];
+    }
+    const int liveCount = blockOffset[blockCount];
+
+    // Each block writes its live paths, in order, starting at its offset
+    nextPathBuffer.resize(liveCount, false);
+    nextRayBuffer.resize(liveCount, false);
+    runOverPaths(blockCount, [&](int b) {
+        int k = blockOffset[b];
+        for (int j = b * blockSize; j < min((b + 1) * blockSize, pathCount); ++j) {
+            if (modulationBuffer[pathBuffer[j]].nonZero()) {
+                nextPathBuffer[k] = pathBuffer[j];
+                nextRayBuffer[k] = rayBuffer[j];
+                ++k;
+            }
+        }
+    });
+
+    Array<int>::swap(pathBuffer, nextPathBuffer);
+    Array<Ray>::swap(rayBuffer, nextRayBuffer);
+    return liveCount;
 }
 
-void PathTracer::chooseLight(const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer) const {
-    Thread::runConcurrently(0, biradianceBuffer.size(), [&](int i) {
-        if (isNull(surfelBuffer[i])) return;
+void PathTracer::findIntersection(const Array<Ray>& rayBuffer, Array<TriTree::Hit> triHitBuffers[SceneTree::LEVEL_COUNT], HitBuffer& hitBuffer, bool coherent) const {
+    // Bottom level: every ray against each tree. In tiled mode all cores are already busy with other tiles.
+    for (int l = 0; l < SceneTree::LEVEL_COUNT; ++l) {
+        m_trees->level(l).intersectRays(rayBuffer, triHitBuffers[l], coherent, m_tilesConcurrent);
+    }
+
+    runOverPaths(rayBuffer.size(), [&](int i) {
+        // Top level: the closest of the levels' hits
+        int l = -1;
+        for (int candidate = 0; candidate < SceneTree::LEVEL_COUNT; ++candidate) {
+            const TriTree::Hit& hit = triHitBuffers[candidate][i];
+            if ((hit.triIndex != TriTree::Hit::NONE) && ((l < 0) || (hit.distance < triHitBuffers[l][i].distance))) {
+                l = candidate;
+            }
+        }
+        if (l < 0) {
+            hitBuffer.flags[i] = 0;
+            return;
+        }
+
+        const SceneTree::Level& level = m_trees->level(l);
+        const CPUVertexArray& vertexArray = level.tris.vertexArray();
+        const TriTree::Hit& hit = triHitBuffers[l][i];
+
+        // Interpolate the vertex attributes at the hit's barycentric coordinates
+        const Tri& tri = level.tris[hit.triIndex];
+        const float w = 1.0f - hit.u - hit.v;
+        const Point3& p0 = tri.position(vertexArray, 0);
+        Vector3 geometricNormal = (tri.position(vertexArray, 1) - p0).cross(tri.position(vertexArray, 2) - p0).directionOrZero();
+        Vector3 shadingNormal = (tri.normal(vertexArray, 0) * w + tri.normal(vertexArray, 1) * hit.u + tri.normal(vertexArray, 2) * hit.v).directionOrZero();
+        const Point2& texCoord = tri.texCoord(vertexArray, 0) * w + tri.texCoord(vertexArray, 1) * hit.u + tri.texCoord(vertexArray, 2) * hit.v;
+        if (hit.backface) {
+            geometricNormal = -geometricNormal;
+            shadingNormal = -shadingNormal;
+        }
+
+        const int material = level.triMaterial[hit.triIndex];
+        const Ray& ray = rayBuffer[i];
+        hitBuffer.set(i, ray.origin() + ray.direction() * hit.distance, geometricNormal, shadingNormal, texCoord, material,
+            uint8((hit.backface ? HitBuffer::BACKFACE : 0) | (m_trees->materials()[material].transmits() ? HitBuffer::MEDIUM : 0)));
+    });
+
+    if (notNull(m_water)) {
+        m_water->intersectRays(rayBuffer, hitBuffer, m_waterMaterial, m_tilesConcurrent);
+    }
+
+    if (m_foamTree.size() == 0) {
+        return;
+    }
+
+    runOverPaths(rayBuffer.size(), [&](int i) {
+        Ray ray = rayBuffer[i];
+        if (hitBuffer.hit(i)) {
+            // Only foam in front of the surface hit can replace it
+            ray.set(ray.origin(), ray.direction(), ray.minDistance(), (hitBuffer.position[i] - ray.origin()).dot(ray.direction()));
+        }
 
-        //For efficiency, if there is only one light, select it
-        if (m_lightArray.size() == 1) {
-            biradianceBuffer[i] = m_lightArray[0]->biradiance(surfelBuffer[i]->position);
+        FoamHit foam;
+        if (m_foamTree.intersect(ray, foam)) {
+            hitBuffer.set(i, foam.position, foam.normal, foam.normal, Point2(0, 0), foam.index, HitBuffer::FOAM);
+        }
+    });
+}
 
-            const Point3& P0 = m_lightArray[0]->position().xyz();;
-            const Point3& P1 = surfelBuffer[i]->position;
-            const float len = (P1-P0).length() - .0001f;
-            shadowRayBuffer[i] = Ray::fromOriginAndDirection(P0, (P1-P0) / len, 0.0f, len - 1e-3f).bumpedRay(.0001f);
+void PathTracer::sampleMaterials(const HitBuffer& hitBuffer, Array<MaterialSample>& materialBuffer) const {
+    runOverPaths(hitBuffer.size(), [&](int i) {
+        if (! hitBuffer.hit(i) || hitBuffer.foam(i)) {
             return;
         }
 
-        float totalBiradiance = 0.0f;
-        for (int j = 0; j < m_lightArray.size(); ++j) {
-            totalBiradiance += m_lightArray[j]->biradiance(surfelBuffer[i]->position).sum();      
+        const int material = hitBuffer.material[i];
+        MaterialSample& sample = materialBuffer[i];
+        const shared_ptr<Material>& textured = m_trees->texturedMaterials()[material];
+        if (isNull(textured)) {
+            sample = m_trees->materials()[material];
+        } else {
+            SceneTree::sampleMaterial(textured, hitBuffer.texCoord[i], sample);
         }
-        
-        Random& rng = Random::threadCommon();
-        float r = totalBiradiance * rng.uniform();
-        for (int j = 0; j < m_lightArray.size(); ++j) {
-            const Biradiance3 birad = m_lightArray[j]->biradiance(surfelBuffer[i]->position);
-            r -= birad.sum();
-            if (r < 0) {
-                biradianceBuffer[i] = birad * (totalBiradiance / birad.sum());
-
-                const Point3& P0 = m_lightArray[j]->position().xyz();;
-                const Point3& P1 = surfelBuffer[i]->position;
-                const float len = (P1-P0).length() - 0.0001f;
-                shadowRayBuffer[i] = Ray::fromOriginAndDirection(P0, (P1-P0) / len, 0.0f, len - 1e-3f).bumpedRay(0.0001f);
-                break;
-            }
+
+        if (hitBuffer.flags[i] & HitBuffer::BACKFACE) {
+            sample.flip();
         }
     });
+}
 
+void PathTracer::chooseLight(const HitBuffer& hitBuffer, Array<Biradiance3>& biradianceBuffer, Array<Ray>& shadowRayBuffer) const {
+    if (m_lightSampler.size() == 0) {
+        return;
+    }
+    runOverPaths(biradianceBuffer.size(), [&](int i) {
+        if (! hitBuffer.hit(i) || hitBuffer.foam(i)) return;
+
+        // For efficiency, if there is only one light, select it without drawing a random number
+        float pdf = 1.0f;
+        const int j = (m_lightSampler.size() == 1) ? 0 : m_lightSampler.sample(Random::threadCommon().uniform(), pdf);
+        const shared_ptr<Light>& light = m_lightSampler.light(j);
+        biradianceBuffer[i] = light->biradiance(hitBuffer.position[i]) / pdf;
+        shadowRayBuffer[i] = LightSampler::shadowRay(light->position().xyz(), hitBuffer.position[i]);
+    });
 }
 
 void PathTracer::testVisibilty(const Array<Ray>& shadowRayBuffer, Array<bool>& lightShadowedBuffer) const {
-    // Only test for shadows from opaque objects.
-    if (m_rigidTriTreeSize == 0) {
-        return;
+    // Light that reaches a point through the water is in the photon map when there is one, so the water must shadow
+    // it here or it would be counted twice. Otherwise only opaque objects cast shadows.
+    const bool transmissiveOccludes = (m_photonMap.size() > 0);
+
+    // A ray is shadowed if any level occludes it. The water is transmissive, so usually only the static level has rigid tris.
+    bool tested = false;
+    Array<bool> occludedBuffer;
+    for (int l = 0; l < SceneTree::LEVEL_COUNT; ++l) {
+        const SceneTree::Level& level = m_trees->level(l);
+        if ((transmissiveOccludes ? level.tris : level.rigidTris).size() == 0) {
+            continue;
+        }
+
+        if (! tested) {
+            level.intersectRays(shadowRayBuffer, lightShadowedBuffer, transmissiveOccludes, m_tilesConcurrent);
+        } else {
+            occludedBuffer.resize(shadowRayBuffer.size(), false);
+            level.intersectRays(shadowRayBuffer, occludedBuffer, transmissiveOccludes, m_tilesConcurrent);
+            runOverPaths(shadowRayBuffer.size(), [&](int i) {
+                lightShadowedBuffer[i] = lightShadowedBuffer[i] || occludedBuffer[i];
+            });
+        }
+        tested = true;
+    }
+    if (! tested) {
+        lightShadowedBuffer.setAll(false);
+    }
+
+    // The particle surface is not in the trees
+    if (transmissiveOccludes && notNull(m_water)) {
+        runOverPaths(shadowRayBuffer.size(), [&](int i) {
+            if (lightShadowedBuffer[i]) {
+                return;
+            }
+            float distance;
+            Vector3 normal;
+            bool entering;
+            int evaluations = 0;
+            lightShadowedBuffer[i] = m_water->intersect(shadowRayBuffer[i], distance, normal, entering, evaluations);
+        });
     }
-    m_rigidTriTree.intersectRays(shadowRayBuffer, lightShadowedBuffer, TriTree::OCCLUSION_TEST_ONLY | TriTree::DO_NOT_CULL_BACKFACES |  TriTree::COHERENT_RAY_HINT);
 }
 
-void PathTracer::generateRecursiveRay(const Array<shared_ptr<Surfel>>& surfelBuffer, Array<Ray>& rayBuffer, Array<Radiance3>& modulationBuffer, const int r, const int d, Array<Point3>& extinctionPointBuffer, Array<bool>& inMediumBuffer) const {
-    Thread::runConcurrently(0, surfelBuffer.size(), [&](int i) {
-        if (isNull(surfelBuffer[i])) {
+void PathTracer::generateRecursiveRay(const Array<int>& pathBuffer, const HitBuffer& hitBuffer, const Array<MaterialSample>& materialBuffer, Array<Ray>& rayBuffer, Array<Radiance3>& radianceBuffer, Array<Radiance3>& modulationBuffer, const int r, const int d, Array<Point3>& extinctionPointBuffer, Array<bool>& inMediumBuffer) const {
+    runOverPaths(hitBuffer.size(), [&](int j) {
+        // j indexes the per-bounce buffers and i the per-pixel ones
+        const int i = pathBuffer[j];
+        if (! hitBuffer.hit(j)) {
             // for rays the hit the sky don't keep adding to pixel value
             modulationBuffer[i] = Radiance3::black();   
             return;
         }; 
 
+        // Russian roulette. Dim paths are ended at random from the second bounce on, and the survivors weighted up by the
+        // chance that they survived, so that the image stays the same on average.
+        if (m_options.russianRoulette && (d >= 1)) {
+            const float survival = modulationBuffer[i].max() / m_options.rouletteThreshold;
+            if (survival < 1.0f) {
+                if (Random::threadCommon().uniform() >= survival) {
+                    modulationBuffer[i] = Radiance3::black();
+                    return;
+                }
+                modulationBuffer[i] /= survival;
+            }
+        }
+
+        // Check if we hit foam
+        if (hitBuffer.foam(j)) {
+            //if we hit a diffuse particle, in order to get the color behind the diffuse particle, we need to cast another ray from behind the particle in the same direction
+            const Point3& origin = hitBuffer.position[j] - hitBuffer.geometricNormal[j] * m_foamTree[hitBuffer.material[j]].radius * 1.01f;
+            rayBuffer[j] = Ray::fromOriginAndDirection(origin, rayBuffer[j].direction());
+            return;
+        }
+
         // Save the point hit so that later the distance traveled through the liquid can be calculated
-        extinctionPointBuffer[i] = surfelBuffer[i]->position;
+        extinctionPointBuffer[i] = hitBuffer.position[j];
 
         // Get impulses
         Vector3 w_after;
-        const Vector3 w_before = -rayBuffer[i].direction();
-        Surfel::ImpulseArray impulseArray;
-        surfelBuffer[i]->getImpulses(PathDirection::EYE_TO_SOURCE, w_before, impulseArray);
-
-        // If no impulses, cast no further rays
-        if (impulseArray.size() <= 0) {
+        const Vector3 w_before = -rayBuffer[j].direction();
+        const MaterialSample& material = materialBuffer[j];
+        MaterialSample::Impulse impulseArray[MaterialSample::MAX_IMPULSES];
+        const int impulseCount = material.getImpulses(hitBuffer.shadingNormal[j], w_before, impulseArray);
+
+        // If no impulses, cast no further rays. L_i already added this hit's light once.
+        if (impulseCount <= 0) {
+            modulationBuffer[i] = Radiance3::black();
             return;
         };
 
@@ -297,35 +916,52 @@ void PathTracer::generateRecursiveRay(const Array<shared_ptr<Surfel>>& surfelBuf
         // first ray will always go one way and the second will always go the other way, etc. However, this
         // guarantees that if you have 2^numBounces rays then you will explore all paths as done in Whitted
         // ray-tracing. Ultimately this approach looked good and was fast enough.
-        int a = (r / (d + 1)) % impulseArray.size();
-
-        float prob = 1.0f / impulseArray.size(); // probability of scattering this direction
+        int a = (r / (d + 1)) % impulseCount;
+        float prob = 1.0f / impulseCount; // probability of scattering this direction
+
+        // Pixels that can stop after any number of samples would see that schedule cut short, favoring the first
+        // impulses. They choose at random in proportion to the impulses' magnitudes instead, as tracePhotons does.
+        if (m_options.adaptiveSampling || (m_options.pixelRayBudget.size() == m_width * m_height)) {
+            float total = 0.0f;
+            for (int b = 0; b < impulseCount; ++b) {
+                total += impulseArray[b].magnitude.average();
+            }
+            if (total <= 0.0f) {
+                modulationBuffer[i] = Radiance3::black();
+                return;
+            }
+            float u = Random::threadCommon().uniform() * total;
+            a = impulseCount - 1;
+            for (int b = 0; b < impulseCount - 1; ++b) {
+                u -= impulseArray[b].magnitude.average();
+                if (u < 0.0f) {
+                    a = b;
+                    break;
+                }
+            }
+            prob = impulseArray[a].magnitude.average() / total;
+            if (prob <= 0.0f) {
+                modulationBuffer[i] = Radiance3::black();
+                return;
+            }
+        }
         w_after = impulseArray[a].direction;
 
-        const shared_ptr<Surfel>& surf = surfelBuffer[i];
-
-        // Check if we hit foam
-        if (surf->kappaPos == foamParticleTag) {
-            //kappaNeg.b doesn't actually store what you think it stores. it stores the diffuse particle radius size
-            const Point3& origin = surf->position + -(surf->geometricNormal * surf->kappaNeg.b * 1.01);
-            //if we hit a diffuse particle, in order to get the color behind the diffuse particle, we need to cast another ray from behind the particle in the same direction
-            rayBuffer[i] = Ray::fromOriginAndDirection(origin, rayBuffer[i].direction());
-            return;
-        }
+        const Vector3& geometricNormal = hitBuffer.geometricNormal[j];
 
         // Check if we're in the liquid
-        float k = sign(w_after.dot(surf->geometricNormal));
+        float k = sign(w_after.dot(geometricNormal));
         if (k <= 0) {
             //we're refracting
-            inMediumBuffer[i] = surf->kappaNeg != Color3::black();
+            inMediumBuffer[i] = material.kappaNeg != Color3::black();
         } else {
             //we're reflecting
-            inMediumBuffer[i] = surf->kappaPos != Color3::black();
+            inMediumBuffer[i] = material.kappaPos != Color3::black();
         }
 
         modulationBuffer[i] *= impulseArray[a].magnitude / prob;
-        const Point3& origin = surf->position + surf->geometricNormal * .01f * k;
+        const Point3& origin = hitBuffer.position[j] + geometricNormal * .01f * k;
         //bumped ray origin
-        rayBuffer[i] = Ray::fromOriginAndDirection(origin, w_after);
+        rayBuffer[j] = Ray::fromOriginAndDirection(origin, w_after);
     });
 }
@@ -6,15 +6,19 @@ Change Log:
 
 #pragma once
 #include <G3D/G3DAll.h>
+#include "Foam.h"
+#include "ParticleSurface.h"
+#include "HitBuffer.h"
+#include "SceneTree.h"
+#include "CausticAtlas.h"
+#include "PhotonMap.h"
+#include "LightSampler.h"
+#include "Denoiser.h"
+#include "WorkQueue.h"
+#include <atomic>
 
 enum Resolution {pixel, verysmall, small, medium, large, vLarge};
 
-/* All foam particles will have their kappaPos set to foamParticleTag.
- * This is simply a way of flagging the particles so that we can do appropriate shading
- * on them. 
- */
-static Color3 foamParticleTag(0.314f, 0.159f, 0.265f);
-
 /** Performs the path-tracing algorithm. **/
 class PathTracer {
 private:
@@ -36,74 +40,314 @@ public:
         String name = "beautifulWaves";
         bool save;
 
-        int raysPerPixel = 32; // in general the raysPerPixel should be 2^(maxRayDepth + 1)
+        int raysPerPixel = 32; // the most per pixel. without adaptive sampling the raysPerPixel should be 2^(maxRayDepth + 1)
         int maxRayDepth = 5; // must be >=3 to pass through the water fully
         bool lowerCameraSensitivity = true;
+
+        /**
+         * Stop sampling a pixel once the standard error of its mean luminance is below noiseThreshold of the mean,
+         * after at least minRaysPerPixel. Sky and opaque surfaces converge quickly, leaving the rays for water and foam.
+         * Reflection and refraction are then chosen at random by magnitude rather than in a fixed alternation.
+         */
+        bool adaptiveSampling = true;
+        int minRaysPerPixel = 8;
+        float noiseThreshold = 0.02f;
+
+        /**
+         * The most rays for each pixel, row-major over the image, below raysPerPixel. Empty means raysPerPixel
+         * everywhere. TemporalAccumulator fills it to spend fewer rays where the last frame can be reused.
+         */
+        Array<int> pixelRayBudget;
+
+        /**
+         * From the second bounce on, end paths whose modulation is below rouletteThreshold at random, and weight the
+         * survivors up so that the image keeps the same expected value.
+         */
+        bool russianRoulette = true;
+        float rouletteThreshold = 0.1f;
+
+        /** Intersect rays with the particle field directly instead of the water mesh. Requires a ParticleSurface. */
+        bool traceParticles = false;
+
+        /** What traces rays against the scene's triangles. WIDE_BVH builds a WideBVH beside each TriTree. */
+        SceneTree::Backend intersectionBackend = SceneTree::TRI_TREE;
+
+        /** Simulation time of the image, which picks the frame of the caustic animation. */
+        SimTime time = 0;
+
+        /**
+         * Photons shot from the lights through the water before each image, which light the caustics under it. The
+         * water then casts shadows, so that the light it lets through is only counted once, as photons.
+         * 0 projects the animated caustic texture instead.
+         */
+        int causticPhotons = 200000;
+
+        /** Radius in meters within which photons light a point. Larger is smoother but blurs the caustics. */
+        float photonRadius = 0.05f;
+
+        /**
+         * Side of the square tiles that are traced independently, one per core, in pixels. A tile's buffers stay in cache
+         * through all of its bounces and samples. 0 traces the whole image as one wavefront, with every stage on all cores.
+         */
+        int tileSize = 0;
+
+        /**
+         * Called once a tile's pixels are final in framebuffer(), with the tile and how many of the tiles are done.
+         * Called from the thread that traced the tile. Optional.
+         */
+        std::function<void(const Rect2D& tile, int tilesDone, int tileCount)> onTileDone;
+
+        /**
+         * Write framebuffer() to the image at the end of pathTrace. Turn off to filter framebuffer() first, as with the
+         * TemporalAccumulator and Denoiser, and then call resolveImage, so that the image is written only once.
+         */
+        bool writeImage = true;
+    };
+
+    /** What the last pathTrace cost. */
+    class Stats {
+    public:
+        /** Camera rays traced, over all pixels. */
+        int64 samples = 0;
+
+        int pixels = 0;
+
+        /** Pixels that met Options::noiseThreshold before Options::raysPerPixel. */
+        int convergedPixels = 0;
+
+        /** Wall-clock time to bring every pixel to the noise threshold or to raysPerPixel, in seconds. */
+        RealTime renderTime = 0;
+
+        /** Photons shot, and how many of them landed on a diffuse surface through the water and were stored. */
+        int photonsEmitted = 0;
+        int photonsStored = 0;
+
+        /** Seconds to trace the photons and to build their kd-tree, before the image is traced. */
+        RealTime photonTraceTime = 0;
+        RealTime photonBuildTime = 0;
+
+        /** Seconds spent gathering photons at hits, summed over the threads that gathered. */
+        RealTime photonGatherTime = 0;
+
+        float samplesPerPixel() const {
+            return (pixels > 0) ? float(double(samples) / double(pixels)) : 0.0f;
+        }
+    };
+
+    /** A rectangle of the image traced as one wavefront. Its paths are numbered in row-major order, one per pixel. */
+    class Tile {
+    public:
+        Point2int32 origin;
+        int width = 0;
+        int height = 0;
+
+        int size() const {
+            return width * height;
+        }
+
+        Point2int32 pixel(int path) const {
+            return Point2int32(origin.x + path % width, origin.y + path / width);
+        }
     };
 
-    /** Sets the scene and intializes key member variables and data structures. **/
+    /**
+     * Sets the scene and intializes key member variables and data structures. Pass the same trees to every PathTracer
+     * of a video so that the static geometry is only built once; without them the tracer builds its own.
+     **/
     PathTracer::PathTracer
        (const shared_ptr<G3D::Scene>& s, 
         const shared_ptr<Camera>& c, 
         const shared_ptr<Image>& i,
         const Options& o,
-        const shared_ptr<Image>& m);
+        const shared_ptr<CausticAtlas>& caustics,
+        const Array<FoamInstance>& foam = Array<FoamInstance>(),
+        ParticleSurface* water = nullptr,
+        const shared_ptr<SceneTree>& trees = nullptr);
 
-    /** Starts the path-tracing. **/
+    /**
+     * Starts the path-tracing. Returns early, with the tiles that were not finished left black, if cancel() is called.
+     * Only reads what the constructor gathered on the CPU, so it may run on a thread without the GL context.
+     **/
     void pathTrace();
 
-   /** Computes the Radiance3 of the light coming in along the ray specified in the parameters. Depth is used in indirect lighting to set our branch factor*/
+    /** Stops pathTrace after the samples and tiles in flight. Safe to call from any thread. */
+    void cancel() {
+        m_cancelled = true;
+    }
+
+    bool cancelled() const {
+        return m_cancelled;
+    }
+
+    const Stats& stats() const {
+        return m_stats;
+    }
+
+    /** Rays traced at each pixel by the last pathTrace, as a fraction of Options::raysPerPixel in gray. */
+    shared_ptr<Image> samplesPerPixelImage() const;
+
+    /** Rays traced at each pixel by the last pathTrace, row-major. */
+    const Array<int>& samplesPerPixel() const {
+        return m_samplesPerPixel;
+    }
+
+    /**
+     * Mean radiance of each pixel traced so far, row-major, before the camera sensitivity is applied. A tile's pixels
+     * may be read from any thread once Options::onTileDone has been called for it.
+     */
+    const Array<Radiance3>& framebuffer() const {
+        return m_framebuffer;
+    }
+
+    Array<Radiance3>& framebuffer() {
+        return m_framebuffer;
+    }
+
+    /** Copies framebuffer() to the image, scaled by sensitivityScale(). pathTrace does this unless Options::writeImage is off. */
+    void resolveImage();
+
+    /** Factor from framebuffer() to the image, which halves it when Options::lowerCameraSensitivity is set. */
+    float sensitivityScale() const {
+        return m_options.lowerCameraSensitivity ? 1.0f / (float) 2 : 1.0f;
+    }
+
+    /** What the first camera ray of each pixel hit in the last pathTrace, for the Denoiser. */
+    const DenoiseBuffers& denoiseBuffers() const {
+        return m_denoiseBuffers;
+    }
+
+    /** Fraction of the tiles that are done. Safe to call from any thread. */
+    float progress() const {
+        return (m_tileCount > 0) ? float(m_tilesDone) / float(m_tileCount) : 0.0f;
+    }
+
+    /** Traces the samples of every pixel in the tile until each converges or reaches raysPerPixel, then writes the tile to the image. */
+    void traceTile
+       (const Tile&                                             tile);
+
+    /** Shoots Options::causticPhotons photons from the lights at the water and stores those that reach a diffuse surface through it in m_photonMap. */
+    void tracePhotons();
+
+    /*updates causticBuffer with the light that the photon map focuses on every diffuse hit*/
+    void gatherCaustics
+       (const HitBuffer&                                        hitBuffer,
+        const Array<MaterialSample>&                            materialBuffer,
+        Array<Radiance3>&                                       causticBuffer);
+
+    /*records what each path's camera ray hit in m_denoiseBuffers*/
+    void captureDenoiseBuffers
+       (const Tile&                                             tile,
+        const Array<int>&                                       pathBuffer,
+        const Array<Ray>&                                       rayBuffer,
+        const HitBuffer&                                        hitBuffer,
+        const Array<MaterialSample>&                            materialBuffer);
+
+    /** Runs callback(i) for i in [0, count) on all cores, or on this thread when tiles are traced concurrently. */
+    void runOverPaths
+       (int                                                     count,
+        const std::function<void(int)>&                         callback) const;
+
+   /**
+    * Computes the Radiance3 of the light coming in along the ray specified in the parameters. Depth is used in indirect lighting to set our branch factor.
+    */
     void L_i
-       (Array<Radiance3>&                                       modulationBuffer, 
-        const  Array<shared_ptr<Surfel>>&                       surfelBuffer,  
+       (const Array<int>&                                       pathBuffer,
+        Array<Radiance3>&                                       radianceBuffer,
+        Array<Radiance3>&                                       modulationBuffer, 
+        const HitBuffer&                                        hitBuffer,  
+        const Array<MaterialSample>&                            materialBuffer,
         const Array<Ray>&                                       rayBuffer, 
         const Array<Biradiance3>&                               biradianceBuffer,  
         Array<bool>&                                            lightShadowedBuffer,
         Array<Ray>&                                             shadowRayBuffer,
         const Array<Point3>&                                    extinctionPointBuffer,
-        Array<bool>&                                            inMediumBuffer) const;
+        Array<bool>&                                            inMediumBuffer,
+        const Array<Radiance3>&                                 causticBuffer) const;
 
     /*Color gradient for background*/
     Radiance3 backgroundRadiance
        (const Ray&                                             ray) const;
 
-    /*updates rayBuffer for every ray*/
+    /*starts a path at every active pixel of the tile, updating rayBuffer and pathBuffer*/
     void generateRayBuffer
-       (Array<Ray>&                                             rayBuffer) const;
+       (const Tile&                                             tile,
+        const Array<int>&                                       activePixelBuffer,
+        Array<Ray>&                                             rayBuffer,
+        Array<int>&                                             pathBuffer) const;
 
-    /*updates surfelBuffer for every ray*/
+    /*updates hitBuffer for every ray with the closest of its hits in each level of m_trees, whose raw TriTree hits go in triHitBuffers. Foam and the particle surface replace triangle hits that they are in front of. coherent is only for camera rays*/
     void findIntersection
        (const Array<Ray>&                                       rayBuffer,  
-        Array<shared_ptr<Surfel>>&                              surfelBuffer) const;
+        Array<TriTree::Hit>                                     triHitBuffers[SceneTree::LEVEL_COUNT],
+        HitBuffer&                                              hitBuffer,
+        bool                                                    coherent) const;
 
-    /*updates biradienceBuffer as well as shadowRayBuffer*/
+    /*evaluates the material of every hit into materialBuffer, flipped for back faces. Textures are only sampled for materials that have them*/
+    void sampleMaterials
+       (const HitBuffer&                                        hitBuffer,
+        Array<MaterialSample>&                                  materialBuffer) const;
+
+    /*picks one light for each hit by power and updates biradienceBuffer, divided by the light's probability, as well as shadowRayBuffer*/
     void chooseLight
-       (const Array<shared_ptr<Surfel>>&                        surfelBuffer, 
+       (const HitBuffer&                                        hitBuffer, 
         Array<Radiance3>&                                       biradianceBuffer,  
         Array<Ray>&                                             shadowRayBuffer) const;
 
-    /*updates lightShadowedBuffer*/
+    /*updates lightShadowedBuffer. transmissive surfaces only shadow when there are caustic photons*/
     //expects shadow rays to be bumped
     void testVisibilty
        (const Array<Ray>&                                       shadowRayBuffer,  
         Array<bool>&                                            lightShadowedBuffer) const;
 
-    /*uses surfelBuffer to generate new rayBuffer*/
+    /*uses hitBuffer and materialBuffer to generate new rayBuffer. paths that end give their modulation black, so that compactPaths drops them*/
     void generateRecursiveRay
-       (const  Array<shared_ptr<Surfel>>&                       surfelBuffer,  
+       (const Array<int>&                                       pathBuffer,
+        const HitBuffer&                                        hitBuffer,  
+        const Array<MaterialSample>&                            materialBuffer,
         Array<Ray>&                                             rayBuffer,  
+        Array<Radiance3>&                                       radianceBuffer,
         Array<Radiance3>&                                       modulationBuffer,
         const int                                               r,
         const int                                               d,
         Array<Point3>&                                          extinctionPointBuffer,
         Array<bool>&                                            inMediumBuffer) const;
 
-    /** sets or resets the modulation buffer to hold 1 / raysPerPixel. Used to average the returned colors from all of the ray casts from a single pixel*/
+    /**
+     * Drops the paths whose modulation has gone to black from pathBuffer and rayBuffer, keeping the rest in order, and
+     * returns how many are left. A parallel stream compaction: blocks of paths are counted and then scattered to their
+     * prefix-summed offsets concurrently. nextPathBuffer and nextRayBuffer are scratch that is swapped with the buffers.
+     */
+    int compactPaths
+       (const Array<Radiance3>&                                 modulationBuffer,
+        Array<int>&                                             pathBuffer,
+        Array<Ray>&                                             rayBuffer,
+        Array<int>&                                             nextPathBuffer,
+        Array<Ray>&                                             nextRayBuffer) const;
+
+    /** sets or resets the modulation buffer to hold 1 and the radiance of this sample to black */
     void  initializeModulationBuffer
-       (Array<Radiance3>&                                       modulationBuffer) const ;
+       (Array<Radiance3>&                                       modulationBuffer,
+        Array<Radiance3>&                                       radianceBuffer) const ;
+
+    /**
+     * Folds sample number r of each active pixel into its running mean and luminance variance (Welford's method), and
+     * drops the pixels that have converged or used up their Options::pixelRayBudget from activePixelBuffer. Returns
+     * how many were dropped because they passed the noise test.
+     */
+    int accumulateSample
+       (const Tile&                                             tile,
+        int                                                     r,
+        const Array<Radiance3>&                                 radianceBuffer,
+        Array<Radiance3>&                                       meanBuffer,
+        Array<float>&                                           varianceBuffer,
+        Array<int>&                                             sampleCountBuffer,
+        Array<int>&                                             activePixelBuffer) const;
 
-    /** effectively lowers the camera sensitivity by dividing each pixel's color value in half */
-    void lowerCameraSensitivity() const;
+    /** Writes the mean of each pixel's samples to m_framebuffer */
+    void writeTile
+       (const Tile&                                             tile,
+        const Array<Radiance3>&                                 meanBuffer,
+        const Array<int>&                                       sampleCountBuffer);
 
     // member variables
     Options m_options;
@@ -111,11 +355,54 @@ public:
     shared_ptr<Scene> m_scene;
     shared_ptr<Camera> m_camera;
     shared_ptr<Image> m_image;
-    shared_ptr<Image> m_causticMap;
+    shared_ptr<CausticAtlas> m_caustics;
+
+    /** The frame of m_caustics at Options::time. */
+    int m_causticFrame = 0;
     Array<shared_ptr<Light>> m_lightArray;
-    TriTree m_tritree;
-    TriTree m_rigidTriTree;
+
+    /** Alias table over m_lightArray, which chooseLight samples. */
+    LightSampler m_lightSampler;
+
+    /** The triangles and their materials. Hits refer to the materials by index. */
+    shared_ptr<SceneTree> m_trees;
+    FoamTree m_foamTree;
+
+    /** Caustic photons for the image being traced. Empty when Options::causticPhotons is 0 or there is no water. */
+    PhotonMap m_photonMap;
+
+    /** The water surface when options.traceParticles is set, in place of the water mesh. Otherwise null. */
+    ParticleSurface* m_water;
+
+    /** Index into the materials of m_trees of the particle surface's material. */
+    int m_waterMaterial = -1;
+
     int m_width; 
     int m_height;
-    int m_rigidTriTreeSize;
+
+    Stats m_stats;
+
+    /** Guards m_stats while tiles are traced concurrently. */
+    std::mutex m_statsMutex;
+
+    /** Whether tiles are being traced concurrently, so that each stage must stay on its tile's thread. */
+    bool m_tilesConcurrent = false;
+
+    /** Rays traced at each pixel by the last pathTrace. */
+    Array<int> m_samplesPerPixel;
+
+    DenoiseBuffers m_denoiseBuffers;
+
+    /**
+     * Mean radiance of each pixel, row-major, as plain floats. Tiles write here and m_image is only written once, by
+     * resolveImage, so that no stage goes through Image's format-generic accessors per sample.
+     */
+    Array<Radiance3> m_framebuffer;
+
+    std::atomic<bool> m_cancelled;
+    std::atomic<int> m_tilesDone;
+    std::atomic<int> m_tileCount;
+
+    /** Pixels that passed the noise test, over the tiles done. */
+    std::atomic<int> m_convergedPixels;
 };
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "PhotonMap.h"
+
+void PhotonMap::clear() {
+    m_positions.fastClear();
+    m_directions.fastClear();
+    m_power.fastClear();
+    m_axis.fastClear();
+}
+
+void PhotonMap::setContents(const Array<Photon>& photons) {
+    Stopwatch clock;
+    clock.tick();
+
+    const int n = photons.size();
+    Array<Point3> positions;
+    Array<int> order;
+    positions.resize(n);
+    order.resize(n);
+    for (int p = 0; p < n; ++p) {
+        positions[p] = photons[p].position;
+        order[p] = p;
+    }
+    m_axis.resize(n);
+
+    // Split the top of the tree on this thread, then build the subtrees below it concurrently
+    Array<Task> tasks;
+    build(order, positions, 0, n, &tasks);
+    Thread::runConcurrently(0, tasks.size(), [&](int t) {
+        build(order, positions, tasks[t].first, tasks[t].count, nullptr);
+    });
+
+    m_positions.resize(n);
+    m_directions.resize(n);
+    m_power.resize(n);
+    Thread::runConcurrently(0, n, [&](int i) {
+        const Photon& photon = photons[order[i]];
+        m_positions[i] = photon.position;
+        m_directions[i] = photon.direction;
+        m_power[i] = photon.power;
+    });
+
+    clock.tock();
+    m_buildTime = clock.elapsedTime();
+}
+
+void PhotonMap::build(Array<int>& order, const Array<Point3>& positions, int first, int count, Array<Task>* tasks) {
+    if (count <= 0) {
+        return;
+    }
+    if (notNull(tasks) && (count < SERIAL_BUILD_SIZE)) {
+        tasks->append(Task{ first, count });
+        return;
+    }
+
+    // Split at the median along the widest axis
+    AABox bounds(positions[order[first]]);
+    for (int i = first + 1; i < first + count; ++i) {
+        bounds.merge(positions[order[i]]);
+    }
+    const Vector3& extent = bounds.extent();
+    const int axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+
+    const int middle = first + count / 2;
+    int* begin = order.getCArray();
+    std::nth_element(begin + first, begin + middle, begin + first + count, [&](int a, int b) {
+        return positions[a][axis] < positions[b][axis];
+    });
+    m_axis[middle] = uint8(axis);
+
+    build(order, positions, first, middle - first, tasks);
+    build(order, positions, middle + 1, first + count - middle - 1, tasks);
+}
+
+Biradiance3 PhotonMap::irradiance(const Point3& position, const Vector3& normal, float radius) const {
+    const float radius2 = square(radius);
+    Power3 sum = Power3::black();
+
+    // Ranges still to visit. The tree is balanced, so its depth is at most 32.
+    int stackFirst[64];
+    int stackCount[64];
+    int top = 0;
+    stackFirst[top] = 0;
+    stackCount[top] = m_positions.size();
+    ++top;
+    while (top > 0) {
+        --top;
+        const int first = stackFirst[top];
+        const int count = stackCount[top];
+        if (count <= 0) {
+            continue;
+        }
+
+        const int middle = first + count / 2;
+        const Point3& p = m_positions[middle];
+        const float distance2 = (p - position).squaredLength();
+        if ((distance2 < radius2) && (m_directions[middle].dot(normal) < 0.0f)) {
+            // Cone filter with k = 1
+            sum += m_power[middle] * (1.0f - sqrt(distance2 / radius2));
+        }
+
+        // Visit the side of the split that position is on, and the other side only if the disk crosses the split
+        const int axis = m_axis[middle];
+        const float offset = position[axis] - p[axis];
+        const int nearFirst = (offset < 0.0f) ? first : middle + 1;
+        const int nearCount = (offset < 0.0f) ? middle - first : first + count - middle - 1;
+        const int farFirst = (offset < 0.0f) ? middle + 1 : first;
+        const int farCount = (offset < 0.0f) ? first + count - middle - 1 : middle - first;
+        if (square(offset) < radius2) {
+            stackFirst[top] = farFirst;
+            stackCount[top] = farCount;
+            ++top;
+        }
+        stackFirst[top] = nearFirst;
+        stackCount[top] = nearCount;
+        ++top;
+    }
+
+    // The cone filter's weights integrate to a third of the disk's area
+    return sum / ((pif() / 3.0f) * radius2);
+}
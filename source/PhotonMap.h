@@ -0,0 +1,70 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/** Light that reached a diffuse surface through the water, as stored by the path tracer's photon pass. */
+class Photon {
+public:
+    Point3 position;
+
+    /** Direction the photon was travelling when it landed. */
+    Vector3 direction;
+
+    Power3 power;
+};
+
+/**
+ * A kd-tree over photons for gathering caustics, built in parallel.
+ *
+ * The tree is implicit: the node of a range of the arrays is the photon at its middle, split on the axis stored for it,
+ * with the two halves of the range as its children. There are no pointers, and positions, which every step of a gather
+ * reads, are kept apart from the power and direction of the photons, which only those that are gathered need.
+ */
+class PhotonMap {
+protected:
+    /** Ranges with fewer photons than this are built on a single thread. */
+    static const int SERIAL_BUILD_SIZE = 4096;
+
+    /** A range whose build was deferred so that it can run on another thread. */
+    class Task {
+    public:
+        int first;
+        int count;
+    };
+
+    /** In tree order. */
+    Array<Point3> m_positions;
+    Array<Vector3> m_directions;
+    Array<Power3> m_power;
+
+    /** Split axis of the node at each index. */
+    Array<uint8> m_axis;
+
+    RealTime m_buildTime = 0;
+
+    /**
+     * Orders order[first, first + count) into a subtree over positions. Ranges below SERIAL_BUILD_SIZE are appended to
+     * tasks instead when tasks is not null.
+     */
+    void build(Array<int>& order, const Array<Point3>& positions, int first, int count, Array<Task>* tasks);
+
+public:
+
+    void setContents(const Array<Photon>& photons);
+
+    void clear();
+
+    int size() const {
+        return m_positions.size();
+    }
+
+    /** Seconds the last setContents took. */
+    RealTime buildTime() const {
+        return m_buildTime;
+    }
+
+    /**
+     * Irradiance at position on a surface facing normal, estimated from the photons within radius that arrived at its
+     * front. Uses a cone filter, so that the edges of caustics do not show the disk.
+     */
+    Biradiance3 irradiance(const Point3& position, const Vector3& normal, float radius) const;
+};
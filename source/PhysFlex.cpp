@@ -689,6 +689,7 @@ void Flex::Init(){
 	g_anisotropy1.resize(maxParticles);
 	g_anisotropy2.resize(maxParticles);
 	g_anisotropy3.resize(maxParticles);
+	g_smoothPositions.resize(maxParticles);
 
 
 	if (g_shapePositions.size()) {
@@ -809,6 +810,10 @@ void Flex::flexStep(){
 	flexGetVelocities(g_flex, &g_velocities[0].x, g_velocities.size(), eFlexMemoryHost);
 	flexGetNormals(g_flex, &g_normals[0].x, g_normals.size(), eFlexMemoryHost);
 	g_diffuseActive = flexGetDiffuseParticles(g_flex, &g_diffusePositions.data()->x, &g_diffuseVelocities.data()->x, g_diffuseIndicies.data() ,eFlexMemoryHost);
+	if (g_readAnisotropy) {
+		flexGetSmoothParticles(g_flex, &g_smoothPositions[0].x, g_waterActive, eFlexMemoryHost);
+		flexGetAnisotropy(g_flex, &g_anisotropy1[0].x, &g_anisotropy2[0].x, &g_anisotropy3[0].x, eFlexMemoryHost);
+	}
     flexSetFence();
     flexWaitFence();
 
@@ -822,6 +827,26 @@ Array<Vector3> Flex::getWaterPositions(){
 	return points;
 }
 
+Array<Vector3> Flex::getSmoothWaterPositions(){
+	Array<Vector3> points;
+	points.resize(g_waterActive);
+	for( int i = 0; i < g_waterActive;++i){
+		points[i] = g_smoothPositions[i].xyz();
+	}
+	return points;
+}
+
+void Flex::getWaterAnisotropy(Array<Vector4>& q1, Array<Vector4>& q2, Array<Vector4>& q3){
+	q1.resize(g_waterActive);
+	q2.resize(g_waterActive);
+	q3.resize(g_waterActive);
+	for( int i = 0; i < g_waterActive;++i){
+		q1[i] = g_anisotropy1[i];
+		q2[i] = g_anisotropy2[i];
+		q3[i] = g_anisotropy3[i];
+	}
+}
+
 //for future look into doing memcopies wtih gpu memory to use cuda stuff for these arrays
 Array<Vector4> Flex::getDiffusePositions(){
 	Array<Vector4> points;
@@ -73,6 +73,10 @@ public:
 	std::vector<Vector4> g_anisotropy1;
 	std::vector<Vector4> g_anisotropy2;
 	std::vector<Vector4> g_anisotropy3;
+	std::vector<Vector4> g_smoothPositions;
+
+    /** Whether flexStep reads back the smoothed positions and anisotropy for the water surface. Off unless the mesher needs them, since the readback is not free. */
+	bool g_readAnisotropy = false;
 	std::vector<Vector4> g_normals;
 	std::vector<Vector4> g_diffusePositions;
 	std::vector<Vector4> g_diffuseVelocities;
@@ -129,6 +133,12 @@ public:
     /** Returns water particle positions. To be read back and rendered. */
 	Array<Vector3> Flex::getWaterPositions();
 
+    /** Returns the Laplacian-smoothed water particle positions. Only valid when g_readAnisotropy was set for the last step. */
+	Array<Vector3> Flex::getSmoothWaterPositions();
+
+    /** Returns the principal axes (xyz) and radii (w) of each water particle's anisotropy ellipsoid. Only valid when g_readAnisotropy was set for the last step. */
+	void Flex::getWaterAnisotropy(Array<Vector4>& q1, Array<Vector4>& q2, Array<Vector4>& q3);
+
     /** Returns diffuse particle positions. To be read back and rendered. */
 	Array<Vector4> Flex::getDiffusePositions();
 
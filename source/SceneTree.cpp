@@ -0,0 +1,191 @@
+#include "SceneTree.h"
+
+void SceneTree::update(const shared_ptr<Scene>& scene, const Array<String>& excluded, Backend backend) {
+    Array<shared_ptr<Entity>> entities;
+    scene->getTypedEntityArray<Entity>(entities);
+
+    Array<shared_ptr<Entity>> staticEntities;
+    Array<shared_ptr<Entity>> dynamicEntities;
+    for (const shared_ptr<Entity>& entity : entities) {
+        if (excluded.contains(entity->name())) {
+            continue;
+        }
+        if (entity->canChange()) {
+            dynamicEntities.append(entity);
+        } else {
+            staticEntities.append(entity);
+        }
+    }
+
+    // Static entities never move, so the level only goes stale when they are added or removed
+    m_staticCached = (m_staticEntities.size() > 0) && (staticEntities.size() == m_staticEntities.size());
+    for (int e = 0; m_staticCached && (e < staticEntities.size()); ++e) {
+        m_staticCached = (staticEntities[e] == m_staticEntities[e]);
+    }
+    if (! m_staticCached) {
+        m_materials.fastClear();
+        m_texturedMaterials.fastClear();
+        m_materialIndex.clear();
+
+        Array<shared_ptr<Surface>> surfaces;
+        for (const shared_ptr<Entity>& entity : staticEntities) {
+            entity->onPose(surfaces);
+        }
+        buildLevel(m_levels[STATIC], surfaces, backend);
+
+        m_staticEntities = staticEntities;
+        m_staticMaterialIndex = m_materialIndex;
+        m_staticMaterialCount = m_materials.size();
+    } else {
+        Stopwatch clock;
+        clock.tick();
+        setBackend(m_levels[STATIC], backend);
+        clock.tock();
+        m_levels[STATIC].buildTime = clock.elapsedTime();
+    }
+
+    // The dynamic level's materials may have been freed and their addresses reused, so they are looked up from scratch
+    m_materials.resize(m_staticMaterialCount);
+    m_texturedMaterials.resize(m_staticMaterialCount);
+    m_materialIndex = m_staticMaterialIndex;
+
+    Array<shared_ptr<Surface>> surfaces;
+    for (const shared_ptr<Entity>& entity : dynamicEntities) {
+        entity->onPose(surfaces);
+    }
+    buildLevel(m_levels[DYNAMIC], surfaces, backend);
+
+    debugPrintf("Scene trees (%s): static level %d tris in %.3f s%s, dynamic level %d tris in %.3f s\n",
+        (backend == WIDE_BVH) ? "WideBVH" : "TriTree",
+        m_levels[STATIC].tris.size(), m_levels[STATIC].buildTime, m_staticCached ? " (cached)" : "",
+        m_levels[DYNAMIC].tris.size(), m_levels[DYNAMIC].buildTime);
+}
+
+void SceneTree::buildLevel(Level& level, const Array<shared_ptr<Surface>>& surfaces, Backend backend) {
+    Stopwatch clock;
+    clock.tick();
+
+    level.tris.setContents(surfaces);
+
+    // A separate TriTree with only solid surfaces for shadow-casting
+    Array<shared_ptr<Surface>> rigidSurfaces;
+    for (const shared_ptr<Surface>& surface : surfaces) {
+        if (! surface->hasTransmission()) {
+            rigidSurfaces.append(surface);
+        }
+    }
+    level.rigidTris.setContents(rigidSurfaces);
+
+    // The wide BVHs are copies of the TriTrees just built, so the old ones are stale
+    level.backend = TRI_TREE;
+    setBackend(level, backend);
+
+    level.triMaterial.resize(level.tris.size());
+
+    // Consecutive tris almost always come from the same surface, so remember the last lookup
+    const Material* previous = nullptr;
+    int previousIndex = -1;
+    for (int t = 0; t < level.tris.size(); ++t) {
+        const shared_ptr<Material>& material = level.tris[t].material();
+        if ((material.get() != previous) || (previousIndex < 0)) {
+            bool created = false;
+            int& index = m_materialIndex.getCreate(material.get(), created);
+            if (created) {
+                index = m_materials.size();
+                sampleMaterial(material, Point2(0, 0), m_materials.next());
+
+                const shared_ptr<UniversalMaterial>& universal = dynamic_pointer_cast<UniversalMaterial>(material);
+                const bool textured = notNull(universal) &&
+                    (notNull(universal->bsdf()->lambertian().texture()) || notNull(universal->bsdf()->glossy().texture()) ||
+                     notNull(universal->bsdf()->transmissive().texture()) || notNull(universal->emissive().texture()));
+                m_texturedMaterials.append(textured ? material : shared_ptr<Material>());
+            }
+            previous = material.get();
+            previousIndex = index;
+        }
+        level.triMaterial[t] = previousIndex;
+    }
+
+    clock.tock();
+    level.buildTime = clock.elapsedTime();
+}
+
+void SceneTree::setBackend(Level& level, Backend backend) {
+    if (backend == level.backend) {
+        return;
+    }
+    if (backend == WIDE_BVH) {
+        level.wideTris.setContents(level.tris);
+        level.wideRigidTris.setContents(level.rigidTris);
+    } else {
+        level.wideTris.clear();
+        level.wideRigidTris.clear();
+    }
+    level.backend = backend;
+}
+
+void SceneTree::Level::intersectRays(const Array<Ray>& rays, Array<TriTree::Hit>& hits, bool coherent, bool singleThread) const {
+    if (backend == WIDE_BVH) {
+        wideTris.intersectRays(rays, hits, coherent, singleThread);
+        return;
+    }
+
+    const TriTree::IntersectRayOptions options = coherent ? TriTree::COHERENT_RAY_HINT : 0;
+    if (singleThread || (tris.size() == 0)) {
+        // TriTree::intersectRays always runs on all cores
+        for (int i = 0; i < rays.size(); ++i) {
+            hits[i] = TriTree::Hit();
+            if (tris.size() > 0) {
+                tris.intersectRay(rays[i], hits[i], options);
+            }
+        }
+    } else {
+        tris.intersectRays(rays, hits, options);
+    }
+}
+
+void SceneTree::Level::intersectRays(const Array<Ray>& rays, Array<bool>& occluded, bool transmissiveOccludes, bool singleThread) const {
+    if (backend == WIDE_BVH) {
+        (transmissiveOccludes ? wideTris : wideRigidTris).intersectRays(rays, occluded, singleThread);
+        return;
+    }
+
+    // Shadow rays all leave from a light, so they are coherent
+    const TriTree& occluders = transmissiveOccludes ? tris : rigidTris;
+    const TriTree::IntersectRayOptions options = TriTree::OCCLUSION_TEST_ONLY | TriTree::DO_NOT_CULL_BACKFACES | TriTree::COHERENT_RAY_HINT;
+    if (singleThread || (occluders.size() == 0)) {
+        for (int i = 0; i < rays.size(); ++i) {
+            TriTree::Hit hit;
+            occluded[i] = (occluders.size() > 0) && occluders.intersectRay(rays[i], hit, options);
+        }
+    } else {
+        occluders.intersectRays(rays, occluded, options);
+    }
+}
+
+int SceneTree::addMaterial(const MaterialSample& material) {
+    m_materials.append(material);
+    m_texturedMaterials.append(shared_ptr<Material>());
+    return m_materials.size() - 1;
+}
+
+void SceneTree::sampleMaterial(const shared_ptr<Material>& material, const Point2& texCoord, MaterialSample& sample) {
+    sample = MaterialSample();
+    const shared_ptr<UniversalMaterial>& universal = dynamic_pointer_cast<UniversalMaterial>(material);
+    if (isNull(universal)) {
+        sample.lambertian = Color3(0.5f);
+        return;
+    }
+
+    const shared_ptr<UniversalBSDF>& bsdf = universal->bsdf();
+    const Color4& glossy = bsdf->glossy().sample(texCoord);
+    sample.lambertian = bsdf->lambertian().sample(texCoord).rgb();
+    sample.glossy = glossy.rgb();
+    sample.smoothness = glossy.a;
+    sample.transmissive = bsdf->transmissive().sample(texCoord);
+    sample.emissive = universal->emissive().sample(texCoord);
+    sample.etaPos = bsdf->etaReflect();
+    sample.etaNeg = bsdf->etaTransmit();
+    sample.kappaPos = bsdf->extinctionReflect();
+    sample.kappaNeg = bsdf->extinctionTransmit();
+}
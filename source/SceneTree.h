@@ -0,0 +1,121 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include "HitBuffer.h"
+#include "WideBVH.h"
+
+/**
+ * The scene's triangles for the path tracer, as two bottom-level trees and the materials they refer to.
+ *
+ * The STATIC level holds the entities that cannot change (the sink, the bunny, the lighthouse). It is built once and kept
+ * across frames for as long as the same static entities are in the scene. The DYNAMIC level holds everything else, which
+ * in practice is the water mesh, and is rebuilt on every update. The top level is only these two instances, so a ray's
+ * closest hit is simply the closer of its hits in each level; there is no tree over them to build.
+ *
+ * Each level can be traced with its TriTrees or with WideBVH copies of them, which are built from the TriTrees.
+ *
+ * Foam and the particle surface have their own structures (FoamTree, ParticleSurface) and are not included.
+ */
+class SceneTree {
+public:
+    enum LevelIndex { STATIC, DYNAMIC, LEVEL_COUNT };
+
+    /** What traces rays against a level. */
+    enum Backend { TRI_TREE, WIDE_BVH };
+
+    /** One bottom-level structure. */
+    class Level {
+    public:
+        /** Every triangle. */
+        TriTree tris;
+
+        /** Only the triangles of surfaces without transmission, which are the ones that cast shadows. */
+        TriTree rigidTris;
+
+        /** Index into SceneTree::materials() of each tri in tris. */
+        Array<int> triMaterial;
+
+        /** tris and rigidTris as wide BVHs. Only built for the WIDE_BVH backend. */
+        WideBVH wideTris;
+        WideBVH wideRigidTris;
+
+        Backend backend = TRI_TREE;
+
+        /** Time the last build of both trees and the material lookup took, in seconds. */
+        RealTime buildTime = 0;
+
+        /**
+         * The closest hit in tris of every ray, or no hit. Packets or TriTree's coherence hint are only used when
+         * coherent, which is for camera rays. On all cores unless singleThread.
+         */
+        void intersectRays(const Array<Ray>& rays, Array<TriTree::Hit>& hits, bool coherent, bool singleThread) const;
+
+        /**
+         * Whether rigidTris occludes each ray, from either side, or tris when transmissiveOccludes. On all cores unless
+         * singleThread.
+         */
+        void intersectRays(const Array<Ray>& rays, Array<bool>& occluded, bool transmissiveOccludes, bool singleThread) const;
+    };
+
+protected:
+    Level m_levels[LEVEL_COUNT];
+
+    /** Every distinct material in the scene, evaluated once. Those of the static level come first. */
+    Array<MaterialSample> m_materials;
+
+    /** The material each entry of m_materials came from, if it has textures and must be sampled at every hit. Otherwise null. */
+    Array<shared_ptr<Material>> m_texturedMaterials;
+
+    Table<const Material*, int> m_materialIndex;
+
+    /** m_materialIndex as it was after the static level was built. The dynamic level starts over from it. */
+    Table<const Material*, int> m_staticMaterialIndex;
+    int m_staticMaterialCount = 0;
+
+    /** The entities the static level was built from, to tell when it must be rebuilt. */
+    Array<shared_ptr<Entity>> m_staticEntities;
+
+    /** Whether the last update reused the static level. */
+    bool m_staticCached = false;
+
+    /** Builds a level's trees from surfaces and adds their materials to the table. */
+    void buildLevel(Level& level, const Array<shared_ptr<Surface>>& surfaces, Backend backend);
+
+    /** Builds the level's wide BVHs if backend needs them and they are not built, and frees them otherwise. */
+    static void setBackend(Level& level, Backend backend);
+
+public:
+
+    /**
+     * Poses the scene and brings both levels up to date. Entities named in excluded are left out, as are invisible ones.
+     * The static level is only rebuilt when the set of entities that cannot change is different from last time, though
+     * switching it to the WIDE_BVH backend builds its wide BVHs.
+     */
+    void update(const shared_ptr<Scene>& scene, const Array<String>& excluded, Backend backend = TRI_TREE);
+
+    /** Appends a material that no tri refers to, such as the particle surface's, until the next update. Returns its index. */
+    int addMaterial(const MaterialSample& material);
+
+    const Level& level(int index) const {
+        return m_levels[index];
+    }
+
+    const Array<MaterialSample>& materials() const {
+        return m_materials;
+    }
+
+    const Array<shared_ptr<Material>>& texturedMaterials() const {
+        return m_texturedMaterials;
+    }
+
+    /** Total number of triangles that cast shadows. */
+    int rigidSize() const {
+        return m_levels[STATIC].rigidTris.size() + m_levels[DYNAMIC].rigidTris.size();
+    }
+
+    bool staticCached() const {
+        return m_staticCached;
+    }
+
+    /** Evaluates a material at a texture coordinate. Materials other than UniversalMaterial are gray Lambertian. */
+    static void sampleMaterial(const shared_ptr<Material>& material, const Point2& texCoord, MaterialSample& sample);
+};
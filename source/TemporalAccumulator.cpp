@@ -0,0 +1,94 @@
+#include "TemporalAccumulator.h"
+#include <atomic>
+
+/** Distance that sky pixels are projected at, so that only the direction matters. */
+static const float SKY_DISTANCE = 1e4f;
+
+void TemporalAccumulator::clear() {
+    m_width = 0;
+    m_height = 0;
+    m_radiance.fastClear();
+    m_rays.fastClear();
+    m_position.fastClear();
+    m_normal.fastClear();
+    m_surface.fastClear();
+    m_reused.fastClear();
+    m_reuse = 0.0f;
+}
+
+int TemporalAccumulator::previousPixel(const Point3& point) const {
+    const Point3& cameraSpace = m_cameraFrame.pointToObjectSpace(point);
+    if (cameraSpace.z >= 0.0f) {
+        // Behind the camera
+        return -1;
+    }
+    const Vector3& projected = m_projection.project(cameraSpace, Rect2D::xywh(0.0f, 0.0f, float(m_width), float(m_height)));
+    const int x = iFloor(projected.x);
+    const int y = iFloor(projected.y);
+    return ((x >= 0) && (x < m_width) && (y >= 0) && (y < m_height)) ? x + y * m_width : -1;
+}
+
+void TemporalAccumulator::rayBudget(int raysPerPixel, const shared_ptr<Camera>& camera, Array<int>& budget) const {
+    budget.fastClear();
+    if ((m_width == 0) || (camera->frame() != m_cameraFrame)) {
+        return;
+    }
+    budget.resize(m_width * m_height);
+    Thread::runConcurrently(0, budget.size(), [&](int p) {
+        budget[p] = m_reused[p] ? min(m_options.historyRaysPerPixel, raysPerPixel) : raysPerPixel;
+    });
+}
+
+void TemporalAccumulator::accumulate(Array<Radiance3>& radiance, const DenoiseBuffers& buffers, const Array<int>& raysPerPixel, const shared_ptr<Camera>& camera) {
+    const int width = buffers.width;
+    const int height = buffers.height;
+    const bool haveHistory = (width == m_width) && (height == m_height);
+
+    Array<int> rays;
+    Array<bool> reused;
+    rays.resize(width * height);
+    reused.resize(width * height);
+    std::atomic<int> reusedCount(0);
+    Thread::runConcurrently(Point2int32(0, 0), Point2int32(width, height), [&](Point2int32 point) {
+        const int p = point.x + point.y * width;
+        rays[p] = raysPerPixel[p];
+        reused[p] = false;
+
+        const uint8 surface = buffers.surface[p];
+        if (! haveHistory || (surface == DenoiseBuffers::WATER) || (surface == DenoiseBuffers::FOAM)) {
+            return;
+        }
+
+        // The sky is matched by direction alone. Its normal faces back along the camera ray.
+        const bool sky = (surface == DenoiseBuffers::SKY);
+        const Point3& position = sky ? camera->frame().translation - buffers.normal[p] * SKY_DISTANCE : buffers.position[p];
+        const int q = previousPixel(position);
+        if ((q < 0) || (m_surface[q] != surface)) {
+            return;
+        }
+        if (! sky && (((m_position[q] - position).length() > m_options.positionTolerance * buffers.depth[p]) ||
+                      (m_normal[q].dot(buffers.normal[p]) < m_options.normalTolerance))) {
+            return;
+        }
+
+        const int history = min(m_rays[q], m_options.maxHistoryRays - rays[p]);
+        if (history > 0) {
+            radiance[p] = (radiance[p] * float(rays[p]) + m_radiance[q] * float(history)) / float(rays[p] + history);
+            rays[p] += history;
+        }
+        reused[p] = true;
+        ++reusedCount;
+    });
+
+    m_width = width;
+    m_height = height;
+    m_radiance = radiance;
+    Array<int>::swap(m_rays, rays);
+    Array<bool>::swap(m_reused, reused);
+    m_position = buffers.position;
+    m_normal = buffers.normal;
+    m_surface = buffers.surface;
+    m_cameraFrame = camera->frame();
+    m_projection = camera->projection();
+    m_reuse = float(reusedCount) / float(max(width * height, 1));
+}
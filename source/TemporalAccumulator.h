@@ -0,0 +1,86 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include "Denoiser.h"
+
+/**
+ * Carries path-traced radiance from one video frame to the next.
+ *
+ * Each pixel's first hit is projected into the previous frame's camera. When the previous frame saw the same kind of
+ * surface at that point, facing the same way, the pixel's radiance there is blended in, weighted by how many rays it
+ * took. Water and foam move and are never reused, and neither is anything that the new hit does not match, which is
+ * where geometry was disoccluded. With a still camera, the pixels that reused history last frame are expected to
+ * again, so rayBudget gives them only a few fresh rays and gives the rest of the image every ray.
+ */
+class TemporalAccumulator {
+public:
+    class Options {
+    public:
+        Options() {}
+
+        bool enabled = false;
+
+        /** Rays of history that a pixel keeps at most. Lower follows changing light, such as caustics, faster. */
+        int maxHistoryRays = 256;
+
+        /** How far the previous frame's hit may be from the new one, relative to its distance from the camera. */
+        float positionTolerance = 0.01f;
+
+        /** Least cosine between the previous frame's normal and the new one. */
+        float normalTolerance = 0.9f;
+
+        /** Rays for a pixel that is expected to reuse history. */
+        int historyRaysPerPixel = 2;
+    };
+
+protected:
+    Options m_options;
+
+    int m_width = 0;
+    int m_height = 0;
+
+    /** The previous frame's radiance, after blending, and how many rays went into it. */
+    Array<Radiance3> m_radiance;
+    Array<int> m_rays;
+
+    /** The previous frame's first hits. */
+    Array<Point3> m_position;
+    Array<Vector3> m_normal;
+    Array<uint8> m_surface;
+
+    /** Whether each pixel of the previous frame reused history. */
+    Array<bool> m_reused;
+
+    CFrame m_cameraFrame;
+    Projection m_projection;
+
+    /** Fraction of the pixels of the last frame that reused history. */
+    float m_reuse = 0.0f;
+
+    /** The previous frame's pixel under the point, or -1 if it is off screen. */
+    int previousPixel(const Point3& point) const;
+
+public:
+
+    Options& options() {
+        return m_options;
+    }
+
+    /** Forgets the history, such as when the scene changes. */
+    void clear();
+
+    /**
+     * Rays for each pixel of the next frame. Empty when the camera has moved or there is no history, which means
+     * raysPerPixel everywhere.
+     */
+    void rayBudget(int raysPerPixel, const shared_ptr<Camera>& camera, Array<int>& budget) const;
+
+    /**
+     * Blends the history into radiance, a path tracer's framebuffer(), and then makes the result the history. buffers
+     * and raysPerPixel are the same path tracer's, and camera is the one it traced from.
+     */
+    void accumulate(Array<Radiance3>& radiance, const DenoiseBuffers& buffers, const Array<int>& raysPerPixel, const shared_ptr<Camera>& camera);
+
+    float reuse() const {
+        return m_reuse;
+    }
+};
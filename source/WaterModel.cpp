@@ -5,15 +5,15 @@ Change Log:
 - created by Kenny, Yitong, Melanie, and Cole for the final
 */
 
-shared_ptr<Model> WaterModel::createWaterModel(Array<Vector3>& waterPositions, float waterRadius, float waterStep) {
-    const shared_ptr<ArticulatedModel>& model = ArticulatedModel::createEmpty("waterModel");
+void WaterModel::createModel() {
+    m_model = ArticulatedModel::createEmpty("waterModel");
 
-    ArticulatedModel::Part*     part      = model->addPart("root");
-    ArticulatedModel::Geometry* geometry  = model->addGeometry("geom");
-    ArticulatedModel::Mesh*     mesh      = model->addMesh("mesh", part, geometry);
+    ArticulatedModel::Part* part = m_model->addPart("root");
+    m_geometry = m_model->addGeometry("geom");
+    m_mesh     = m_model->addMesh("mesh", part, m_geometry);
 
     // Assign a material
-    mesh->material = UniversalMaterial::create(
+    m_mesh->material = UniversalMaterial::create(
         PARSE_ANY(
         UniversalMaterial::Specification {
 			lambertian = Color3(0);
@@ -22,33 +22,73 @@ shared_ptr<Model> WaterModel::createWaterModel(Array<Vector3>& waterPositions, f
             extinctionTransmit = Color3(1,1,1);
             extinctionReflect = Color3(0,0,0);
         }));
-    
-    Array<CPUVertexArray::Vertex>& vertexArray = geometry->cpuVertexArray.vertex;
-    Array<int>& indexArray = mesh->cpuIndexArray;
-    MCubes(waterPositions, waterRadius, waterStep).marchCubes(vertexArray, indexArray);
+}
+
+shared_ptr<Model> WaterModel::updateWaterModel(Array<Vector3>& waterPositions, float waterRadius, float waterStep) {
+    if (isNull(m_model)) {
+        createModel();
+    }
+
+    // fastClear keeps the arrays' memory for this frame's mesh
+    Array<CPUVertexArray::Vertex>& vertexArray = m_geometry->cpuVertexArray.vertex;
+    Array<int>& indexArray = m_mesh->cpuIndexArray;
+    vertexArray.fastClear();
+    indexArray.fastClear();
+
+    BEGIN_PROFILER_EVENT("Mesh water");
+    m_mesher.setParticles(waterPositions, anisotropy, waterRadius, waterStep, meshOptions);
+    m_mesher.marchCubes(vertexArray, indexArray, &m_brickCache);
+    meshStats = m_mesher.stats();
+    END_PROFILER_EVENT();
+
+    decimateStats = MeshDecimator::Stats();
+    if (decimateOptions.enabled) {
+        BEGIN_PROFILER_EVENT("Decimate water");
+        decimateOptions.view = meshOptions.view;
+        m_decimator.options() = decimateOptions;
+        m_decimator.decimate(vertexArray, indexArray, waterStep);
+        decimateStats = m_decimator.stats();
+        END_PROFILER_EVENT();
+    }
+
+    // The GPU copies are stale. The model uploads the new arrays the next time it is posed.
+    m_geometry->clearAttributeArrays();
+    m_mesh->clearIndexStream();
 
     // Tell the ArticulatedModel to generate bounding boxes, GPU vertex arrays,
     // normals and tangents automatically. We already ensured correct
     // topology, so avoid the vertex merging optimization.
     ArticulatedModel::CleanGeometrySettings geometrySettings;
     geometrySettings.allowVertexMerging = false;
-    model->cleanGeometry(geometrySettings);
+    m_model->cleanGeometry(geometrySettings);
 
-    return model;
+    return m_model;
 }
 
 
+void WaterModel::setWaterParticles(const Array<Vector3>& positions, float radius, float step) {
+    particlePositions = positions;
+    particleRadius = radius;
+    particleStep = step;
+}
+
+shared_ptr<ParticleSurface> WaterModel::createParticleSurface(const ParticleSurface::Options& options) const {
+    return std::make_shared<ParticleSurface>(particlePositions, anisotropy, particleRadius, particleStep, meshOptions, options);
+}
+
 void WaterModel::addWaterToScene(Array<Vector3>& waterPositions, shared_ptr<Scene>& scene, float waterRadius, float waterStep) {
-    // Replace any existing torus model. Models don't 
-    // have to be added to the model table to use them 
+    setWaterParticles(waterPositions, waterRadius, waterStep);
+
+    // The model persists across frames, so it only needs to be inserted
+    // into a scene that does not have it yet, e.g., after loading a scene.
+    // Models don't have to be added to the model table to use them
     // with a VisibleEntity.
-    const shared_ptr<Model>& waterModel = createWaterModel(waterPositions, waterRadius, waterStep);
-    if (scene->modelTable().containsKey(waterModel->name())) {
-        scene->removeModel(waterModel->name());
+    const shared_ptr<Model>& waterModel = updateWaterModel(waterPositions, waterRadius, waterStep);
+    if (! scene->modelTable().containsKey(waterModel->name())) {
+        scene->insert(waterModel);
     }
-    scene->insert(waterModel);
 
-    // Replace any existing torus entity that has the wrong type
+    // Replace any existing entity that has the wrong type
     shared_ptr<Entity> water = scene->entity("water");
     if (notNull(water) && isNull(dynamic_pointer_cast<VisibleEntity>(water))) {
         logPrintf("The scene contained an Entity named 'water' that was not a VisibleEntity\n");
@@ -57,6 +97,9 @@ void WaterModel::addWaterToScene(Array<Vector3>& waterPositions, shared_ptr<Scen
     }
     //this is to stop it from crashing when the water model is empty
     if (waterPositions.size() < 1) { 
+        if (notNull(water)) {
+            water->setVisible(false);
+        }
         return;
     }
 
@@ -71,45 +114,139 @@ void WaterModel::addWaterToScene(Array<Vector3>& waterPositions, shared_ptr<Scen
                     model = "waterModel";
                 };
             ));
+        water->setFrame(CFrame::fromXYZYPRDegrees(0.0f, 0.0f, 0.0f, 0.0f, 0.0f));
     } else {
-        // Change the model on the existing torus entity
-        dynamic_pointer_cast<VisibleEntity>(water)->setModel(waterModel);
+        const shared_ptr<VisibleEntity>& visibleWater = dynamic_pointer_cast<VisibleEntity>(water);
+        if (visibleWater->model() != waterModel) {
+            visibleWater->setModel(waterModel);
+        }
+        water->setVisible(true);
     }
-
-    water->setFrame(CFrame::fromXYZYPRDegrees(0.0f, 0.0f, 0.0f, 0.0f, 0.0f));
 }
 
-const Any DIFFUSE_PARTICLE_ENTITY_ANY = PARSE_ANY(
-    VisibleEntity {
-        model = "sphereModel";
-    };
-);
+void WaterModel::createFoamModel() {
+    m_foamModel = ArticulatedModel::createEmpty("foamModel");
+
+    ArticulatedModel::Part* part = m_foamModel->addPart("root");
+    m_foamGeometry = m_foamModel->addGeometry("geom");
+
+    m_foamMeshes.fastClear();
+    for (int b = 0; b <= FOAM_AGE_BUCKETS; ++b) {
+        const float age = b / float(FOAM_AGE_BUCKETS);
+        ArticulatedModel::Mesh* mesh = m_foamModel->addMesh(format("age%d", b), part, m_foamGeometry);
+
+        // The path tracer intersects foamInstances instead of this model, so the material only matters for rasterization
+        UniversalMaterial::Specification spec(Color4(0.95f, 0.95f, 1.0f, age));
+        spec.setTransmissive(Texture::Specification(Color3(0.5)));
+        mesh->material = UniversalMaterial::create(spec);
+
+        m_foamMeshes.append(mesh);
+    }
+
+    FoamInstance::getSphereMesh(m_foamSphereVertices, m_foamSphereIndices);
+    m_foamSphereTangents.resize(m_foamSphereVertices.size());
+    for (int k = 0; k < m_foamSphereVertices.size(); ++k) {
+        // Any unit vector perpendicular to the normal will do, since the foam material has no normal map
+        const Vector3& normal = m_foamSphereVertices[k];
+        const Vector3& up = (std::abs(normal.y) < 0.9f) ? Vector3::unitY() : Vector3::unitX();
+        m_foamSphereTangents[k] = Vector4(up.cross(normal).direction(), 1.0f);
+    }
+    // Tells cleanGeometry that every vertex comes with its tangent
+    m_foamGeometry->cpuVertexArray.hasTangent = true;
+    m_foamBucketStart.fastClear();
+}
 
 void WaterModel::addDiffuseToScene(Array<Vector4>& diffusePositions, shared_ptr<Scene>& scene, float diffuseRadius, float diffuseStep) {
-    for (int i = 0; i < diffusePositions.size(); ++i) {
+    if (isNull(m_foamModel)) {
+        createFoamModel();
+    }
+
+    const Array<Vector3>& sphereVertices = m_foamSphereVertices;
+    const Array<int>& sphereIndices = m_foamSphereIndices;
+    const int verticesPerSphere = sphereVertices.size();
+    const int indicesPerSphere = sphereIndices.size();
+
+    // Sort the particles by age bucket so that each bucket's spheres are contiguous in the vertex array
+    const int n = diffusePositions.size();
+    Array<int>& next = m_foamBucketNext;
+    next.resize(FOAM_AGE_BUCKETS + 2);
+    next.setAll(0);
+    for (int i = 0; i < n; ++i) {
+        ++next[iClamp(int(FOAM_AGE_BUCKETS * diffusePositions[i].w), 0, FOAM_AGE_BUCKETS) + 1];
+    }
+    for (int b = 1; b < next.size(); ++b) {
+        next[b] += next[b - 1];
+    }
+
+    // Every copy of the sphere keeps its indices as long as no bucket changes size
+    bool topologyChanged = (next.size() != m_foamBucketStart.size());
+    for (int b = 0; (b < next.size()) && ! topologyChanged; ++b) {
+        topologyChanged = (next[b] != m_foamBucketStart[b]);
+    }
+    if (topologyChanged) {
+        m_foamBucketStart = next;
+    }
+    const Array<int>& bucketStart = m_foamBucketStart;
+
+    foamInstances.resize(n, false);
+    for (int i = 0; i < n; ++i) {
         const Vector4& pos = diffusePositions[i];
+        const int bucket = iClamp(int(FOAM_AGE_BUCKETS * pos.w), 0, FOAM_AGE_BUCKETS);
+        FoamInstance& instance = foamInstances[next[bucket]++];
+        instance.position = pos.xyz();
+        instance.radius = diffuseRadius;
+        // Only the rasterized model is quantized to the buckets. The path tracer gets Flex's age as is.
+        instance.age = clamp(pos.w, 0.0f, 1.0f);
+    }
 
-        const String entityName = format("Diffuse Sphere %d", i);
-        if (isNull(scene->typedEntity<VisibleEntity>(entityName))) {
-            scene->createEntity(entityName, DIFFUSE_PARTICLE_ENTITY_ANY);
+    // Expand the template sphere once per particle
+    Array<CPUVertexArray::Vertex>& vertexArray = m_foamGeometry->cpuVertexArray.vertex;
+    vertexArray.resize(n * verticesPerSphere, false);
+    Thread::runConcurrently(0, n, [&](int j) {
+        const FoamInstance& instance = foamInstances[j];
+        CPUVertexArray::Vertex* v = vertexArray.getCArray() + j * verticesPerSphere;
+        for (int k = 0; k < verticesPerSphere; ++k) {
+            v[k].position = instance.position + sphereVertices[k] * instance.radius;
+            v[k].normal = sphereVertices[k];
+            v[k].tangent = m_foamSphereTangents[k];
+            v[k].texCoord0 = Point2(0, 0);
         }
-        const shared_ptr<VisibleEntity>& entity = scene->typedEntity<VisibleEntity>(entityName);
-        debugAssertM(!isNull(entity), "Diffuse sphere entity should exist but doesn't");
-        
-        UniversalMaterial::Specification spec(Color4(0.95f, 0.95f, 1.0f, int(10 * pos.w) / 10.0f));
-        // We're using the kappaPos to tag this model as a diffuse particle
-        // kappNeg stores the current age and radius of the diffuse particle
-        spec.setExtinction(Color3(int(10 * pos.w) / 10.0f, 0, diffuseRadius), foamParticleTag);
-        // Transmissive can't be Color3(0) otherwise it will cast a shadow in our pathTracer so we just set to it some value that's not 0.
-        spec.setTransmissive(Texture::Specification(Color3(0.5)));
+    });
+
+    for (int b = 0; topologyChanged && (b <= FOAM_AGE_BUCKETS); ++b) {
+        const int first = bucketStart[b];
+        Array<int>& indexArray = m_foamMeshes[b]->cpuIndexArray;
+        indexArray.resize((bucketStart[b + 1] - first) * indicesPerSphere, false);
+        Thread::runConcurrently(0, bucketStart[b + 1] - first, [&](int j) {
+            const int offset = (first + j) * verticesPerSphere;
+            int* index = indexArray.getCArray() + j * indicesPerSphere;
+            for (int k = 0; k < indicesPerSphere; ++k) {
+                index[k] = offset + sphereIndices[k];
+            }
+        });
+        m_foamMeshes[b]->clearIndexStream();
+    }
+
+    // Normals and tangents are all set, so this only recomputes the bounds and uploads the moved vertices
+    m_foamGeometry->clearAttributeArrays();
+    ArticulatedModel::CleanGeometrySettings geometrySettings;
+    geometrySettings.allowVertexMerging = false;
+    m_foamModel->cleanGeometry(geometrySettings);
 
-        entity->articulatedModelPose().materialTable.set("default/low-poly-sphere", UniversalMaterial::create(spec));
-        entity->setFrame(CFrame::fromXYZYPRDegrees(pos.x, pos.y, pos.z));
+    if (! scene->modelTable().containsKey(m_foamModel->name())) {
+        scene->insert(m_foamModel);
     }
 
-    for (int i = diffusePositions.size(); i < m_previousDiffuseParticleCount; ++i) {
-        const String entityName = format("Diffuse Sphere %d", i);
-        scene->removeEntity(entityName);
+    shared_ptr<VisibleEntity> foam = scene->typedEntity<VisibleEntity>(FOAM_ENTITY_NAME);
+    if (isNull(foam)) {
+        foam = dynamic_pointer_cast<VisibleEntity>(scene->createEntity(FOAM_ENTITY_NAME,
+            PARSE_ANY(
+                VisibleEntity {
+                    model = "foamModel";
+                };
+            )));
+    } else if (foam->model() != m_foamModel) {
+        foam->setModel(m_foamModel);
     }
-    m_previousDiffuseParticleCount = diffusePositions.size();
+    foam->setVisible(n > 0);
 }
@@ -1,19 +1,93 @@
 #pragma once
 #include <G3D/G3DAll.h>
 #include "MCubes.h"
+#include "MeshDecimator.h"
 #include "PathTracer.h"
+#include "Foam.h"
+#include "ParticleSurface.h"
 
 class WaterModel {
 protected:
-    /** The number of diffuse particles in the scene the last time diffuse particles were generated. Used to remove unused entities. */
-    int m_previousDiffuseParticleCount = 0;
+    /** Foam opacity is quantized to this many steps above zero. Each step is one mesh of the foam model with its own material. */
+    static const int FOAM_AGE_BUCKETS = 10;
+
+    /**
+     * All diffuse particles, batched into one model that is rebuilt in place every frame. Particles are grouped
+     * by age so that each group can share a material, and every particle is a copy of the same template sphere.
+     */
+    shared_ptr<ArticulatedModel> m_foamModel;
+    ArticulatedModel::Geometry* m_foamGeometry = nullptr;
+    Array<ArticulatedModel::Mesh*> m_foamMeshes;
+
+    /**
+     * Unit sphere copied once per diffuse particle, with tangents so that cleanGeometry does not have to
+     * compute them for every copy every frame.
+     */
+    Array<Vector3> m_foamSphereVertices;
+    Array<Vector4> m_foamSphereTangents;
+    Array<int> m_foamSphereIndices;
+
+    /** Index of the first particle of each age bucket in foamInstances, and one past the last. The index arrays are only rebuilt when it changes. */
+    Array<int> m_foamBucketStart;
+    Array<int> m_foamBucketNext;
+
+    /** Creates m_foamModel with one mesh and material per age bucket, and the template sphere. */
+    void createFoamModel();
+
+    /** Triangles of the previous water mesh by brick, so that only the parts where particles moved are remeshed. */
+    MCubes::BrickCache m_brickCache;
+
+    /** Kept from frame to frame so that their particle copies, hash grids and scratch arrays are reused rather than reallocated. */
+    MCubes m_mesher;
+    MeshDecimator m_decimator;
+
+    /**
+     * The water model, created with its material on first use and remeshed in place every frame after that.
+     * Its vertex and index arrays keep their capacity from frame to frame, so they stop allocating once
+     * they have grown to fit the largest mesh.
+     */
+    shared_ptr<ArticulatedModel> m_model;
+    ArticulatedModel::Geometry* m_geometry = nullptr;
+    ArticulatedModel::Mesh* m_mesh = nullptr;
+
+    /** Creates m_model, its single mesh and the water material. */
+    void createModel();
 public:
-    /** Returns a pointer to a model representing the water particles as described by the parameters. The model is created through marching cubes. */
-    shared_ptr<Model> createWaterModel(Array<Vector3>& waterPositions, float waterRadius, float waterStep);
+    /** Options forwarded to the marching cubes mesher every frame. */
+    MCubes::Options meshOptions;
+
+    /** Per-particle ellipsoids from the solver. Used when meshOptions.field is ANISOTROPIC_KERNEL, in which case the water positions passed in should be the smoothed ones. */
+    MCubes::Anisotropy anisotropy;
 
-    /** Creates a water model with WaterModel::createWaterModel and adds it to the passed scene. */
+    /** Work done by the mesher for the most recent water model. */
+    MCubes::Stats meshStats;
+
+    /** Options for simplifying the mesh after extraction. Its view is taken from meshOptions. */
+    MeshDecimator::Options decimateOptions;
+
+    /** Reduction and time of the decimator for the most recent water model. Zero when it is disabled. */
+    MeshDecimator::Stats decimateStats;
+
+    /** The water particles of the most recent frame and the radius and step they were meshed with, for tracing the particle field directly. */
+    Array<Vector3> particlePositions;
+    float particleRadius = 0.0f;
+    float particleStep = 0.0f;
+
+    /** Records this frame's water particles without meshing them. addWaterToScene does this too. */
+    void setWaterParticles(const Array<Vector3>& positions, float radius, float step);
+
+    /** The zero set of the most recent frame's particle field, with the same field settings as meshOptions, for the path tracer. */
+    shared_ptr<ParticleSurface> createParticleSurface(const ParticleSurface::Options& options = ParticleSurface::Options()) const;
+
+    /** Remeshes the water model for the water particles as described by the parameters and returns it. The mesh is created through marching cubes. */
+    shared_ptr<Model> updateWaterModel(Array<Vector3>& waterPositions, float waterRadius, float waterStep);
+
+    /** Updates the water model with WaterModel::updateWaterModel and adds it to the passed scene if it is not already there. */
     void addWaterToScene(Array<Vector3>& waterPositions, shared_ptr<Scene>& scene, float waterRadius, float waterStep);
 
-    /** Adds diffuse particles to the scene. The particles are visible entities sharing a sphere model. */
+    /** The diffuse particles passed to the last call of addDiffuseToScene, for the path tracer. */
+    Array<FoamInstance> foamInstances;
+
+    /** Adds diffuse particles to the scene. The particles are batched into a single entity, so the scene does not grow with the particle count. */
 	void WaterModel::addDiffuseToScene(Array<Vector4>& diffusePositions, shared_ptr<Scene>& scene, float diffuseRadius, float diffuseStep);
 };
\ No newline at end of file
@@ -0,0 +1,709 @@
+#include "WideBVH.h"
+#include "FieldKernel.h"
+#include "Intrinsics.h"
+
+/** Bins along the split axis when building by SAH. */
+static const int SAH_BINS = 12;
+
+/** Packs a leaf for the traversal stack. */
+static inline int leafEntry(int first, int count) {
+    return ~((first << 3) | count);
+}
+
+void WideBVH::clear() {
+    m_nodes.fastClear();
+    m_triangles.fastClear();
+    m_stackSize = 1;
+}
+
+void WideBVH::setImplementation(Implementation implementation) {
+    // FieldKernel already knows whether this CPU and OS support AVX
+    const Implementation best = (FieldKernel::best() == FieldKernel::AVX) ? AVX : SCALAR;
+    m_implementation = (implementation > best) ? best : implementation;
+}
+
+void WideBVH::setContents(const TriTree& tree) {
+    const CPUVertexArray& vertexArray = tree.vertexArray();
+    Array<Point3> corners;
+    Array<bool> twoSided;
+    corners.resize(tree.size() * 3);
+    twoSided.resize(tree.size());
+    Thread::runConcurrently(0, tree.size(), [&](int t) {
+        const Tri& tri = tree[t];
+        for (int k = 0; k < 3; ++k) {
+            corners[3 * t + k] = tri.position(vertexArray, k);
+        }
+        twoSided[t] = tri.twoSided();
+    });
+    setContents(corners, twoSided);
+}
+
+void WideBVH::setContents(const Array<Point3>& corners, const Array<bool>& twoSided) {
+    clear();
+    setImplementation(AVX);
+    const int n = twoSided.size();
+    if (n == 0) {
+        return;
+    }
+
+    Array<Triangle> triangles;
+    Array<AABox> boxes;
+    Array<Point3> centroids;
+    triangles.resize(n);
+    boxes.resize(n);
+    centroids.resize(n);
+    Thread::runConcurrently(0, n, [&](int t) {
+        const Point3& a = corners[3 * t];
+        const Point3& b = corners[3 * t + 1];
+        const Point3& c = corners[3 * t + 2];
+        Triangle& triangle = triangles[t];
+        triangle.v0 = a;
+        triangle.e1 = b - a;
+        triangle.e2 = c - a;
+        triangle.index = t;
+        triangle.twoSided = twoSided[t];
+
+        boxes[t] = AABox(a.min(b).min(c), a.max(b).max(c));
+        centroids[t] = (a + b + c) / 3.0f;
+    });
+
+    Array<int> order;
+    order.resize(n);
+    for (int t = 0; t < n; ++t) {
+        order[t] = t;
+    }
+
+    Array<BinaryNode> binary;
+    const int root = buildBinary(binary, order, boxes, centroids, 0, n);
+
+    // Store the triangles in leaf order so that a leaf is a contiguous range
+    m_triangles.resize(n);
+    for (int t = 0; t < n; ++t) {
+        m_triangles[t] = triangles[order[t]];
+    }
+
+    collapse(binary, root, 1);
+}
+
+int WideBVH::buildBinary(Array<BinaryNode>& binary, Array<int>& order, const Array<AABox>& boxes, const Array<Point3>& centroids, int first, int count) const {
+    const int index = binary.size();
+    binary.next();
+
+    AABox bounds = boxes[order[first]];
+    AABox centroidBounds(centroids[order[first]]);
+    for (int i = first + 1; i < first + count; ++i) {
+        bounds.merge(boxes[order[i]]);
+        centroidBounds.merge(centroids[order[i]]);
+    }
+    binary[index].bounds = bounds;
+
+    if (count <= LEAF_SIZE) {
+        binary[index].first = first;
+        binary[index].count = count;
+        return index;
+    }
+
+    const Vector3& extent = centroidBounds.extent();
+    const int axis = (extent.x >= extent.y) ? ((extent.x >= extent.z) ? 0 : 2) : ((extent.y >= extent.z) ? 1 : 2);
+    const float low = centroidBounds.low()[axis];
+    const float width = extent[axis];
+
+    int* begin = order.getCArray() + first;
+    int* end = begin + count;
+    int* middle = begin;
+    if (width > 0.0f) {
+        // Bin the centroids and choose the bin boundary with the smallest surface area heuristic
+        AABox binBounds[SAH_BINS];
+        int binCount[SAH_BINS] = {};
+        const float binsPerUnit = SAH_BINS / width;
+        const auto binOf = [&](int t) {
+            return min(int((centroids[t][axis] - low) * binsPerUnit), SAH_BINS - 1);
+        };
+        for (int i = first; i < first + count; ++i) {
+            const int t = order[i];
+            const int b = binOf(t);
+            if (binCount[b] == 0) {
+                binBounds[b] = boxes[t];
+            } else {
+                binBounds[b].merge(boxes[t]);
+            }
+            ++binCount[b];
+        }
+
+        // Sweep from the right, then from the left, to cost every split
+        float rightArea[SAH_BINS];
+        int rightCount[SAH_BINS];
+        AABox sweep;
+        int sweepCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            if (binCount[b] > 0) {
+                if (sweepCount == 0) {
+                    sweep = binBounds[b];
+                } else {
+                    sweep.merge(binBounds[b]);
+                }
+                sweepCount += binCount[b];
+            }
+            rightArea[b] = (sweepCount > 0) ? sweep.area() : 0.0f;
+            rightCount[b] = sweepCount;
+        }
+
+        float bestCost = finf();
+        int bestSplit = -1;
+        sweepCount = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            if (binCount[b] > 0) {
+                if (sweepCount == 0) {
+                    sweep = binBounds[b];
+                } else {
+                    sweep.merge(binBounds[b]);
+                }
+                sweepCount += binCount[b];
+            }
+            if ((sweepCount == 0) || (rightCount[b + 1] == 0)) {
+                continue;
+            }
+            const float cost = sweep.area() * sweepCount + rightArea[b + 1] * rightCount[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        if (bestSplit >= 0) {
+            middle = std::partition(begin, end, [&](int t) { return binOf(t) <= bestSplit; });
+        }
+    }
+
+    if ((middle == begin) || (middle == end)) {
+        // Every centroid fell in one bin, so split at the median instead
+        middle = begin + count / 2;
+        std::nth_element(begin, middle, end, [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+    }
+
+    const int leftCount = int(middle - begin);
+    const int left = buildBinary(binary, order, boxes, centroids, first, leftCount);
+    const int right = buildBinary(binary, order, boxes, centroids, first + leftCount, count - leftCount);
+    binary[index].left = left;
+    binary[index].right = right;
+    return index;
+}
+
+int WideBVH::collapse(const Array<BinaryNode>& binary, int root, int depth) {
+    const int nodeIndex = m_nodes.size();
+    m_nodes.next();
+
+    // Each level of depth-first traversal leaves at most WIDTH - 1 siblings on the stack
+    m_stackSize = max(m_stackSize, depth * (WIDTH - 1) + 1);
+
+    // Open the inner child with the largest surface area, which is the most likely to be hit, until there are 8
+    int children[WIDTH];
+    int childCount = 0;
+    const BinaryNode& rootNode = binary[root];
+    if (rootNode.count > 0) {
+        // Only happens when the whole tree is one leaf
+        children[childCount++] = root;
+    } else {
+        children[childCount++] = rootNode.left;
+        children[childCount++] = rootNode.right;
+    }
+    while (childCount < WIDTH) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (int k = 0; k < childCount; ++k) {
+            const BinaryNode& child = binary[children[k]];
+            if ((child.count == 0) && (child.bounds.area() > largestArea)) {
+                largest = k;
+                largestArea = child.bounds.area();
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        const BinaryNode& opened = binary[children[largest]];
+        children[largest] = opened.left;
+        children[childCount++] = opened.right;
+    }
+
+    // Quantize the child boxes against the node's, rounding outward. The scale is padded so that 255 reaches the far corner.
+    Node node;
+    const AABox& bounds = rootNode.bounds;
+    for (int a = 0; a < 3; ++a) {
+        node.origin[a] = bounds.low()[a];
+        node.scale[a] = max(bounds.extent()[a] * (1.0f + 1e-5f) / 255.0f, 1e-30f);
+    }
+    node.childCount = uint8(childCount);
+
+    for (int k = 0; k < WIDTH; ++k) {
+        if (k >= childCount) {
+            // An empty box that no ray can hit
+            for (int a = 0; a < 3; ++a) {
+                node.low[a][k] = 255;
+                node.high[a][k] = 0;
+            }
+            node.child[k] = 0;
+            node.count[k] = 0;
+            continue;
+        }
+
+        const BinaryNode& child = binary[children[k]];
+        for (int a = 0; a < 3; ++a) {
+            const float origin = node.origin[a];
+            const float scale = node.scale[a];
+            const float childLow = child.bounds.low()[a];
+            const float childHigh = child.bounds.high()[a];
+
+            // Check against the decoded value, computed exactly as traversal does, so that rounding can never shrink the box
+            int low = iClamp(iFloor((childLow - origin) / scale), 0, 255);
+            while ((low > 0) && (origin + float(low) * scale > childLow)) {
+                --low;
+            }
+            int high = iClamp(iCeil((childHigh - origin) / scale), 0, 255);
+            while ((high < 255) && (origin + float(high) * scale < childHigh)) {
+                ++high;
+            }
+            node.low[a][k] = uint8(low);
+            node.high[a][k] = uint8(high);
+        }
+
+        if (child.count > 0) {
+            node.child[k] = child.first;
+            node.count[k] = uint8(child.count);
+        } else {
+            node.child[k] = collapse(binary, children[k], depth + 1);
+            node.count[k] = 0;
+        }
+    }
+
+    m_nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+int WideBVH::intersectChildren(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const {
+    if (m_implementation == AVX) {
+        return intersectChildrenAVX(node, origin, invDirection, minDistance, maxDistance, t);
+    }
+    return intersectChildrenScalar(node, origin, invDirection, minDistance, maxDistance, t);
+}
+
+int WideBVH::intersectChildrenScalar(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const {
+    int mask = 0;
+    for (int k = 0; k < node.childCount; ++k) {
+        float tNear = minDistance;
+        float tFar = maxDistance;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (node.origin[a] + float(node.low[a][k]) * node.scale[a] - origin[a]) * invDirection[a];
+            float t1 = (node.origin[a] + float(node.high[a][k]) * node.scale[a] - origin[a]) * invDirection[a];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            tNear = max(tNear, t0);
+            tFar = min(tFar, t1);
+        }
+        if (tNear <= tFar) {
+            mask |= 1 << k;
+            t[k] = tNear;
+        }
+    }
+    return mask;
+}
+
+/** The 8 children's plane along one axis, decoded from bytes. */
+AVX_FUNCTION static inline __m256 decodePlanes(const uint8* q, float origin, float scale) {
+    const __m128i bytes = _mm_loadl_epi64((const __m128i*)q);
+    const __m128 low4 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes));
+    const __m128 high4 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+    const __m256 planes = _mm256_insertf128_ps(_mm256_castps128_ps256(low4), high4, 1);
+    return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(planes, _mm256_set1_ps(scale)));
+}
+
+AVX_FUNCTION int WideBVH::intersectChildrenAVX(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const {
+    __m256 tNear = _mm256_set1_ps(minDistance);
+    __m256 tFar = _mm256_set1_ps(maxDistance);
+    for (int a = 0; a < 3; ++a) {
+        const __m256 o = _mm256_set1_ps(origin[a]);
+        const __m256 inv = _mm256_set1_ps(invDirection[a]);
+        const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(decodePlanes(node.low[a], node.origin[a], node.scale[a]), o), inv);
+        const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(decodePlanes(node.high[a], node.origin[a], node.scale[a]), o), inv);
+
+        // max and min return their second operand when either is NaN, which keeps the running interval for 0 * inf
+        tNear = _mm256_max_ps(_mm256_min_ps(t0, t1), tNear);
+        tFar = _mm256_min_ps(_mm256_max_ps(t0, t1), tFar);
+    }
+    _mm256_storeu_ps(t, tNear);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) & ((1 << node.childCount) - 1);
+}
+
+bool WideBVH::intersectTriangle(const Triangle& triangle, const Ray& ray, bool cullBackfaces, float& maxDistance, TriTree::Hit& hit) const {
+    // Moller-Trumbore. det is positive when the ray hits the front face.
+    const Vector3& direction = ray.direction();
+    const Vector3& p = direction.cross(triangle.e2);
+    const float det = triangle.e1.dot(p);
+    const bool backface = (det < 0.0f);
+    if ((det == 0.0f) || (backface && cullBackfaces && ! triangle.twoSided)) {
+        return false;
+    }
+
+    const float invDet = 1.0f / det;
+    const Vector3& s = ray.origin() - triangle.v0;
+    const float u = s.dot(p) * invDet;
+    if ((u < 0.0f) || (u > 1.0f)) {
+        return false;
+    }
+    const Vector3& q = s.cross(triangle.e1);
+    const float v = direction.dot(q) * invDet;
+    if ((v < 0.0f) || (u + v > 1.0f)) {
+        return false;
+    }
+    const float distance = triangle.e2.dot(q) * invDet;
+    if ((distance < ray.minDistance()) || (distance >= maxDistance)) {
+        return false;
+    }
+
+    maxDistance = distance;
+    hit.triIndex = triangle.index;
+    hit.u = u;
+    hit.v = v;
+    hit.distance = distance;
+    hit.backface = backface;
+    return true;
+}
+
+bool WideBVH::traverse(const Ray& ray, bool anyHit, bool cullBackfaces, TriTree::Hit& hit) const {
+    hit = TriTree::Hit();
+    if (m_nodes.size() == 0) {
+        return false;
+    }
+
+    const Point3& origin = ray.origin();
+    const Vector3 invDirection(1.0f / ray.direction().x, 1.0f / ray.direction().y, 1.0f / ray.direction().z);
+    float maxDistance = ray.maxDistance();
+    bool found = false;
+
+    // SAH trees fit in STACK_SIZE. A degenerate tree gets a stack on the heap that is as deep as it needs.
+    StackEntry localStack[STACK_SIZE];
+    Array<StackEntry> heapStack;
+    StackEntry* stack = localStack;
+    if (m_stackSize > STACK_SIZE) {
+        heapStack.resize(m_stackSize);
+        stack = heapStack.getCArray();
+    }
+
+    int top = 0;
+    stack[top++] = { 0, ray.minDistance() };
+    while (top > 0) {
+        const StackEntry entry = stack[--top];
+        if (entry.distance > maxDistance) {
+            // A closer hit was found since this was pushed
+            continue;
+        }
+
+        if (entry.entry < 0) {
+            const int leaf = ~entry.entry;
+            const int first = leaf >> 3;
+            const int count = leaf & 7;
+            for (int t = first; t < first + count; ++t) {
+                if (intersectTriangle(m_triangles[t], ray, cullBackfaces, maxDistance, hit)) {
+                    found = true;
+                    if (anyHit) {
+                        return true;
+                    }
+                }
+            }
+            continue;
+        }
+
+        const Node& node = m_nodes[entry.entry];
+        float t[WIDTH];
+        int mask = intersectChildren(node, origin, invDirection, ray.minDistance(), maxDistance, t);
+
+        // Sort the children hit farthest first, so that the nearest is on top of the stack
+        StackEntry children[WIDTH];
+        int childCount = 0;
+        while (mask != 0) {
+            int k = 0;
+            while ((mask & (1 << k)) == 0) {
+                ++k;
+            }
+            mask &= ~(1 << k);
+
+            const StackEntry child = { (node.count[k] > 0) ? leafEntry(node.child[k], node.count[k]) : node.child[k], t[k] };
+            int c = childCount++;
+            while ((c > 0) && (children[c - 1].distance < child.distance)) {
+                children[c] = children[c - 1];
+                --c;
+            }
+            children[c] = child;
+        }
+
+        debugAssertM(top + childCount <= m_stackSize, "WideBVH traversal stack overflow");
+        for (int c = 0; c < childCount; ++c) {
+            stack[top++] = children[c];
+        }
+    }
+    return found;
+}
+
+bool WideBVH::intersectRay(const Ray& ray, TriTree::Hit& hit) const {
+    return traverse(ray, false, true, hit);
+}
+
+bool WideBVH::occluded(const Ray& ray) const {
+    TriTree::Hit hit;
+    return traverse(ray, true, false, hit);
+}
+
+void WideBVH::intersectPacket(const Ray* rays, int count, TriTree::Hit* hits) const {
+    if ((m_implementation == AVX) && (m_nodes.size() > 0)) {
+        intersectPacketAVX(rays, count, hits);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            intersectRay(rays[i], hits[i]);
+        }
+    }
+}
+
+/** a x b for 8 vectors in structure-of-arrays form. */
+AVX_FUNCTION static inline void crossAVX(const __m256 a[3], const __m256 b[3], __m256 result[3]) {
+    result[0] = _mm256_sub_ps(_mm256_mul_ps(a[1], b[2]), _mm256_mul_ps(a[2], b[1]));
+    result[1] = _mm256_sub_ps(_mm256_mul_ps(a[2], b[0]), _mm256_mul_ps(a[0], b[2]));
+    result[2] = _mm256_sub_ps(_mm256_mul_ps(a[0], b[1]), _mm256_mul_ps(a[1], b[0]));
+}
+
+AVX_FUNCTION static inline __m256 dotAVX(const __m256 a[3], const __m256 b[3]) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(a[0], b[0]), _mm256_mul_ps(a[1], b[1])), _mm256_mul_ps(a[2], b[2]));
+}
+
+AVX_FUNCTION void WideBVH::intersectPacketAVX(const Ray* rays, int count, TriTree::Hit* hits) const {
+    // One lane per ray. Unused lanes get an empty interval and never hit anything.
+    alignas(32) float lanes[9][PACKET_SIZE];
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        const Ray& ray = rays[min(i, count - 1)];
+        for (int a = 0; a < 3; ++a) {
+            lanes[a][i] = ray.origin()[a];
+            lanes[3 + a][i] = ray.direction()[a];
+            lanes[6 + a][i] = 1.0f / ray.direction()[a];
+        }
+    }
+    alignas(32) float minDistance[PACKET_SIZE];
+    alignas(32) float maxDistance[PACKET_SIZE];
+    for (int i = 0; i < PACKET_SIZE; ++i) {
+        minDistance[i] = (i < count) ? rays[i].minDistance() : finf();
+        maxDistance[i] = (i < count) ? rays[i].maxDistance() : -finf();
+    }
+
+    __m256 origin[3];
+    __m256 direction[3];
+    __m256 invDirection[3];
+    for (int a = 0; a < 3; ++a) {
+        origin[a] = _mm256_load_ps(lanes[a]);
+        direction[a] = _mm256_load_ps(lanes[3 + a]);
+        invDirection[a] = _mm256_load_ps(lanes[6 + a]);
+    }
+    const __m256 tMin = _mm256_load_ps(minDistance);
+    __m256 tMax = _mm256_load_ps(maxDistance);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    for (int i = 0; i < count; ++i) {
+        hits[i] = TriTree::Hit();
+    }
+
+    int localStack[STACK_SIZE];
+    Array<int> heapStack;
+    int* stack = localStack;
+    if (m_stackSize > STACK_SIZE) {
+        heapStack.resize(m_stackSize);
+        stack = heapStack.getCArray();
+    }
+
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const int entry = stack[--top];
+
+        if (entry < 0) {
+            const int leaf = ~entry;
+            const int first = leaf >> 3;
+            for (int t = first; t < first + (leaf & 7); ++t) {
+                const Triangle& triangle = m_triangles[t];
+                const __m256 v0[3] = { _mm256_set1_ps(triangle.v0.x), _mm256_set1_ps(triangle.v0.y), _mm256_set1_ps(triangle.v0.z) };
+                const __m256 e1[3] = { _mm256_set1_ps(triangle.e1.x), _mm256_set1_ps(triangle.e1.y), _mm256_set1_ps(triangle.e1.z) };
+                const __m256 e2[3] = { _mm256_set1_ps(triangle.e2.x), _mm256_set1_ps(triangle.e2.y), _mm256_set1_ps(triangle.e2.z) };
+
+                __m256 p[3];
+                crossAVX(direction, e2, p);
+                const __m256 det = dotAVX(e1, p);
+                const __m256 invDet = _mm256_div_ps(one, det);
+                const __m256 s[3] = { _mm256_sub_ps(origin[0], v0[0]), _mm256_sub_ps(origin[1], v0[1]), _mm256_sub_ps(origin[2], v0[2]) };
+                const __m256 u = _mm256_mul_ps(dotAVX(s, p), invDet);
+                __m256 q[3];
+                crossAVX(s, e1, q);
+                const __m256 v = _mm256_mul_ps(dotAVX(direction, q), invDet);
+                const __m256 distance = _mm256_mul_ps(dotAVX(e2, q), invDet);
+
+                // Comparisons against NaN from a zero det are false, so those lanes miss
+                __m256 hit = triangle.twoSided ? _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ) : _mm256_cmp_ps(det, zero, _CMP_GT_OQ);
+                hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+                hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+                hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+                hit = _mm256_and_ps(hit, _mm256_cmp_ps(distance, tMin, _CMP_GE_OQ));
+                hit = _mm256_and_ps(hit, _mm256_cmp_ps(distance, tMax, _CMP_LT_OQ));
+                int mask = _mm256_movemask_ps(hit);
+                if (mask == 0) {
+                    continue;
+                }
+
+                tMax = _mm256_blendv_ps(tMax, distance, hit);
+                alignas(32) float us[PACKET_SIZE];
+                alignas(32) float vs[PACKET_SIZE];
+                alignas(32) float distances[PACKET_SIZE];
+                alignas(32) float dets[PACKET_SIZE];
+                _mm256_store_ps(us, u);
+                _mm256_store_ps(vs, v);
+                _mm256_store_ps(distances, distance);
+                _mm256_store_ps(dets, det);
+                for (int i = 0; i < count; ++i) {
+                    if (mask & (1 << i)) {
+                        TriTree::Hit& h = hits[i];
+                        h.triIndex = triangle.index;
+                        h.u = us[i];
+                        h.v = vs[i];
+                        h.distance = distances[i];
+                        h.backface = (dets[i] < 0.0f);
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Push every child that any ray hits. The rays are coherent, so they mostly agree on the order.
+        const Node& node = m_nodes[entry];
+        for (int k = node.childCount - 1; k >= 0; --k) {
+            __m256 tNear = tMin;
+            __m256 tFar = tMax;
+            for (int a = 0; a < 3; ++a) {
+                const __m256 low = _mm256_set1_ps(node.origin[a] + float(node.low[a][k]) * node.scale[a]);
+                const __m256 high = _mm256_set1_ps(node.origin[a] + float(node.high[a][k]) * node.scale[a]);
+                const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(low, origin[a]), invDirection[a]);
+                const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(high, origin[a]), invDirection[a]);
+                tNear = _mm256_max_ps(_mm256_min_ps(t0, t1), tNear);
+                tFar = _mm256_min_ps(_mm256_max_ps(t0, t1), tFar);
+            }
+            if (_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) != 0) {
+                debugAssertM(top < m_stackSize, "WideBVH traversal stack overflow");
+                stack[top++] = (node.count[k] > 0) ? leafEntry(node.child[k], node.count[k]) : node.child[k];
+            }
+        }
+    }
+}
+
+void WideBVH::intersectRays(const Array<Ray>& rays, Array<TriTree::Hit>& hits, bool coherent, bool singleThread) const {
+    hits.resize(rays.size(), false);
+    if (coherent && (m_implementation == AVX)) {
+        const int packetCount = (rays.size() + PACKET_SIZE - 1) / PACKET_SIZE;
+        Thread::runConcurrently(0, packetCount, [&](int p) {
+            const int first = p * PACKET_SIZE;
+            intersectPacket(rays.getCArray() + first, min(PACKET_SIZE, rays.size() - first), hits.getCArray() + first);
+        }, singleThread);
+    } else {
+        Thread::runConcurrently(0, rays.size(), [&](int i) {
+            intersectRay(rays[i], hits[i]);
+        }, singleThread);
+    }
+}
+
+void WideBVH::intersectRays(const Array<Ray>& rays, Array<bool>& occludedBuffer, bool singleThread) const {
+    occludedBuffer.resize(rays.size(), false);
+    Thread::runConcurrently(0, rays.size(), [&](int i) {
+        occludedBuffer[i] = occluded(rays[i]);
+    }, singleThread);
+}
+
+String WideBVH::benchmark(const TriTree& tree, const Array<Ray>& cameraRays, const Point3& light) {
+    Stopwatch clock;
+    clock.tick();
+    WideBVH wide;
+    wide.setContents(tree);
+    clock.tock();
+    const RealTime buildTime = clock.elapsedTime();
+
+    // Each pass is timed as the best of a few runs
+    const int RUNS = 3;
+    const auto time = [&](const std::function<void()>& pass) {
+        RealTime best = finf();
+        for (int run = 0; run < RUNS; ++run) {
+            clock.tick();
+            pass();
+            clock.tock();
+            best = min(best, clock.elapsedTime());
+        }
+        return best;
+    };
+
+    // Hits are the same when they are on the same tri, or at the same distance where tris meet
+    const auto sameHit = [](const TriTree::Hit& a, const TriTree::Hit& b) {
+        if ((a.triIndex == TriTree::Hit::NONE) || (b.triIndex == TriTree::Hit::NONE)) {
+            return a.triIndex == b.triIndex;
+        }
+        return (a.triIndex == b.triIndex) || (std::abs(a.distance - b.distance) <= 1e-4f * (1.0f + a.distance));
+    };
+
+    Timing camera;
+    Array<TriTree::Hit> treeHits;
+    Array<TriTree::Hit> wideHits;
+    camera.triTree = time([&]() { tree.intersectRays(cameraRays, treeHits, TriTree::COHERENT_RAY_HINT); });
+    camera.wide = time([&]() { wide.intersectRays(cameraRays, wideHits, true); });
+    for (int i = 0; i < cameraRays.size(); ++i) {
+        camera.mismatches += sameHit(treeHits[i], wideHits[i]) ? 0 : 1;
+    }
+
+    // Diffuse bounces and shadow rays leave from where the camera rays hit
+    const CPUVertexArray& vertexArray = tree.vertexArray();
+    Array<Ray> bounceRays;
+    Array<Ray> shadowRays;
+    Random rng(1);
+    for (int i = 0; i < cameraRays.size(); ++i) {
+        const TriTree::Hit& hit = treeHits[i];
+        if (hit.triIndex == TriTree::Hit::NONE) {
+            continue;
+        }
+        const Tri& tri = tree[hit.triIndex];
+        const Point3& p0 = tri.position(vertexArray, 0);
+        Vector3 n = (tri.position(vertexArray, 1) - p0).cross(tri.position(vertexArray, 2) - p0).directionOrZero();
+        if (hit.backface) {
+            n = -n;
+        }
+        const Point3& position = cameraRays[i].origin() + cameraRays[i].direction() * hit.distance + n * 1e-4f;
+        bounceRays.append(Ray::fromOriginAndDirection(position, Vector3::cosHemiRandom(n, rng)));
+
+        const Vector3& toLight = light - position;
+        shadowRays.append(Ray::fromOriginAndDirection(position, toLight.direction(), 0.0f, toLight.length()));
+    }
+
+    Timing bounce;
+    bounce.triTree = time([&]() { tree.intersectRays(bounceRays, treeHits); });
+    bounce.wide = time([&]() { wide.intersectRays(bounceRays, wideHits, false); });
+    for (int i = 0; i < bounceRays.size(); ++i) {
+        bounce.mismatches += sameHit(treeHits[i], wideHits[i]) ? 0 : 1;
+    }
+
+    Timing shadow;
+    Array<bool> treeOccluded;
+    Array<bool> wideOccluded;
+    shadow.triTree = time([&]() { tree.intersectRays(shadowRays, treeOccluded, TriTree::OCCLUSION_TEST_ONLY | TriTree::DO_NOT_CULL_BACKFACES); });
+    shadow.wide = time([&]() { wide.intersectRays(shadowRays, wideOccluded); });
+    for (int i = 0; i < shadowRays.size(); ++i) {
+        shadow.mismatches += (treeOccluded[i] == wideOccluded[i]) ? 0 : 1;
+    }
+
+    const auto line = [](const char* name, int rays, const Timing& timing) {
+        return format("%-8s %8d rays: TriTree %7.2f Mrays/s, WideBVH %7.2f Mrays/s (%.2fx), %d mismatches\n", name, rays,
+            rays / max(timing.triTree, 1e-9) / 1e6, rays / max(timing.wide, 1e-9) / 1e6, timing.triTree / max(timing.wide, 1e-9), timing.mismatches);
+    };
+    return format("WideBVH: %d tris, %d nodes, built in %.3f s, %s\n", wide.size(), wide.m_nodes.size(), buildTime,
+            (wide.implementation() == AVX) ? "AVX" : "scalar") +
+        line("Camera", cameraRays.size(), camera) +
+        line("Diffuse", bounceRays.size(), bounce) +
+        line("Shadow", shadowRays.size(), shadow);
+}
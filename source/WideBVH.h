@@ -0,0 +1,169 @@
+#pragma once
+#include <G3D/G3DAll.h>
+
+/**
+ * A bounding volume hierarchy over triangles with 8 children per node, as an alternative to G3D's TriTree for the path tracer.
+ *
+ * It is built as a binary tree by binned SAH and then collapsed, pulling up the largest grandchildren until each node has
+ * 8 children. Child boxes are stored as 8-bit offsets from the node's corner, rounded outward, so a node is 112 bytes
+ * instead of the 192 that 8 float boxes take. With AVX, one ray is tested against all 8 children at once. Coherent rays
+ * (from the camera) can instead be traced 8 at a time in packets that share one traversal, testing each box against all 8.
+ * Shadow rays stop at the first hit. Without AVX every test falls back to scalar code.
+ *
+ * Hits follow TriTree's conventions, including its triangle indices when built from a TriTree, so they can be used in
+ * place of TriTree's. Back faces of one-sided triangles are culled except for occlusion tests, as TriTree does for the
+ * options that the path tracer passes.
+ */
+class WideBVH {
+public:
+    enum Implementation { SCALAR, AVX };
+
+    static const int WIDTH = 8;
+
+    /** Most triangles in a leaf. */
+    static const int LEAF_SIZE = 4;
+
+    /** Rays in a packet, one per AVX lane. */
+    static const int PACKET_SIZE = 8;
+
+    /** Eight children. Their boxes are origin + (low, high) * scale. Slots at and past childCount are empty. */
+    class Node {
+    public:
+        float origin[3];
+        float scale[3];
+        uint8 low[3][WIDTH];
+        uint8 high[3][WIDTH];
+
+        /** Node index of an inner child, or the first triangle of a leaf. */
+        int child[WIDTH];
+
+        /** Triangles in a leaf child, 0 for an inner child. */
+        uint8 count[WIDTH];
+
+        uint8 childCount;
+    };
+
+    /** A triangle as Moller-Trumbore uses it. */
+    class Triangle {
+    public:
+        Point3 v0;
+        Vector3 e1;
+        Vector3 e2;
+
+        /** Index of the triangle in the input, which is the TriTree index when built from one. */
+        int index;
+
+        bool twoSided;
+    };
+
+    /** What a benchmark measured for one kind of ray. */
+    class Timing {
+    public:
+        RealTime triTree = 0;
+        RealTime wide = 0;
+
+        /** Rays whose hit differs between TriTree and WideBVH. */
+        int mismatches = 0;
+    };
+
+protected:
+    /** Node 0 is the root. */
+    Array<Node> m_nodes;
+
+    /** In leaf order. */
+    Array<Triangle> m_triangles;
+
+    Implementation m_implementation = SCALAR;
+
+    /** Entry on the single-ray traversal stack: a node, or ~(first triangle << 3 | count) for a leaf. */
+    class StackEntry {
+    public:
+        int entry;
+        float distance;
+    };
+
+    /** Entries of the traversal stacks kept on the call stack. */
+    static const int STACK_SIZE = 512;
+
+    /** Entries the traversal stacks need for this tree. Traversal moves its stack to the heap when this exceeds STACK_SIZE. */
+    int m_stackSize = 1;
+
+    /** Writes the entry distance of each child the ray hits before maxDistance to t, and returns the mask of those children. */
+    int intersectChildren(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const;
+    int intersectChildrenScalar(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const;
+    int intersectChildrenAVX(const Node& node, const Point3& origin, const Vector3& invDirection, float minDistance, float maxDistance, float t[WIDTH]) const;
+
+    /** Tests the ray against one triangle. On a hit closer than maxDistance, shortens it and fills hit. */
+    bool intersectTriangle(const Triangle& triangle, const Ray& ray, bool cullBackfaces, float& maxDistance, TriTree::Hit& hit) const;
+
+    /** Traversal shared by intersectRay and occluded. */
+    bool traverse(const Ray& ray, bool anyHit, bool cullBackfaces, TriTree::Hit& hit) const;
+
+    void intersectPacketAVX(const Ray* rays, int count, TriTree::Hit* hits) const;
+
+    /** A node of the binary tree that is collapsed into the wide one. */
+    class BinaryNode {
+    public:
+        AABox bounds;
+
+        /** Children of an inner node. */
+        int left = -1;
+        int right = -1;
+
+        /** Triangles of a leaf. count is 0 for an inner node. */
+        int first = 0;
+        int count = 0;
+    };
+
+    /**
+     * Builds the binary tree over order[first, first + count) by binned SAH, reordering that range, and returns its root.
+     * order holds triangle indices into boxes and centroids.
+     */
+    int buildBinary(Array<BinaryNode>& binary, Array<int>& order, const Array<AABox>& boxes, const Array<Point3>& centroids, int first, int count) const;
+
+    /** Appends the wide node for the binary subtree at root, and those below it, and returns its index. depth is 1 at the root. */
+    int collapse(const Array<BinaryNode>& binary, int root, int depth);
+
+public:
+
+    /** Builds over the tris of a TriTree, keeping their indices. */
+    void setContents(const TriTree& tree);
+
+    /** Builds over triangles given as three corners each, counterclockwise from the front. */
+    void setContents(const Array<Point3>& corners, const Array<bool>& twoSided);
+
+    void clear();
+
+    /** Number of triangles. */
+    int size() const {
+        return m_triangles.size();
+    }
+
+    Implementation implementation() const {
+        return m_implementation;
+    }
+
+    /** Uses the given implementation if this CPU supports it, and the best one it supports otherwise. */
+    void setImplementation(Implementation implementation);
+
+    /** The closest hit. On a miss returns false and leaves hit.triIndex NONE. */
+    bool intersectRay(const Ray& ray, TriTree::Hit& hit) const;
+
+    /** Whether anything is hit, from either side. Stops at the first hit found. */
+    bool occluded(const Ray& ray) const;
+
+    /** The closest hits of up to PACKET_SIZE rays, traversing once for all of them. Best when the rays are coherent. */
+    void intersectPacket(const Ray* rays, int count, TriTree::Hit* hits) const;
+
+    /** The closest hit of every ray, in packets when coherent. On all cores unless singleThread. */
+    void intersectRays(const Array<Ray>& rays, Array<TriTree::Hit>& hits, bool coherent, bool singleThread = false) const;
+
+    /** Whether every ray is occluded. On all cores unless singleThread. */
+    void intersectRays(const Array<Ray>& rays, Array<bool>& occluded, bool singleThread = false) const;
+
+    /**
+     * Times TriTree and WideBVH, both on all cores, on the camera rays given, on diffuse bounces from where they hit, and
+     * on shadow rays from those hits to light, and checks that they find the same hits. Returns a human-readable report.
+     */
+    static String benchmark(const TriTree& tree, const Array<Ray>& cameraRays, const Point3& light);
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <G3D/G3DAll.h>
+#include <atomic>
+
+/**
+ * Invokes callback(i) for every i in [0, count) using all of the cores.
+ *
+ * Thread::runConcurrently hands each thread a fixed slice of the range, which
+ * leaves cores idle when the cost per item is very uneven (a brick full of
+ * surface vs. a brick that only grazes a droplet). Here every worker instead
+ * pulls the next unclaimed index from a shared counter until the range is
+ * exhausted. Items are claimed in increasing order but may finish in any order,
+ * so callers that need deterministic output must write to per-item storage.
+ */
+inline void runDynamically(const int count, const std::function<void(int)>& callback) {
+    if (count <= 0) {
+        return;
+    }
+
+    std::atomic<int> next(0);
+    const int numWorkers = min(System::numCores(), count);
+    Thread::runConcurrently(0, numWorkers, [&](int) {
+        for (int i = next++; i < count; i = next++) {
+            callback(i);
+        }
+    });
+}